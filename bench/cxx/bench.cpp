@@ -0,0 +1,151 @@
+// Benchmarks the shard core (src/shard.hpp) without node: load, decode,
+// lookup and pack on generated shards.
+//
+// Usage: build/cxx/bench [ids per shard = 10000] [shards = 16] [iterations = 5]
+//
+// Array lengths are skewed like real indexes: most ids hold a few values
+// and a few hold many. Shards are checked to survive a load and pack round
+// trip before anything is timed.
+
+#include "shard.hpp"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <string>
+#include <vector>
+
+using namespace binding;
+
+typedef std::chrono::steady_clock clock_type;
+
+static double seconds_since(clock_type::time_point start) {
+    return std::chrono::duration<double>(clock_type::now() - start).count();
+}
+
+static void report(const char * name, double count, const char * unit, double seconds) {
+    std::printf("%-8s x %14.0f %s/sec\n", name, count / seconds, unit);
+}
+
+static std::string pack_buffer(carmen::proto::object const& message) {
+    std::string out;
+    if (!message.SerializeToString(&out)) {
+        std::fprintf(stderr, "failed to serialize shard\n");
+        std::exit(1);
+    }
+    return out;
+}
+
+int main(int argc, char ** argv) {
+    std::size_t ids = argc > 1 ? std::strtoul(argv[1], NULL, 10) : 10000;
+    std::size_t shards = argc > 2 ? std::strtoul(argv[2], NULL, 10) : 16;
+    std::size_t iterations = argc > 3 ? std::strtoul(argv[3], NULL, 10) : 5;
+    if (!ids || !shards || !iterations) {
+        std::fprintf(stderr, "usage: %s [ids per shard] [shards] [iterations]\n", argv[0]);
+        return 1;
+    }
+
+    std::mt19937_64 rng(1);
+    std::uniform_real_distribution<double> uniform(0.0, 1.0);
+
+    // Generate shards of 32-bit ids mapped to arrays of 52-bit values.
+    std::vector<std::string> buffers(shards);
+    std::vector<std::vector<uint32_t> > shard_ids(shards);
+    std::size_t bytes = 0, values = 0;
+    for (std::size_t s = 0; s < shards; ++s) {
+        arraycache arrc;
+        while (arrc.size() < ids) {
+            uint32_t id = static_cast<uint32_t>(rng());
+            intarray & array = arrc[id];
+            if (!array.empty()) continue;
+            double u = uniform(rng);
+            std::size_t length = 1 + static_cast<std::size_t>(u * u * u * u * 64);
+            for (std::size_t i = 0; i < length; ++i) {
+                array.push_back(rng() & 0xfffffffffffffULL);
+            }
+            values += length;
+            shard_ids[s].push_back(id);
+        }
+        carmen::proto::object message;
+        pack_arrays(arrc, message);
+        buffers[s] = pack_buffer(message);
+        bytes += buffers[s].size();
+
+        // round trip
+        larraycache larrc;
+        load_into_cache(larrc, buffers[s].data(), buffers[s].size());
+        carmen::proto::object repacked;
+        pack_arrays(larrc, repacked);
+        if (larrc.size() != arrc.size() || pack_buffer(repacked) != buffers[s]) {
+            std::fprintf(stderr, "shard %u does not round trip\n", static_cast<unsigned>(s));
+            return 1;
+        }
+    }
+    std::printf("%u shards, %u ids, %u values, %.1f MB\n",
+                static_cast<unsigned>(shards),
+                static_cast<unsigned>(ids * shards),
+                static_cast<unsigned>(values),
+                static_cast<double>(bytes) / 1048576);
+
+    std::vector<larraycache> loaded(shards);
+    clock_type::time_point start = clock_type::now();
+    for (std::size_t n = 0; n < iterations; ++n) {
+        for (std::size_t s = 0; s < shards; ++s) {
+            larraycache larrc;
+            load_into_cache(larrc, buffers[s].data(), buffers[s].size());
+            if (n + 1 == iterations) loaded[s].swap(larrc);
+        }
+    }
+    double elapsed = seconds_since(start);
+    report("load", static_cast<double>(bytes * iterations) / 1048576, "MB", elapsed);
+    report("load", static_cast<double>(ids * shards * iterations), "ids", elapsed);
+
+    std::size_t decoded = 0;
+    start = clock_type::now();
+    for (std::size_t n = 0; n < iterations; ++n) {
+        for (std::size_t s = 0; s < shards; ++s) {
+            larraycache::const_iterator itr = loaded[s].begin();
+            for (; itr != loaded[s].end(); ++itr) {
+                intarray array;
+                decode_array(itr->second, array);
+                decoded += array.size();
+            }
+        }
+    }
+    report("decode", static_cast<double>(decoded), "values", seconds_since(start));
+
+    // Lookups of random ids, one in ten missing.
+    std::size_t lookups = ids * shards * iterations, found = 0;
+    std::vector<std::pair<std::size_t,uint32_t> > keys(lookups);
+    for (std::size_t i = 0; i < lookups; ++i) {
+        std::size_t s = rng() % shards;
+        uint32_t id = i % 10 ? shard_ids[s][rng() % ids] : static_cast<uint32_t>(rng());
+        keys[i] = std::make_pair(s, id);
+    }
+    start = clock_type::now();
+    for (std::size_t i = 0; i < lookups; ++i) {
+        larraycache const& larrc = loaded[keys[i].first];
+        larraycache::const_iterator itr = larrc.find(keys[i].second);
+        if (itr == larrc.end()) continue;
+        intarray array;
+        decode_array(itr->second, array);
+        found += !array.empty();
+    }
+    report("lookup", static_cast<double>(lookups), "ops", seconds_since(start));
+
+    std::size_t packed = 0;
+    start = clock_type::now();
+    for (std::size_t n = 0; n < iterations; ++n) {
+        for (std::size_t s = 0; s < shards; ++s) {
+            carmen::proto::object message;
+            pack_arrays(loaded[s], message);
+            packed += pack_buffer(message).size();
+        }
+    }
+    report("pack", static_cast<double>(packed) / 1048576, "MB", seconds_since(start));
+
+    // keep the optimizer from dropping the loops above
+    if (decoded + found + packed == 0) return 1;
+    return 0;
+}
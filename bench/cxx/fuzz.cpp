@@ -0,0 +1,116 @@
+// Fuzz target for shard buffers, libFuzzer compatible.
+//
+// Any input may be rejected with an exception, but none may crash or read
+// out of bounds, and whatever is accepted must pack into a shard that loads
+// back to the same arrays.
+//
+// Built with -DCARMEN_FUZZ_MAIN the target gets its own driver for
+// compilers without libFuzzer: it runs each file named on the command line,
+// or with no files, a number of random mutations of generated shards.
+
+#include "shard.hpp"
+
+#include <cstdio>
+#include <cstdlib>
+#include <exception>
+#include <string>
+
+using namespace binding;
+
+static void decode_all(larraycache const& larrc, arraycache & arrc) {
+    larraycache::const_iterator itr = larrc.begin();
+    for (; itr != larrc.end(); ++itr) {
+        decode_array(itr->second, arrc[static_cast<uint32_t>(itr->first)]);
+    }
+}
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t * data, std::size_t size) {
+    larraycache larrc;
+    arraycache arrc;
+    try {
+        load_into_cache(larrc, reinterpret_cast<const char *>(data), size);
+        decode_all(larrc, arrc);
+    } catch (std::exception const&) {
+        return 0;
+    }
+
+    // What was accepted must round trip.
+    std::string buffer;
+    carmen::proto::object message;
+    pack_arrays(larrc, message);
+    if (!message.SerializeToString(&buffer)) std::abort();
+    larraycache reloaded;
+    arraycache redecoded;
+    load_into_cache(reloaded, buffer.data(), buffer.size());
+    decode_all(reloaded, redecoded);
+    if (reloaded.size() != larrc.size() || redecoded != arrc) std::abort();
+    return 0;
+}
+
+#ifdef CARMEN_FUZZ_MAIN
+
+#include <fstream>
+#include <iterator>
+#include <random>
+
+static int run(std::string const& input) {
+    return LLVMFuzzerTestOneInput(reinterpret_cast<const uint8_t *>(input.data()), input.size());
+}
+
+int main(int argc, char ** argv) {
+    if (argc > 1) {
+        for (int i = 1; i < argc; ++i) {
+            std::ifstream file(argv[i], std::ios::binary);
+            if (!file) {
+                std::fprintf(stderr, "cannot read %s\n", argv[i]);
+                return 1;
+            }
+            run(std::string(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>()));
+        }
+        std::printf("%d inputs\n", argc - 1);
+        return 0;
+    }
+
+    const unsigned runs = 200000;
+    std::mt19937_64 rng(1);
+    std::string seed;
+    for (unsigned n = 0; n < runs; ++n) {
+        // a fresh valid shard every so often, mutated from then on
+        if (n % 1000 == 0) {
+            arraycache arrc;
+            std::size_t ids = 1 + rng() % 32;
+            for (std::size_t i = 0; i < ids; ++i) {
+                intarray & array = arrc[static_cast<uint32_t>(rng())];
+                std::size_t length = rng() % 8;
+                for (std::size_t j = 0; j < length; ++j) array.push_back(rng() >> (rng() % 64));
+            }
+            carmen::proto::object message;
+            pack_arrays(arrc, message);
+            message.SerializeToString(&seed);
+        }
+        std::string input(seed);
+        std::size_t edits = 1 + rng() % 4;
+        for (std::size_t e = 0; e < edits && !input.empty(); ++e) {
+            std::size_t pos = rng() % input.size();
+            switch (rng() % 4) {
+                case 0: // flip a bit
+                    input[pos] = static_cast<char>(input[pos] ^ (1 << (rng() % 8)));
+                    break;
+                case 1: // overwrite a byte, favouring varint continuations
+                    input[pos] = static_cast<char>(rng() % 2 ? 0xff : rng());
+                    break;
+                case 2: // truncate
+                    input.resize(pos);
+                    break;
+                case 3: // insert a byte
+                    input.insert(pos, 1, static_cast<char>(rng()));
+                    break;
+            }
+        }
+        run(input);
+    }
+    std::printf("%u runs\n", runs);
+    return 0;
+}
+
+#endif
@@ -0,0 +1,180 @@
+var EventEmitter = require('events').EventEmitter,
+    inherits = require('util').inherits,
+    sm = new (require('sphericalmercator'))(),
+    fnv1a = require('../lib/util/fnv');
+
+module.exports = SyntheticSource;
+
+inherits(SyntheticSource, EventEmitter);
+
+// A carmen source of generated documents, used by bench/synthetic.js.
+//
+// Documents are generated from their number and `seed` alone, so any
+// document can be regenerated without storing it. Their text is made of
+// pseudo-words drawn from a vocabulary of `vocab` words with a Zipf
+// distribution (exponent `skew`): a few words are very common and most
+// are rare, like the terms of real place names. Index shards are kept in
+// memory, see lib/api-mem.js.
+//
+// Options:
+// - `features`: number of documents (default 10000)
+// - `vocab`: vocabulary size (default features / 4, at most 200000)
+// - `skew`: Zipf exponent (default 1.1)
+// - `seed`: seed for generated data (default 1)
+// - `maxzoom`: zoom of document tiles (default 6)
+// - `shardlevel`: index shardlevel (default 1)
+// - `batch`: documents per getIndexableDocs call (default 10000)
+function SyntheticSource(options, callback) {
+    options = options || {};
+    this.features = options.features || 10000;
+    this.vocab = options.vocab || Math.min(200000, Math.max(100, Math.ceil(this.features / 4)));
+    this.skew = options.skew || 1.1;
+    this.seed = options.seed || 1;
+    this.maxzoom = options.maxzoom || 6;
+    this.batch = options.batch || 10000;
+    this._info = {
+        maxzoom: this.maxzoom,
+        shardlevel: options.shardlevel === undefined ? 1 : options.shardlevel
+    };
+    this._shards = options._shards || {};
+    this._cdf = options._cdf || zipf(this.vocab, this.skew);
+    this.open = true;
+    if (callback) callback(null, this);
+}
+
+// A source reading the same index shards, with nothing cached.
+SyntheticSource.prototype.clone = function() {
+    return new SyntheticSource({
+        features: this.features,
+        vocab: this.vocab,
+        skew: this.skew,
+        seed: this.seed,
+        maxzoom: this.maxzoom,
+        batch: this.batch,
+        shardlevel: this._info.shardlevel,
+        _shards: this._shards,
+        _cdf: this._cdf
+    });
+};
+
+// Document `i` (0-based), with ids starting at 1.
+SyntheticSource.prototype.doc = function(i) {
+    var rand = random(fnv1a(this.seed + '/' + i));
+    var synonyms = rand() < 0.1 ? 2 : 1;
+    var texts = [];
+    for (var s = 0; s < synonyms; s++) {
+        var count = 1 + Math.floor(Math.pow(rand(), 2) * 4);
+        var words = [];
+        for (var w = 0; w < count; w++) words.push(this.word(this.sample(rand())));
+        texts.push(words.join(' '));
+    }
+    var lon = rand() * 360 - 180,
+        lat = rand() * 170 - 85,
+        xyz = sm.xyz([lon, lat, lon, lat], this.maxzoom);
+    return {
+        _id: i + 1,
+        _text: texts.join(','),
+        _center: [lon, lat],
+        _zxy: [this.maxzoom + '/' + xyz.minX + '/' + xyz.minY]
+    };
+};
+
+// Vocabulary rank for a uniform random number.
+SyntheticSource.prototype.sample = function(u) {
+    var cdf = this._cdf, lo = 0, hi = cdf.length - 1;
+    while (lo < hi) {
+        var mid = (lo + hi) >> 1;
+        if (cdf[mid] < u) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+};
+
+// Pseudo-word of a vocabulary rank. Syllables are two letters so distinct
+// ranks give distinct words.
+var syllables = ['ba','ko','ri','te','mu','sa','lo','ne','di','fa','gu','pe','vi','zo','ha','ju'];
+SyntheticSource.prototype.word = function(rank) {
+    var word = syllables[rank % 7 + 9];
+    do {
+        word += syllables[rank % 16];
+        rank = Math.floor(rank / 16);
+    } while (rank);
+    return word;
+};
+
+SyntheticSource.prototype.getInfo = function(callback) {
+    callback(null, this._info);
+};
+
+SyntheticSource.prototype.putInfo = function(info, callback) {
+    for (var key in info) this._info[key] = info[key];
+    callback(null);
+};
+
+SyntheticSource.prototype.getIndexableDocs = function(pointer, callback) {
+    pointer = pointer || {};
+    var offset = pointer.offset || 0,
+        end = Math.min(this.features, offset + this.batch),
+        docs = [];
+    for (var i = offset; i < end; i++) docs.push(this.doc(i));
+    callback(null, docs, { offset: end });
+};
+
+SyntheticSource.prototype.getGeocoderData = function(type, shard, callback) {
+    callback(null, this._shards[type] && this._shards[type][shard]);
+};
+
+SyntheticSource.prototype.putGeocoderData = function(type, shard, data, callback) {
+    if (this._shards[type] === undefined) this._shards[type] = {};
+    this._shards[type][shard] = data;
+    callback(null);
+};
+
+// UTFGrid for context lookups: every pixel of a tile maps to one document
+// picked from the tile coordinates.
+SyntheticSource.prototype.getGrid = function(z, x, y, callback) {
+    var i = (x * 7919 + y * 104729) % this.features,
+        doc = this.doc(i),
+        data = {};
+    data[doc._id] = { _id: doc._id, _text: doc._text };
+    callback(null, {
+        grid: fullgrid,
+        keys: ['', String(doc._id)],
+        data: data
+    });
+};
+
+SyntheticSource.prototype.startWriting = function(callback) {
+    callback(null);
+};
+
+SyntheticSource.prototype.stopWriting = function(callback) {
+    callback(null);
+};
+
+// 64 rows of '!', the UTFGrid encoding of key 1.
+var fullgrid = [];
+for (var row = 0; row < 64; row++) fullgrid.push(new Array(65).join('!'));
+
+// Cumulative Zipf distribution over `n` ranks.
+function zipf(n, s) {
+    var cdf = new Float64Array(n), total = 0, i;
+    for (i = 0; i < n; i++) total += 1 / Math.pow(i + 1, s);
+    var sum = 0;
+    for (i = 0; i < n; i++) {
+        sum += 1 / Math.pow(i + 1, s) / total;
+        cdf[i] = sum;
+    }
+    cdf[n - 1] = 1;
+    return cdf;
+}
+
+// Park-Miller generator, returns numbers in [0, 1).
+function random(seed) {
+    var state = seed % 2147483647;
+    if (state <= 0) state += 2147483646;
+    return function() {
+        state = state * 16807 % 2147483647;
+        return (state - 1) / 2147483646;
+    };
+}
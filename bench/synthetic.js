@@ -0,0 +1,338 @@
+#!/usr/bin/env node
+
+// Synthetic benchmark suite. Builds an index of generated documents (see
+// bench/synthetic-source.js) at a chosen scale and measures:
+//
+// - index: time to build the index
+// - shardload: time to loadSync every stored shard, per type
+// - get: `_get` lookups per second on loaded shards, through the cache
+//   and through a type handle
+// - getall: ids per second through getall, against an empty cache (cold)
+//   and once its shards are loaded (warm)
+// - geocode, context: queries per second and p50/p99/p999 latency, for a
+//   first (cold) and second (warm) pass over the same queries, and for
+//   geocode the per-stage metrics of the geocoder
+// - peak RSS, overall and per stage
+//
+// Results are written as JSON to stdout, or to --out, so runs can be
+// compared across commits.
+//
+// Usage: bench/synthetic.js [--features 10000] [--vocab n] [--skew 1.1]
+//   [--shardlevel 1] [--seed 1] [--queries 1000] [--concurrency 16]
+//   [--gets 100000] [--threads n] [--spill] [--out file.json] [--quiet]
+
+var argv = require('minimist')(process.argv.slice(2)),
+    fs = require('fs'),
+    os = require('os'),
+    exec = require('child_process').exec,
+    queue = require('queue-async'),
+    Carmen = require('..'),
+    Cache = require('../lib/util/cxxcache'),
+    context = require('../lib/context'),
+    SyntheticSource = require('./synthetic-source');
+
+var options = {
+    features: +argv.features || 10000,
+    vocab: +argv.vocab || undefined,
+    skew: +argv.skew || 1.1,
+    shardlevel: argv.shardlevel === undefined ? 1 : +argv.shardlevel,
+    seed: +argv.seed || 1,
+    queries: +argv.queries || 1000,
+    concurrency: +argv.concurrency || 16,
+    gets: +argv.gets || 100000,
+    threads: +argv.threads || os.cpus().length,
+    spill: !!argv.spill
+};
+
+var types = ['freq', 'term', 'phrase', 'grid', 'degen'];
+
+var result = {
+    options: options,
+    env: {
+        node: process.version,
+        platform: process.platform,
+        arch: process.arch,
+        cpus: os.cpus().length,
+        date: new Date().toISOString()
+    },
+    stages: {}
+};
+
+// Peak RSS, sampled while stages run.
+var rss = { peak: 0, stage: 0 };
+function sample() {
+    var current = process.memoryUsage().rss;
+    rss.peak = Math.max(rss.peak, current);
+    rss.stage = Math.max(rss.stage, current);
+}
+var sampler = setInterval(sample, 20);
+
+var source = new SyntheticSource({
+    features: options.features,
+    vocab: options.vocab,
+    skew: options.skew,
+    seed: options.seed,
+    shardlevel: options.shardlevel
+});
+options.vocab = source.vocab;
+
+var q = queue(1);
+q.defer(commit);
+q.defer(stage, 'index', buildIndex);
+q.defer(stage, 'shardload', shardload);
+q.defer(stage, 'get', get);
+q.defer(stage, 'getall', getall);
+q.defer(stage, 'geocode', geocode);
+q.defer(stage, 'context', reverse);
+q.awaitAll(function(err) {
+    clearInterval(sampler);
+    if (err) throw err;
+    sample();
+    result.rss = rss.peak;
+    var json = JSON.stringify(result, null, 2);
+    if (argv.out) fs.writeFileSync(argv.out, json + '\n');
+    else console.log(json);
+});
+
+// Record the commit being measured, if any.
+function commit(callback) {
+    exec('git rev-parse HEAD', { cwd: __dirname }, function(err, stdout) {
+        if (!err) result.env.commit = stdout.trim();
+        callback();
+    });
+}
+
+// Run a stage and record its results, duration and peak RSS.
+function stage(name, fn, callback) {
+    if (!argv.quiet) console.error('# ' + name);
+    rss.stage = 0;
+    sample();
+    var start = process.hrtime();
+    fn(function(err, stats) {
+        if (err) return callback(err);
+        sample();
+        stats = stats || {};
+        stats.ms = ms(process.hrtime(start));
+        stats.rss = rss.stage;
+        result.stages[name] = stats;
+        callback();
+    });
+}
+
+function buildIndex(callback) {
+    var carmen = new Carmen({ synthetic: source });
+    var opts = { threads: options.threads, shardlevel: options.shardlevel };
+    if (options.spill) opts.spill = {};
+    carmen.index(source, source, opts, function(err) {
+        if (err) return callback(err);
+        var stats = { shards: {}, bytes: {} };
+        types.forEach(function(type) {
+            var shards = source._shards[type] || {};
+            stats.shards[type] = Object.keys(shards).length;
+            stats.bytes[type] = 0;
+            for (var s in shards) stats.bytes[type] += shards[s].length;
+        });
+        callback(null, stats);
+    });
+}
+
+// A cache with every stored shard loaded.
+var loaded;
+
+function shardload(callback) {
+    var stats = {};
+    loaded = new Cache('synthetic', options.shardlevel);
+    types.forEach(function(type) {
+        var shards = source._shards[type] || {},
+            bytes = 0,
+            count = 0,
+            start = process.hrtime();
+        for (var s in shards) {
+            loaded.loadSync(shards[s], type, +s);
+            bytes += shards[s].length;
+            count++;
+        }
+        var elapsed = ms(process.hrtime(start));
+        stats[type] = {
+            shards: count,
+            bytes: bytes,
+            ms: elapsed,
+            mbps: elapsed ? bytes / 1048576 / (elapsed / 1000) : null
+        };
+    });
+    callback(null, stats);
+}
+
+function get(callback) {
+    var stats = {};
+    ['phrase', 'grid', 'term'].forEach(function(type) {
+        var keys = sampleKeys(loaded, type, 10000);
+        if (!keys.length) return;
+        var handle = loaded.handle(type), i, k, start;
+
+        start = process.hrtime();
+        for (i = 0; i < options.gets; i++) {
+            k = keys[i % keys.length];
+            loaded._get(type, k[0], k[1]);
+        }
+        var cache = ms(process.hrtime(start));
+
+        start = process.hrtime();
+        for (i = 0; i < options.gets; i++) {
+            k = keys[i % keys.length];
+            handle._get(k[0], k[1]);
+        }
+        var handled = ms(process.hrtime(start));
+
+        stats[type] = {
+            ops: options.gets,
+            cache: options.gets / (cache / 1000),
+            handle: options.gets / (handled / 1000)
+        };
+    });
+    callback(null, stats);
+}
+
+function getall(callback) {
+    var keys = sampleKeys(loaded, 'phrase', 10000).map(function(k) { return k[1]; }),
+        batches = [];
+    if (!keys.length) return callback(null, {});
+    for (var i = 0; i < keys.length; i += 100) batches.push(keys.slice(i, i + 100));
+
+    var cache = new Cache('synthetic', options.shardlevel),
+        getter = source.getGeocoderData.bind(source),
+        stats = {};
+
+    run('cold', function(err) {
+        if (err) return callback(err);
+        run('warm', function(err) {
+            callback(err, stats);
+        });
+    });
+
+    function run(name, callback) {
+        var start = process.hrtime(),
+            q = queue(options.concurrency);
+        batches.forEach(function(batch) {
+            q.defer(cache.getall.bind(cache), getter, 'phrase', batch);
+        });
+        q.awaitAll(function(err) {
+            if (err) return callback(err);
+            var elapsed = ms(process.hrtime(start));
+            stats[name] = { ids: keys.length, ms: elapsed, idsps: keys.length / (elapsed / 1000) };
+            callback();
+        });
+    }
+}
+
+// Queries are the full text or the first word of random documents.
+function geocode(callback) {
+    var carmen = new Carmen({ synthetic: source.clone() }),
+        rand = random(options.seed),
+        queries = [];
+    for (var i = 0; i < options.queries; i++) {
+        var doc = source.doc(Math.floor(rand() * options.features)),
+            text = doc._text.split(',')[0];
+        queries.push(rand() < 0.5 ? text : text.split(' ')[0]);
+    }
+    passes(queries, function(query, callback) {
+        carmen.geocode(query, {}, callback);
+    }, function(err, stats) {
+        if (err) return callback(err);
+        // per-stage latency over both passes
+        stats.metrics = carmen.metrics();
+        callback(null, stats);
+    });
+}
+
+function reverse(callback) {
+    var carmen = new Carmen({ synthetic: source.clone() }),
+        rand = random(options.seed + 1),
+        points = [];
+    for (var i = 0; i < options.queries; i++) {
+        points.push([rand() * 360 - 180, rand() * 170 - 85]);
+    }
+    carmen._open(function(err) {
+        if (err) return callback(err);
+        passes(points, function(point, callback) {
+            context(carmen, point[0], point[1], null, true, callback);
+        }, callback);
+    });
+}
+
+// Run `fn` over `inputs` twice, reporting each pass.
+function passes(inputs, fn, callback) {
+    var stats = {};
+    latency(inputs, fn, function(err, cold) {
+        if (err) return callback(err);
+        stats.cold = cold;
+        latency(inputs, fn, function(err, warm) {
+            if (err) return callback(err);
+            stats.warm = warm;
+            callback(null, stats);
+        });
+    });
+}
+
+// Run `fn` over `inputs`, `options.concurrency` at a time, and report
+// throughput and latency percentiles in milliseconds.
+function latency(inputs, fn, callback) {
+    var times = [],
+        start = process.hrtime(),
+        q = queue(options.concurrency);
+    inputs.forEach(function(input) {
+        q.defer(function(callback) {
+            var t = process.hrtime();
+            fn(input, function(err) {
+                if (err) return callback(err);
+                times.push(ms(process.hrtime(t)));
+                callback();
+            });
+        });
+    });
+    q.awaitAll(function(err) {
+        if (err) return callback(err);
+        var elapsed = ms(process.hrtime(start));
+        times.sort(function(a, b) { return a - b; });
+        callback(null, {
+            count: times.length,
+            qps: times.length / (elapsed / 1000),
+            p50: percentile(times, 0.5),
+            p99: percentile(times, 0.99),
+            p999: percentile(times, 0.999),
+            max: times[times.length - 1]
+        });
+    });
+}
+
+// Up to `count` [shard, id] pairs of a type in a cache.
+function sampleKeys(cache, type, count) {
+    var keys = [],
+        shards = cache.list(type);
+    for (var i = 0; i < shards.length && keys.length < count; i++) {
+        var ids = cache.list(type, shards[i]);
+        for (var j = 0; j < ids.length && keys.length < count; j++) {
+            keys.push([shards[i], +ids[j]]);
+        }
+    }
+    return keys;
+}
+
+function percentile(sorted, p) {
+    if (!sorted.length) return null;
+    return sorted[Math.min(sorted.length - 1, Math.floor(sorted.length * p))];
+}
+
+function ms(hrtime) {
+    return hrtime[0] * 1e3 + hrtime[1] / 1e6;
+}
+
+// Park-Miller generator, returns numbers in [0, 1).
+function random(seed) {
+    var state = (seed * 48271) % 2147483647;
+    if (state <= 0) state += 2147483646;
+    return function() {
+        state = state * 16807 % 2147483647;
+        return (state - 1) / 2147483646;
+    };
+}
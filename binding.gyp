@@ -26,6 +26,11 @@
       'dependencies': [ 'action_before_build' ],
       'sources': [
         "./src/binding.cpp",
+        "./src/querycache.cpp",
+        "./src/indexer.cpp",
+        "./src/cachehandle.cpp",
+        "./src/shard.cpp",
+        "./src/metrics.cpp",
         "<(SHARED_INTERMEDIATE_DIR)/index.pb.cc"
       ],
       "include_dirs" : [
@@ -3,6 +3,8 @@ var path = require('path'),
     queue = require('queue-async');
 
 var Cache = require('./lib/util/cxxcache'),
+    QueryCache = require('./lib/util/querycache'),
+    Metrics = require('./lib/util/metrics'),
     getSearch = require('./lib/search'),
     getContext = require('./lib/context'),
     loader = require('./lib/loader'),
@@ -16,11 +18,17 @@ require('util').inherits(Geocoder, EventEmitter);
 module.exports = Geocoder;
 
 // Initialize and load Geocoder, with a selection of indexes.
-function Geocoder(options) {
+//
+// `config` is optional and may contain:
+// - `querycache`: `{ size: bytes, shards: n }` to cache geocode results
+//   for repeated queries.
+function Geocoder(options, config) {
     if (!options) throw new Error('Geocoder options required.');
+    config = config || {};
 
     var q = queue(),
-        indexes = pairs(options);
+        indexes = pairs(options),
+        metrics = this._metrics = new Metrics(Metrics.stages);
 
     indexes.forEach(function(index) {
         q.defer(loadIndex, index);
@@ -34,6 +42,10 @@ function Geocoder(options) {
 
     this.indexes = indexes.reduce(toObject, {});
 
+    if (config.querycache) this._querycache = new QueryCache(
+        config.querycache.size || 64 * 1024 * 1024,
+        config.querycache.shards || 16);
+
     function loadIndex(sourceindex, callback) {
         var source = sourceindex[1],
             key = sourceindex[0];
@@ -59,6 +71,7 @@ function Geocoder(options) {
             source._geocoder.format = info.format || '';
             source._geocoder.name = key;
             source._geocoder.idx = Object.keys(options).indexOf(key);
+            source._geocoder.recorder = new Metrics.Recorder(metrics);
             return callback();
         }
     }
@@ -88,6 +101,8 @@ Geocoder.prototype._open = function(callback) {
 //
 // `query` is a string of text, like "Chester, NJ"
 // `options` is an object with additional parameters
+// `options.trace` may be a function called with the timings of each stage
+// of this query, see lib/geocode.js.
 // `callback` is called with (error, results)
 Geocoder.prototype.geocode = function(query, options, callback) {
     if (!this._opened) {
@@ -99,6 +114,14 @@ Geocoder.prototype.geocode = function(query, options, callback) {
     return geocode(this, query, options, callback);
 };
 
+// Latency of each stage of the geocodes run so far, see
+// lib/util/metrics.js. Pass `reset` to start over once read.
+Geocoder.prototype.metrics = function(reset) {
+    var stats = this._metrics.stats();
+    if (reset) this._metrics.reset();
+    return stats;
+};
+
 // Search a carmen source for features matching query.
 Geocoder.prototype.search = function(source, query, callback) {
     if (!this._opened) {
@@ -158,3 +181,12 @@ Geocoder.prototype.wipe = function(source, callback) {
 
 Geocoder.auto = loader.auto;
 Geocoder.autodir = loader.autodir;
+
+// Maximum number of index shard fetches in flight at once. The limit is
+// shared by every geocoder in the process, so it is set here rather than
+// per geocoder.
+Object.defineProperty(Geocoder, 'concurrency', {
+    enumerable: true,
+    get: function() { return Cache.concurrency; },
+    set: function(concurrency) { Cache.concurrency = concurrency; }
+});
@@ -2,11 +2,17 @@ var sm = new (require('sphericalmercator'))(),
     ops = require('./util/ops'),
     context = require('./context'),
     termops = require('./util/termops'),
+    QueryCache = require('./util/querycache'),
+    Metrics = require('./util/metrics'),
     getSetRelevance = require('./pure/setrelevance'),
     sortByRelevance = require('./relevsort'),
     queue = require('queue-async'),
     DEBUG = process.env.DEBUG;
 
+// Stages are timed into `geocoder._metrics`. When `options.trace` is a
+// function it is called before `callback` with `{ query, ms, stages }`,
+// `stages` listing every timed stage of this query as
+// `{ stage, source, ms }`, see lib/util/metrics.js.
 module.exports = function(geocoder, query, options, callback) {
     options = options || {};
     options.stats = options.stats || false;
@@ -20,30 +26,64 @@ module.exports = function(geocoder, query, options, callback) {
         type: 'FeatureCollection',
         query: termops.tokenize(query, true)
     };
-    var q = queue();
+    var q = queue(),
+        start = process.hrtime(),
+        recorder = new Metrics.Recorder(geocoder._metrics, typeof options.trace === 'function');
 
-    stats.totalTime = +new Date();
+    // Serve repeated queries from the result cache when one is configured.
+    var querycache = geocoder._querycache,
+        cachekey,
+        generation;
+    if (querycache) {
+        cachekey = QueryCache.key(queryData.query, options);
+        generation = QueryCache.generation(indexes);
+        var cached = querycache.get(cachekey, generation);
+        if (cached !== undefined) {
+            try {
+                queryData = JSON.parse(cached);
+            } catch (err) {
+                return callback(err);
+            }
+            stats.totalTime = recorder.time('total', start);
+            stats.cache = querycache.stats();
+            if (options.stats) queryData.stats = stats;
+            trace();
+            return process.nextTick(function() {
+                callback(null, queryData);
+            });
+        }
+    }
+
+    // Read every index through a snapshot so that shards already loaded
+    // are read at their current version even if reloaded mid query.
+    // Context lookups read `view`, the geocoder with the snapshots as its
+    // indexes.
+    indexes = snapshot(indexes, recorder);
+    callback = release(indexes, callback);
+    var view = Object.create(geocoder);
+    view.indexes = indexes;
 
     // lon,lat pair. Provide the context for this location.
     if (queryData.query.length === 2 &&
         'number' === typeof queryData.query[0] &&
         'number' === typeof queryData.query[1]) {
-        return context(geocoder, queryData.query[0], queryData.query[1], null, true, function(err, context) {
+        var contextStart = process.hrtime();
+        return context(view, queryData.query[0], queryData.query[1], null, true, function(err, context) {
             if (err) return callback(err);
+            recorder.time('context', contextStart);
             context._relevance = 1;
             queryData.features = [];
             while (context.length) {
                 queryData.features.push(ops.toFeature(context));
                 context.shift();
             }
-            stats.totalTime = (+new Date()) - stats.totalTime;
-            if (options.stats) queryData.stats = stats;
-            return callback(null, queryData);
+            stats.totalTime = recorder.time('total', start);
+            return done();
         });
     }
 
     // keyword search. Find matching features.
-    stats.searchTime = +new Date();
+    var searchStart = process.hrtime();
 
     // search runs `geocoder.search` over each backend with `data.query`,
     // condenses all of the results, and sorts them by potential usefulness.
@@ -62,18 +102,19 @@ module.exports = function(geocoder, query, options, callback) {
         }
 
         zooms = zooms.sort(sortNumeric);
-        stats.searchTime = +new Date() - stats.searchTime;
+        stats.searchTime = Metrics.elapsed(searchStart);
         stats.searchCount = grids.reduce(function(sum, v) {
             return sum + v.length;
         }, 0);
-        stats.relevTime = +new Date();
         searchComplete(null, feats, grids, zooms);
     });
 
     function loadType(dbname, callback) {
+        var start = process.hrtime();
         geocoder.search(indexes[dbname], queryData.query.join(' '), searchLoaded);
         function searchLoaded(err, feat, grid, s) {
             if (err) return callback(err);
+            recorder.time('search', start, dbname);
             if (grid.length) {
                 var z = indexes[dbname]._geocoder.zoom;
                 if (zooms.indexOf(z) === -1) zooms.push(z);
@@ -94,18 +135,55 @@ module.exports = function(geocoder, query, options, callback) {
     // @param {Array} zooms a list of zoom numbers
     function searchComplete(err, feats, grids, zooms) {
         if (err) return callback(err);
-        sortByRelevance(indexes, types, queryData.query, stats, geocoder, feats, grids, zooms, function(err, contexts) {
+        sortByRelevance(indexes, types, queryData.query, stats, recorder, view, feats, grids, zooms, function(err, contexts) {
             if (err) return callback(err);
 
             queryData.features = contexts.slice(0, options.limit).map(ops.toFeature);
             stats.relev = contexts.length ? contexts[0]._relevance : 0;
-            stats.totalTime = (+new Date()) - stats.totalTime;
-
-            if (options.stats) queryData.stats = stats;
+            stats.totalTime = recorder.time('total', start);
 
-            return callback(null, queryData);
+            return done();
         });
     }
+
+    // Store the result in the result cache (without per-request stats)
+    // and return it.
+    function done() {
+        if (querycache) {
+            querycache.set(cachekey, JSON.stringify(queryData), generation);
+            stats.cache = querycache.stats();
+        }
+        if (options.stats) queryData.stats = stats;
+        trace();
+        return callback(null, queryData);
+    }
+
+    function trace() {
+        if (!recorder.trace) return;
+        options.trace({ query: query, ms: stats.totalTime, stages: recorder.trace });
+    }
 };
 
 function sortNumeric(a,b) { return a < b ? -1 : 1; }
+
+// Wrap each source with one whose `_geocoder` is a snapshot of the source's
+// cache, timed through `recorder`. Everything else is read from the source
+// itself.
+function snapshot(indexes, recorder) {
+    var snap = {};
+    for (var name in indexes) {
+        snap[name] = Object.create(indexes[name]);
+        snap[name]._geocoder = indexes[name]._geocoder.snapshot();
+        snap[name]._geocoder.recorder = recorder;
+    }
+    return snap;
+}
+
+// Wrap `callback` to release the snapshots of `indexes` once the query is
+// done rather than leave their shards pinned until they are collected.
+function release(indexes, callback) {
+    return function(err, data) {
+        for (var name in indexes) indexes[name]._geocoder.release();
+        callback(err, data);
+    };
+}
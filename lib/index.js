@@ -2,6 +2,8 @@ var termops = require('./util/termops'),
     feature = require('./util/feature'),
     uniq = require('./util/uniq'),
     ops = require('./util/ops'),
+    Indexer = require('./util/indexer'),
+    os = require('os'),
     queue = require('queue-async'),
     DEBUG = process.env.DEBUG;
 
@@ -16,6 +18,12 @@ function index(geocoder, from, to, options, callback) {
 
     to.startWriting(function(err) {
         if (err) return callback(err);
+        to._geocoder._indexer = options.spill ?
+            new Indexer(options.threads || os.cpus().length, {
+                dir: options.spill.dir || os.tmpdir(),
+                memory: options.spill.memory
+            }) :
+            new Indexer(options.threads || os.cpus().length);
         if (options.shardlevel) {
             to.putInfo({shardlevel:options.shardlevel}, function(err) {
                 if (err) return callback(err);
@@ -48,52 +56,69 @@ function index(geocoder, from, to, options, callback) {
 
 // # Update
 //
-// Updates the source's index with provided docs.
+// Updates the source's index with provided docs. Docs are tokenized here,
+// term hashing, frequency counting and building postings run natively
+// across threads (see src/indexer.cpp). When the indexer spills to disk
+// postings are set aside in run files instead of being merged into the
+// cache, and are only merged into shards by store().
 //
 // @param {Object} source - a Carmen source
 // @param {Array} docs - an array of documents
 // @param {Function} callback
 function update(source, docs, callback) {
-    source._geocoder._known = source._geocoder._known || { term:{} };
-    var known = source._geocoder._known;
-
-    // First pass over docs.
-    // - Creates termsets (one or more arrays of termids) from document text.
-    // - Tallies frequency of termids against current frequencies compiling a
-    //   final in-memory frequency count of all terms involved with this set of
-    //   documents to be indexed.
-    // - Stores new frequencies.
-    var freq = generateFrequency(docs);
+    invalidate(source);
+    callback = invalidating(source, callback);
+
+    var cache = source._geocoder;
+    var indexer = cache._indexer = cache._indexer || new Indexer(os.cpus().length);
+
+    // Overlapping updates would interleave their batches, queue them.
+    indexer.exclusive(function(done) {
+        updateBatch(source, indexer, docs, done);
+    }, callback);
+}
+
+function updateBatch(source, indexer, docs, callback) {
+    var cache = source._geocoder;
     var getter = source.getGeocoderData.bind(source);
 
-    // Ensures all shards are loaded.
-    var ids = Object.keys(freq).map(function(v) { return parseInt(v, 10); });
-    source._geocoder.getall(getter, 'freq', ids, function(err) {
-        if (err) return callback(err);
-        for (var i = 0; i < ids.length; i++) {
-            var id = ids[i];
-            freq[id][0] = (source._geocoder.get('freq', id) || [0])[0] + freq[id][0];
-            source._geocoder.set('freq', id, freq[id]);
+    var texts = [];
+    var grids = [];
+    try {
+        for (var i = 0; i < docs.length; i++) {
+            texts.push(prepareDoc(docs[i]));
+            grids.push(docs[i]._grid);
         }
-        indexDocs(freq[0], freq, callback);
-    });
+        // First pass over docs.
+        // - Tallies frequency of termids against current frequencies
+        //   compiling a final count of all terms involved with this set of
+        //   documents to be indexed.
+        // - Stores new frequencies.
+        indexer.frequency(texts, grids, function(err, ids) {
+            if (err) return callback(err);
+            // Ensures all shards are loaded.
+            cache.getall(getter, 'freq', ids, function(err) {
+                if (err) return callback(err);
+                try {
+                    indexer.index(cache, indexDocs);
+                } catch(err) {
+                    return callback(err);
+                }
+            });
+        });
+    } catch(err) {
+        return callback(err);
+    }
 
     // Second pass over docs.
     // - Create term => docid index. Uses calculated frequencies to index only
     //   significant terms for each document.
     // - Create id => grid zxy index.
-    function indexDocs(approxdocs, freq, callback) {
-        var patch = { grid: {}, term: {}, phrase: {}, degen: {} };
-        var features = {};
-
-        try {
-            for (var i = 0; i < docs.length; i++) loadDoc(docs[i], freq, patch, known);
-        } catch(err) {
-            return callback(err);
-        }
+    function indexDocs(err, patched) {
+        if (err) return callback(err);
 
         var q = queue(500);
-        q.defer(function(features, callback) {
+        q.defer(function(callback) {
             feature.putFeatures(source, docs, function(err) {
                 if (err) return callback(err);
                 // @TODO manually calls _commit on MBTiles sources.
@@ -103,53 +128,50 @@ function update(source, docs, callback) {
                 // be worth making a public function in node-mbtiles (?).
                 return source._commit ? source._commit(callback) : callback();
             });
-        }, features);
-        for (var type in patch) setParts(patch[type], type);
-        q.awaitAll(callback);
-
-        function setParts(data, type) {
-            q.defer(function(data, type, callback) {
-                var ids = Object.keys(data);
-                var cache = source._geocoder;
-                cache.getall(getter, type, ids, function(err) {
-                    if (err) return callback(err);
-                    for (var i = 0; i < ids.length; i++) {
-                        var id = ids[i];
-                        // This merges new entries on top of old ones.
-                        switch (type) {
-                        case 'term':
-                            var current = cache.get(type, id);
-                            if (current) {
-                                current.push.apply(current, data[id]);
-                                if (current.length > 2000) current = uniq(current);
-                            } else {
-                                current = data[id];
-                            }
-                            cache.set(type, id, current);
-                            break;
-                        case 'grid':
-                        case 'degen':
-                            var current = cache.get(type, id);
-                            if (current) {
-                                current.push.apply(current, data[id]);
-                            } else {
-                                current = data[id];
-                            }
-                            cache.set(type, id, current);
-                            break;
-                        case 'phrase':
-                            cache.set(type, id, data[id]);
-                            break;
-                        }
-                    }
-                    callback();
-                });
-            }, data, type);
+        });
+        if (indexer.spilling) {
+            q.defer(function(callback) {
+                try {
+                    indexer.spill(cache, callback);
+                } catch(err) {
+                    return callback(err);
+                }
+            });
+        } else {
+            for (var type in patched) q.defer(setParts, type, patched[type]);
         }
+        q.awaitAll(indexer.spilling ? spillFreq : callback);
+    }
+
+    // When spilling, frequencies are stored and their shards unloaded after
+    // every batch so that they don't pile up in memory either. The next
+    // batch fetches the shards it touches again.
+    function spillFreq(err) {
+        if (err) return callback(err);
+        storeCache(source, ['freq'], function(err) {
+            if (err) return callback(err);
+            cache.unloadall('freq');
+            return source._commit ? source._commit(callback) : callback();
+        });
+    }
+
+    // Merges new entries on top of old ones once their shards are loaded.
+    function setParts(type, ids, callback) {
+        cache.getall(getter, type, ids, function(err) {
+            if (err) return callback(err);
+            try {
+                indexer.apply(cache, type);
+            } catch(err) {
+                return callback(err);
+            }
+            callback();
+        });
     }
 };
 
-function loadDoc(doc, freq, patch, known) {
+// Validates a doc and sets its `_hash` and `_grid`. Returns the tokens of
+// each of its texts, leaving out texts without any.
+function prepareDoc(doc) {
     if (!doc._id) throw new Error('doc has no _id');
     if (!doc._zxy) throw new Error('doc has no _zxy');
     if (!doc._text) throw new Error('doc has no _text');
@@ -162,15 +184,23 @@ function loadDoc(doc, freq, patch, known) {
     }
 
     var texts = doc._text.split(',');
-    var termsets = [];
-    var termsmaps = [];
     var tokensets = [];
     for (var x = 0; x < texts.length; x++) {
         var tokens = termops.tokenize(texts[x]);
-        if (!tokens.length) continue;
-        termsets.push(termops.termsWeighted(tokens, freq));
-        termsmaps.push(termops.termsMap(tokens));
-        tokensets.push(tokens);
+        if (tokens.length) tokensets.push(tokens);
+    }
+    return tokensets;
+}
+
+// loadDoc and generateFrequency are the reference implementation of the
+// native indexer, which must produce the same patch and frequencies.
+function loadDoc(doc, freq, patch, known) {
+    var tokensets = prepareDoc(doc);
+    var termsets = [];
+    var termsmaps = [];
+    for (var x = 0; x < tokensets.length; x++) {
+        termsets.push(termops.termsWeighted(tokensets[x], freq));
+        termsmaps.push(termops.termsMap(tokensets[x]));
     }
 
     for (var x = 0; x < termsets.length; x++) {
@@ -253,12 +283,45 @@ function generateFrequency(docs) {
 // ## Store
 //
 // Serialize and make permanent the index currently in memory for a source.
+// Postings spilled to run files are merged with the stored shards instead.
 function store(source, callback) {
-    if (source._geocoder._known) delete source._geocoder._known;
+    invalidate(source);
+    callback = invalidating(source, callback);
+
+    var indexer = source._geocoder._indexer;
+    if (!indexer) {
+        return storeCache(source, ['freq','term','phrase','grid','degen'], callback);
+    }
+    delete source._geocoder._indexer;
+
+    // Wait for updates still in flight on the indexer.
+    indexer.exclusive(function(done) {
+        if (!indexer.spilling) {
+            return storeCache(source, ['freq','term','phrase','grid','degen'], done);
+        }
+        try {
+            indexer.flush(flushed);
+        } catch(err) {
+            return flushed(err);
+        }
+        function flushed(err) {
+            if (err) return cleared(err);
+            storeCache(source, ['freq'], function(err) {
+                if (err) return cleared(err);
+                storeRuns(source, indexer, cleared);
+            });
+        }
+        function cleared(err) {
+            indexer.clear();
+            done(err);
+        }
+    }, callback);
+}
 
+function storeCache(source, types, callback) {
     var tasks = [];
 
-    ['freq','term','phrase','grid','degen'].forEach(loadTerm);
+    types.forEach(loadTerm);
 
     function loadTerm(type) {
         var cache = source._geocoder;
@@ -291,3 +354,49 @@ function store(source, callback) {
     });
     q.awaitAll(callback);
 }
+
+// Merge each shard that has spilled postings with the shard as stored. Only
+// one shard per merge is held in memory. Shards the cache holds are
+// unloaded since they no longer match the stored ones.
+function storeRuns(source, indexer, callback) {
+    var cache = source._geocoder;
+    var q = queue(10);
+    ['term','phrase','grid','degen'].forEach(function(type) {
+        indexer.shards(type).forEach(function(shard) {
+            q.defer(mergeShard, type, shard);
+        });
+    });
+    q.awaitAll(callback);
+
+    function mergeShard(type, shard, callback) {
+        source.getGeocoderData(type, shard, function(err, buffer) {
+            if (err) return callback(err);
+            try {
+                indexer.merge(type, shard, Buffer.isBuffer(buffer) ? buffer : null, merged);
+            } catch(err) {
+                return callback(err);
+            }
+            function merged(err, buffer) {
+                if (err) return callback(err);
+                cache.unload(type, shard);
+                source.putGeocoderData(type, shard, buffer, callback);
+            }
+        });
+    }
+}
+
+// Bump the generation of a source's index so results cached against it
+// (see lib/util/querycache.js) are no longer served. Loads, writes and
+// unloads of the cache bump it too, writes to feature shards don't.
+function invalidate(source) {
+    source._geocoder.invalidate();
+}
+
+// Wrap a callback to invalidate again once a write completes, so results
+// computed against a partially written index are not served either.
+function invalidating(source, callback) {
+    return function() {
+        invalidate(source);
+        return callback.apply(this, arguments);
+    };
+}
@@ -1,6 +1,6 @@
 var getSetRelevance = require('./pure/setrelevance'),
     coalesceZooms = require('./pure/coalescezooms'),
-    applyAddress = require('./pure/applyaddress'),
+    applyAddress = require('./util/applyaddress'),
     sm = new(require('sphericalmercator'))(),
     ops = require('./util/ops'),
     mp2_14 = Math.pow(2, 14),
@@ -8,7 +8,8 @@ var getSetRelevance = require('./pure/setrelevance'),
     queue = require('queue-async'),
     context = require('./context'),
     termops = require('./util/termops'),
-    feature = require('./util/feature');
+    feature = require('./util/feature'),
+    Metrics = require('./util/metrics');
 
 module.exports = relevSort;
 
@@ -20,16 +21,22 @@ module.exports = relevSort;
 //
 // @param `contexts` is an array of bboxes which are assigned scores
 // @param `relevd` which is an object mapping place ids to places
-// @param {Object} geocoder the geocoder instance
+// @param {Object} stats per-query stats, see lib/geocode.js
+// @param {Object} recorder times coalesce, relev, feature and context
+// stages, see lib/util/metrics.js
+// @param {Object} geocoder the geocoder instance, its `indexes` being the
+// snapshots `indexes` reads, see lib/geocode.js
 // @param {Array} feats an array of feature objects
 // @param {Array} grids an array of grid objects
 // @param {Array} zooms an array of zoom numbers
 // @param {Function} callback
-function relevSort(indexes, types, query, stats, geocoder, feats, grids, zooms, callback) {
+function relevSort(indexes, types, query, stats, recorder, geocoder, feats, grids, zooms, callback) {
+    var start = process.hrtime();
 
     // Combine the scores for each match across multiple grids and zoom levels,
     // producing a mapping from `zxy` to matches
     var coalesced = coalesceZooms(grids, feats, types, zooms, indexes);
+    recorder.time('coalesce', start);
 
     // Generate a light modifier to apply to results from indexes without
     // address handling if an address is present in the query.
@@ -90,7 +97,7 @@ function relevSort(indexes, types, query, stats, geocoder, feats, grids, zooms,
 
     results = formatted;
 
-    stats.relevTime = +new Date() - stats.relevTime;
+    stats.relevTime = recorder.time('relev', start);
     stats.relevCount = results.length;
 
     if (!results.length) return callback(null, results);
@@ -98,7 +105,7 @@ function relevSort(indexes, types, query, stats, geocoder, feats, grids, zooms,
     // Disallow more than 20 of the best results at this point.
     if (results.length > 20) results = results.slice(0, 20);
 
-    var start = +new Date();
+    var contextStart = process.hrtime();
     var q = queue();
 
     results.forEach(function(term) {
@@ -121,7 +128,7 @@ function relevSort(indexes, types, query, stats, geocoder, feats, grids, zooms,
 
         contexts.sort(sortContext);
 
-        stats.contextTime = +new Date() - start;
+        stats.contextTime = Metrics.elapsed(contextStart);
         stats.contextCount = contexts.length;
 
         return callback(null, contexts);
@@ -131,10 +138,12 @@ function relevSort(indexes, types, query, stats, geocoder, feats, grids, zooms,
     // then load all of the relevant contexts for that feature
     function loadResult(term, callback) {
         var cq = queue();
-        var source = geocoder.indexes[term.db];
+        var source = indexes[term.db];
+        var featureStart = process.hrtime();
         feature.getFeature(source, term.id, featureLoaded);
         function featureLoaded(err, features) {
             if (err) return callback(err);
+            recorder.time('feature', featureStart, term.db);
             for (var id in features) {
                 // To exclude false positives from feature hash collisions
                 // check the feature center coord and ensure it is in the
@@ -147,7 +156,7 @@ function relevSort(indexes, types, query, stats, geocoder, feats, grids, zooms,
                 var checks = coalesced[coord];
                 if (address && feat._rangetype && source._geocoder.geocoder_address) {
                     feat._address = address;
-                    feat._geometry = applyAddress(feat, address);
+                    feat._geometry = applyAddress(feat, address, source._geocoder, id);
                     feat._center = feat._geometry && feat._geometry.coordinates;
                     checks = checks && feat._geometry;
                 }
@@ -155,8 +164,10 @@ function relevSort(indexes, types, query, stats, geocoder, feats, grids, zooms,
                     if (!('_center' in feat)) return callback(new Error('No _center field in data'));
                     feat._extid = term.db + '.' + id;
                     feat._fhash = term.db + '.' + term.id;
+                    var lookupStart = process.hrtime();
                     context(geocoder, feat._center[0], feat._center[1], term.db, false, function(err, context) {
                         if (err) return callback(err);
+                        recorder.time('context', lookupStart, term.db);
                         // Push feature onto the top level.
                         context.unshift(feat);
                         return callback(null, context);
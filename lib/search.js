@@ -1,5 +1,6 @@
 var termops = require('./util/termops'),
     ops = require('./util/ops'),
+    queue = require('queue-async'),
     uniq = require('./util/uniq'),
     Relev = require('./util/relev');
 
@@ -10,6 +11,9 @@ var idmod = Math.pow(2,25);
 // @param {Object} source a Geocoder datasource
 // @param {Array} query a list of terms composing the query to Carmen
 // @param {Number} id (unused)
+// Each step is timed through `source._geocoder.recorder`, see
+// lib/util/metrics.js.
+//
 // @param {Function} callback called with `(err, features, result, stats)`
 module.exports = function search(source, query, callback) {
     var idx = source._geocoder.idx,
@@ -17,7 +21,7 @@ module.exports = function search(source, query, callback) {
         terms = termops.terms(termops.tokenize(query)),
         relevs = {},
         // statistics, stored as
-        // [call count, result length, call time]
+        // [call count, result length, call time in ms]
         stats = {
             degen: [0,0,0],
             phrase: [0,0,0],
@@ -31,9 +35,14 @@ module.exports = function search(source, query, callback) {
         querymask = {},
         // maps terms to degenerate distance from canonical terms.
         querydist = {},
-        docrelev = {};
-
-    getDegen(terms, [], 0, function degenDone(err, terms) {
+        docrelev = {},
+        getter = source.getGeocoderData.bind(source),
+        // per-type handles for lookups in the loops below
+        phraseCache = source._geocoder.handle('phrase'),
+        gridCache = source._geocoder.handle('grid'),
+        recorder = source._geocoder.recorder;
+
+    getDegen(terms, function degenDone(err, terms) {
         if (err) return callback(err);
         getPhrases(terms, function phrasesDone(err, phrases) {
             if (err) return callback(err);
@@ -49,50 +58,53 @@ module.exports = function search(source, query, callback) {
     });
 
     // First, for all of the terms searched, get degenerate variations
-    // from the geocoder source.
+    // from the geocoder source. Lookups for all terms are made at once and
+    // their results processed in query order.
     //
-    // @param {Array} queue a queue of results that is mutated by this call
-    // @param {Array} result a list of results so far
-    // @param {Number} idx the index of iterations of this function - the
-    // depth of this function's recursion
+    // @param {Array} terms a list of query terms
     // @param {Function} callback called with `(err, result)`
-    function getDegen(queue, result, idx, callback) {
-        if (!queue[idx]) {
-            stats.degen[2] = stats.degen[2] && (+new Date() - stats.degen[2]);
-            stats.degen[1] = result.length;
-            return callback(null, result);
+    function getDegen(terms, callback) {
+        var q = queue(),
+            start = process.hrtime();
+        for (var i = 0; i < terms.length; i++) {
+            stats.degen[0]++;
+            q.defer(getDegens, terms[i]);
         }
-
-        stats.degen[0]++;
-        stats.degen[2] = +new Date();
-
-        source._geocoder.getall(source.getGeocoderData.bind(source), 'degen', [queue[idx]], mapTerms);
-
-        function mapTerms(err, termdist) {
+        q.awaitAll(function(err, termdists) {
             if (err) return callback(err);
 
-            termdist.sort(ops.sortDegens);
-
-            for (var i = 0; i < termdist.length && i < 10; i++) {
-                var term = termdist[i] >>> 4 << 4 >>> 0;
-                queryidx[term] = queryidx[term] !== undefined ? queryidx[term] : idx;
-                querymask[term] = (querymask[term]||0) + (1<<idx);
-                querydist[term] = termdist[i]%16;
-                result.push(term);
+            var result = [];
+            for (var idx = 0; idx < termdists.length; idx++) {
+                var termdist = termdists[idx];
+                termdist.sort(ops.sortDegens);
+
+                for (var i = 0; i < termdist.length && i < 10; i++) {
+                    var term = termdist[i] >>> 4 << 4 >>> 0;
+                    queryidx[term] = queryidx[term] !== undefined ? queryidx[term] : idx;
+                    querymask[term] = (querymask[term]||0) + (1<<idx);
+                    querydist[term] = termdist[i]%16;
+                    result.push(term);
+                }
             }
 
-            return getDegen(queue, result, idx+1, callback);
-        }
+            stats.degen[2] = recorder.time('degen', start, dbname);
+            stats.degen[1] = result.length;
+            return callback(null, result);
+        });
+    }
+
+    function getDegens(term, callback) {
+        source._geocoder.getall(getter, 'degen', [term], callback);
     }
 
     // @param {Array} queue a queue of results that is mutated by this call
     // @param {Function} callback called with `(err, result)`
     function getPhrases(queue, callback) {
+        var start = process.hrtime();
         stats.phrase[0]++;
-        stats.phrase[2] = +new Date();
-        source._geocoder.getall(source.getGeocoderData.bind(source), 'term', queue, function(err, result) {
+        source._geocoder.getall(getter, 'term', queue, function(err, result) {
             if (err) return callback(err);
-            stats.phrase[2] = stats.phrase[2] && (+new Date() - stats.phrase[2]);
+            stats.phrase[2] = recorder.time('phrase', start, dbname);
             stats.phrase[1] = result.length;
             return callback(null, result);
         });
@@ -101,11 +113,11 @@ module.exports = function search(source, query, callback) {
     // @param {Array} queue a queue of results that is mutated by this call
     // @param {Function} callback called with `(err, result)`
     function getTerms(queue, callback) {
+        var start = process.hrtime();
         stats.term[0]++;
-        stats.term[2] = +new Date();
-        source._geocoder.getall(source.getGeocoderData.bind(source), 'phrase', queue, function(err, result) {
+        source._geocoder.getall(getter, 'phrase', queue, function(err, result) {
             if (err) return callback(err);
-            stats.term[2] = stats.term[2] && (+new Date() - stats.term[2]);
+            stats.term[2] = recorder.time('term', start, dbname);
             stats.term[1] = result.length;
             return callback(null, result);
         });
@@ -114,11 +126,11 @@ module.exports = function search(source, query, callback) {
     // @param {Array} queue a queue of results that is mutated by this call
     // @returns {Array} list of sets that match with this phrase
     function getSets(phrases) {
-        stats.relevd[2] = +new Date();
+        var start = process.hrtime();
         var result = [];
         for (var a = 0; a < phrases.length; a++) {
             var id = phrases[a];
-            var data = source._geocoder.get('phrase', id);
+            var data = phraseCache.get(id);
             if (!data) throw new Error('Failed to get phrase');
 
             // relev each feature:
@@ -184,7 +196,7 @@ module.exports = function search(source, query, callback) {
         }
 
         result = uniq(result);
-        stats.relevd[2] = +new Date() - stats.relevd[2];
+        stats.relevd[2] = recorder.time('relevd', start, dbname);
         stats.relevd[1] = result.length;
         return result;
     }
@@ -192,10 +204,10 @@ module.exports = function search(source, query, callback) {
     // @param {Array} queue a queue of results that is mutated by this call
     // @param {Function} callback called with `(err, result)`
     function getgrids(queue, callback) {
+        var start = process.hrtime();
         stats.grid[0]++;
-        stats.grid[2] = +new Date();
 
-        source._geocoder.getall(source.getGeocoderData.bind(source), 'grid', queue, function(err) {
+        source._geocoder.getall(getter, 'grid', queue, function(err) {
             if (err) return callback(err);
 
             var result = [],
@@ -206,7 +218,7 @@ module.exports = function search(source, query, callback) {
             for (var a = 0; a < queue.length; a++) {
                 id = queue[a];
                 relev = relevs[id];
-                grids = source._geocoder.get('grid', id);
+                grids = gridCache.get(id);
 
                 for (var i = 0; i < grids.length; i++) {
                     grid = grids[i];
@@ -226,7 +238,7 @@ module.exports = function search(source, query, callback) {
                 result.push.apply(result, grids);
             }
 
-            stats.grid[2] = stats.grid[2] && (+new Date() - stats.grid[2]);
+            stats.grid[2] = recorder.time('grid', start, dbname);
             stats.grid[1] = result.length;
             return callback(null, features, result);
         });
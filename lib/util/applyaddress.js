@@ -0,0 +1,96 @@
+var Cache = require('./cxxcache'),
+    termops = require('./termops'),
+    shard = require('./feature').shard;
+
+var parity = { O: 1, E: 2, B: 3, '': 3 };
+
+// Used for features that are not interpolated through a source's cache.
+var scratch = new Cache('address', 0);
+
+// Interpolate `address` along a feature's TIGER ranges. Interpolation runs
+// natively (see `getAddress` in src/binding.cpp) over ranges and geometry
+// prepared once per feature. When a source `cache` and feature `id` are
+// given the prepared data is stored alongside the feature's shard in the
+// cache and reused by later queries.
+module.exports = function(feature, address, cache, id) {
+    // features without address data at all, on either side of the street
+    if (feature._rangetype !== 'tiger' ||
+        !feature._geometry ||
+        (feature._geometry.type !== 'LineString' &&
+        feature._geometry.type !== 'MultiLineString')) return;
+
+    var s = 0;
+    if (cache && id !== undefined && !isNaN(+id)) {
+        s = shard(cache.shardlevel, termops.feature(id));
+        id = +id;
+    } else {
+        cache = scratch;
+        id = 0;
+    }
+
+    if (cache === scratch || !cache.hasAddress(s, id)) setAddress(cache, s, id, feature);
+
+    var coordinates = cache.getAddress(s, id, +address);
+    if (!coordinates) return;
+    return {
+        type:'Point',
+        coordinates: coordinates
+    };
+};
+
+module.exports.parseSemiNumber = parseSemiNumber;
+
+// Convert range fields and geometry into typed arrays for the native
+// interpolator.
+function setAddress(cache, s, id, feature) {
+    var lines = feature._geometry.type === 'MultiLineString' ?
+        feature._geometry.coordinates :
+        [feature._geometry.coordinates];
+
+    var lf = toArray(feature._lfromhn),
+        lt = toArray(feature._ltohn),
+        rf = toArray(feature._rfromhn),
+        rt = toArray(feature._rtohn),
+        lp = toArray(feature._parityl),
+        rp = toArray(feature._parityr);
+
+    var points = 0;
+    for (var i = 0; i < lines.length; i++) points += lines[i].length;
+
+    var ranges = new Float64Array(lines.length * 4),
+        parities = new Uint8Array(lines.length * 2),
+        coords = new Float64Array(points * 2),
+        offsets = new Uint32Array(lines.length + 1),
+        p = 0;
+
+    for (i = 0; i < lines.length; i++) {
+        ranges[i * 4] = toRange(lf[i]);
+        ranges[i * 4 + 1] = toRange(lt[i]);
+        ranges[i * 4 + 2] = toRange(rf[i]);
+        ranges[i * 4 + 3] = toRange(rt[i]);
+        parities[i * 2] = parity[lp[i] || ''] || 0;
+        parities[i * 2 + 1] = parity[rp[i] || ''] || 0;
+        offsets[i] = p;
+        for (var j = 0; j < lines[i].length; j++, p++) {
+            coords[p * 2] = lines[i][j][0];
+            coords[p * 2 + 1] = lines[i][j][1];
+        }
+    }
+    offsets[lines.length] = p;
+
+    cache.setAddress(s, id, ranges, parities, coords, offsets);
+}
+
+function toArray(_) {
+    return Array.isArray(_) ? _ : _ ? [_] : [];
+}
+
+function toRange(_) {
+    _ = parseSemiNumber(_);
+    return _ === null ? NaN : _;
+}
+
+function parseSemiNumber(_) {
+    _ = parseInt((_ || '').replace(/[^\d]/g,''),10);
+    return isNaN(_) ? null : _;
+}
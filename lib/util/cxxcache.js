@@ -1,4 +1,5 @@
 var Cache = require('./binding.node').Cache;
+var Metrics = require('./metrics');
 var queue = require('queue-async');
 
 // This file wraps the Cache object coming from C++
@@ -9,6 +10,11 @@ var queue = require('queue-async');
 // of the data (called 'lazy' cache) which needs extra
 // work to decode before being usable.
 //
+// `id` and `shardlevel` are set from the constructor arguments.
+// `shardlevel` is stored natively and may be changed before any
+// shard is loaded, e.g. by index(): shards worked out here, by
+// handles and by the Indexer all read the one value.
+//
 // This object offers to JS these functions:
 //
 // Returns whether the Cache has data loaded for a given
@@ -56,6 +62,92 @@ var queue = require('queue-async');
 // Removes cached data for given type and shard from
 // both the memory and lazy caches.
 // - unload(type, shard)
+//
+// Loads a binary feature shard into the lazy cache under the
+// 'feature' type. Each feature is kept as its raw JSON string
+// so only features that are requested need to be decoded.
+// Segments are merged into features already loaded for the
+// shard, later segments winning. `has`, `list` and `unload`
+// work on 'feature' shards like any other type.
+// - loadFeatures(buffer, shard)
+//
+// Encodes an object mapping feature hashes to feature JSON
+// strings as a binary feature shard segment. Segments can be
+// appended to an existing shard buffer.
+// - packFeatures(features)
+//
+// Packs every feature loaded for a shard into a single segment,
+// used to rewrite a shard once features are merged into it.
+// - packFeatureShard(shard)
+//
+// Returns a number that changes whenever a feature shard is
+// loaded, written or unloaded, so that features decoded from it
+// can be reused until then. A snapshot reading a version its
+// cache has since replaced returns -1.
+// - _featureVersion(shard)
+//
+// Gets the JSON string stored for a feature hash.
+// - _getFeature(shard, id)
+//
+// Stores address interpolation data for a feature alongside
+// its feature shard. `ranges` (Float64Array) holds the
+// lfromhn, ltohn, rfromhn, rtohn numbers of each line (NaN when
+// missing), `parity` (Uint8Array) the left/right parity masks
+// of each line, `coords` (Float64Array) x,y pairs and `lines`
+// (Uint32Array) the offset of each line's first point followed
+// by the total point count. Cumulative segment lengths are
+// computed once here. Cleared by `loadFeatures` and `unload`
+// for the shard.
+// - setAddress(shard, id, ranges, parity, coords, lines)
+// - hasAddress(shard, id)
+//
+// Interpolates a house number against stored address data,
+// returning a [lon, lat] array or undefined if no range matches.
+// - getAddress(shard, id, address)
+//
+// In-flight shard registry used by getall. `_wait` registers
+// a callback for a shard and returns true if no fetch for it
+// is in flight yet, in which case the caller should fetch it.
+// `_settle` is passed the fetch result: the buffer is decoded
+// off the main thread and loaded before every waiting callback
+// is called with `(err)`, or `(null, ms)` with the time the
+// decode took. Given a Metrics object and a stage index, the
+// decode time is also recorded there. If the shard was loaded,
+// written or unloaded after `_wait` started the fetch, the
+// fetched buffer may be older and is dropped instead.
+// - _wait(type, shard, callback)
+// - _settle(type, shard, err, buffer, [metrics, stage])
+//
+// Returns a snapshot of the cache, see `snapshot` below.
+// - _snapshot()
+//
+// Drops the shards a snapshot holds, leaving it empty, rather than
+// waiting for it to be garbage collected. No-op on a cache that is not
+// a snapshot. Shard versions the cache has since replaced but that a
+// snapshot still holds are reported to V8 as external memory until
+// every snapshot holding them is released.
+// - release()
+//
+// `generation` is a number that changes on every load, write or
+// unload of a shard other than a feature shard, and on `invalidate()`.
+// Results cached with QueryCache are checked against it. Snapshots
+// and handles read the generation of their cache.
+// - generation
+// - invalidate()
+//
+// Returns the number of snapshots, across all caches, that have not
+// been released or garbage collected yet.
+// - Cache._snapshots()
+//
+// Returns a handle bound to `type`. The type is resolved once so
+// lookups through the handle take only a shard and id, which is
+// cheaper in loops. Handles have `has`, `load`, `loadSync`, `pack`,
+// `list`, `_get`, `_set` and `unload`, the same as the cache minus
+// the type argument, plus `get(id)` and `set(id, data)` which work
+// out the shard natively from the cache's current `shardlevel`. A
+// handle of a snapshot reads the snapshot. Wrapped by the JS land
+// function 'handle', which keeps one handle per type.
+// - _handle(type)
 
 exports = module.exports = Cache;
 
@@ -117,6 +209,11 @@ Cache.prototype.get = function(type, id) {
 
 // # getall
 //
+// Concurrent misses for the same shard, from this or any other getall
+// call, share a single fetch and decode. Fetches across all caches are
+// limited to `Cache.concurrency` at a time. Fetches and decodes are
+// timed through the cache's `recorder`.
+//
 // @param {Function} getter a function that accepts `(type, shard, callback)`
 // and given a type and shard, grabs all possible results.
 // @param {String} type
@@ -127,16 +224,17 @@ Cache.prototype.getall = function(getter, type, ids, callback) {
 
     var shardlevel = this.shardlevel,
         cache = this,
+        recorder = this.recorder,
+        handle = this.handle(type),
         queues = Cache.shards(shardlevel, ids),
         shards = Object.keys(queues),
-        remaining = shards.length,
         result = [];
 
-    var q = queue(10);
+    var q = queue();
 
     for (var i = 0; i < shards.length; i++) {
         var shard = +shards[i];
-        q.defer(loadshard, shard, queues[shard], false);
+        q.defer(loadshard, shard, queues[shard]);
     }
 
     q.awaitAll(function(err) {
@@ -145,44 +243,112 @@ Cache.prototype.getall = function(getter, type, ids, callback) {
         return callback(null, uniq);
     });
 
-    function error(err) {
-        remaining = -1;
-        return callback(err);
-    }
-
-    function loadshard(shard, queue, force, callback) {
-        // Loading results.
-        var has_shard = force || cache.has(type, shard);
+    function loadshard(shard, queue, callback) {
+        if (handle.has(shard)) return collect();
 
-        if (!has_shard) {
-            return getter(type, shard, cacheloadshard);
-        }
+        // Register with the in-flight registry. Only the first miss for a
+        // shard fetches it, everyone is called back once it is decoded.
+        var fetching = cache._wait(type, shard, loaded);
+        if (fetching) Cache.io(function(done) {
+            var start = process.hrtime();
+            getter(type, shard, function(err, buffer) {
+                done();
+                recorder.time('fetch', start, cache.name);
+                if (recorder.metrics) {
+                    cache._settle(type, shard, err || null, buffer || null, recorder.metrics, Metrics.stage.decode);
+                } else {
+                    cache._settle(type, shard, err || null, buffer || null);
+                }
+            });
+        });
 
-        function cacheloadshard(err, buffer) {
+        function loaded(err, ms) {
             if (err) return callback(err);
-            else if (!buffer) return loadshard(shard, queue, true, callback);
-            else {
-                try {
-                    // Sync load is used because async call is
-                    // experimental/not yet stable
-                    cache.loadSync(buffer, type, shard);
-                    loadshard(shard, queue, false, callback);
-                } catch(e) {
-                    error(e);
-                }
-            }
+            if (fetching && ms !== undefined) recorder.add('decode', ms, cache.name);
+            collect();
         }
 
         // Queue shard has been loaded into memory.
-        for (var a = 0; a < queue.length; a++) {
-            var id = queue[a];
-            // if (+id > Math.pow(2,32)) console.warn('ID %s', id);
-            var match = cache._get(type,+shard,+id);
-            if (match) for (var i = 0; i < match.length; i++) result.push(match[i]);
+        function collect() {
+            for (var a = 0; a < queue.length; a++) {
+                var id = queue[a];
+                var match = handle._get(+shard,+id);
+                if (match) for (var i = 0; i < match.length; i++) result.push(match[i]);
+            }
+            callback();
         }
+    }
+};
+
+// # handle
+//
+// Returns the handle bound to `type`, made on first use and kept on the
+// cache so hot paths can ask for it on every call. Handles hold their
+// cache through a JS reference, so a cache and its handles are collected
+// together.
+//
+// @param {String} type
+Cache.prototype.handle = function(type) {
+    var handles = this._handles = this._handles || {};
+    return handles[type] || (handles[type] = this._handle(type));
+};
 
-        callback();
+// Caches record nothing unless given a recorder, see lib/util/metrics.js.
+Cache.prototype.recorder = Metrics.Recorder.none;
+
+// Maximum number of concurrent getter calls made by getall across all
+// caches.
+Cache.concurrency = 10;
+
+var ioActive = 0,
+    ioPending = [],
+    ioRunning = false;
+
+// Run `task(done)` once fewer than `Cache.concurrency` tasks are active.
+Cache.io = function(task) {
+    ioPending.push(task);
+    ionext();
+};
+
+function ionext() {
+    // Tasks that finish synchronously re-enter here, let the outer loop
+    // pick up the next one instead of recursing.
+    if (ioRunning) return;
+    ioRunning = true;
+    while (ioActive < Cache.concurrency && ioPending.length) {
+        ioActive++;
+        ioPending.shift()(iodone);
+    }
+    ioRunning = false;
+}
+
+function iodone() {
+    ioActive--;
+    ionext();
+}
+
+// # snapshot
+//
+// Returns a read-only view of this cache for the duration of a query.
+// The snapshot holds every shard loaded at the time it is taken, at the
+// version loaded then: a later `load`, `loadSync`, `_set` or `unload` of
+// those shards does not show through. Taking a snapshot is O(1), the
+// cache copies its shard tables on the next write instead. Shards first
+// loaded after the snapshot, such as those getall fetches for it, are
+// read at the version the snapshot first sees. Loads and writes made
+// through the snapshot are applied to this cache. Properties set on this
+// cache (zoom, name, ...) are copied onto the snapshot, and `_origin` is
+// set to this cache. Call `release()` on the snapshot once the query is
+// done with it.
+Cache.prototype.snapshot = function() {
+    var snap = this._snapshot();
+    snap._origin = this;
+    for (var key in this) {
+        // handles read the cache they were made from, the snapshot makes its own
+        if (key === '_handles') continue;
+        if (this.hasOwnProperty(key) && !snap.hasOwnProperty(key)) snap[key] = this[key];
     }
+    return snap;
 };
 
 // # unloadall
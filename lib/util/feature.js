@@ -5,14 +5,26 @@ module.exports.getFeature = getFeature;
 module.exports.getAllFeatures = getAllFeatures;
 module.exports.putFeature = putFeature;
 module.exports.putFeatures = putFeatures;
+module.exports.shard = shard;
+
+// Number of feature shards getFeature keeps loaded per cache. Once more
+// are read the least recently read shard is unloaded.
+module.exports.limit = 64;
+
+// Feature shards are stored in the binary segment format read and written
+// by `loadFeatures` and `packFeatures` in src/binding.cpp. Shards read by
+// getFeature are kept in the source's Cache under the 'feature' type, up
+// to `limit` of them, so that repeat lookups skip I/O. Each feature is
+// JSON decoded the first time it is requested and reused until its shard
+// changes. Writes load a shard only for as long as they merge into it.
 
 function getFeature(source, id, callback) {
-    var s = shard(source._geocoder.shardlevel, id);
-    source.getGeocoderData('feature', s, function(err, buffer) {
+    var cache = source._geocoder;
+    var s = shard(cache.shardlevel, id);
+    loadShard(source, s, function(err, kept) {
         if (err) return callback(err);
         try {
-            var data = buffer ? JSON.parse(buffer) : {};
-            return callback(null, data[id] && JSON.parse(data[id]));
+            return callback(null, lookup(cache, s, +id, kept));
         } catch (err) { return callback(err); }
     });
 }
@@ -22,12 +34,13 @@ function getAllFeatures(source, callback) {
     var docs = [];
     var q = queue();
     for (var i = 0; i < limit; i++) q.defer(function(shard, callback) {
-        source.getGeocoderData('feature', shard, function(err, buffer) {
+        loadShard(source, shard, function(err) {
             if (err) return callback(err);
             try {
-                var data = buffer ? JSON.parse(buffer) : {};
-                for (var hash in data) {
-                    var chunk = JSON.parse(data[hash]);
+                var cache = source._geocoder;
+                var hashes = cache.list('feature', shard);
+                for (var i = 0; i < hashes.length; i++) {
+                    var chunk = JSON.parse(cache._getFeature(shard, +hashes[i]));
                     for (var x in chunk) docs.push(chunk[x]);
                 }
                 return callback();
@@ -44,20 +57,14 @@ function getAllFeatures(source, callback) {
 
 function putFeature(source, id, data, callback) {
     var s = shard(source._geocoder.shardlevel, id);
-    source.getGeocoderData('feature', s, function(err, buffer) {
-        if (err) return callback(err);
-        try {
-            var current = buffer ? JSON.parse(buffer) : {};
-            if (current[id]) {
-                var merged = JSON.parse(current[id]);
-                for (var key in data) merged[key] = data[key];
-                current[id] = JSON.stringify(merged);
-            } else {
-                current[id] = JSON.stringify(data);
-            }
-            source.putGeocoderData('feature', JSON.stringify(current), callback);
-        } catch (err) { return callback(err); }
-    });
+    writeShard(source, s, function(cache) {
+        var existing = cache._getFeature(s, +id);
+        var merged = existing ? JSON.parse(existing) : {};
+        for (var key in data) merged[key] = data[key];
+        var entries = {};
+        entries[id] = JSON.stringify(merged);
+        return entries;
+    }, callback);
 }
 
 function putFeatures(source, docs, callback) {
@@ -70,23 +77,134 @@ function putFeatures(source, docs, callback) {
     }
     var q = queue(100);
     for (var s in byshard) q.defer(function(s, docs, callback) {
-        source.getGeocoderData('feature', s, function(err, buffer) {
-            if (err) return callback(err);
-            try {
-                var current = buffer ? JSON.parse(buffer) : {};
-                for (var i = 0; i < docs.length; i++) {
-                    var doc = docs[i];
-                    var entry = current[doc._hash] ? JSON.parse(current[doc._hash]) : {};
-                    entry[doc._id] = doc;
-                    current[doc._hash] = JSON.stringify(entry, cleanDoc);
+        writeShard(source, s, function(cache) {
+            // Only features touched by this batch are decoded and
+            // re-encoded. Everything else in the shard is left as-is.
+            var entries = {};
+            for (var i = 0; i < docs.length; i++) {
+                var doc = docs[i];
+                if (!entries[doc._hash]) {
+                    var existing = cache._getFeature(s, doc._hash);
+                    entries[doc._hash] = existing ? JSON.parse(existing) : {};
                 }
-                source.putGeocoderData('feature', s, JSON.stringify(current), callback);
-            } catch (err) { return callback(err) }
-        });
-    }, s, byshard[s]);
+                entries[doc._hash][doc._id] = doc;
+            }
+            for (var hash in entries) {
+                entries[hash] = JSON.stringify(entries[hash], cleanDoc);
+            }
+            return entries;
+        }, callback);
+    }, +s, byshard[s]);
     q.awaitAll(callback);
 }
 
+// Load a feature shard into the source's Cache if it is not already
+// present, and call back with its entry in the cache's kept shards.
+function loadShard(source, s, callback) {
+    var cache = source._geocoder;
+    if (cache.has('feature', s)) return callback(null, keep(cache, s));
+    source.getGeocoderData('feature', s, function(err, buffer) {
+        if (err) return callback(err);
+        try {
+            cache.loadFeatures(decode(cache, buffer), s);
+        } catch (err) { return callback(err); }
+        return callback(null, keep(cache, s));
+    });
+}
+
+// Mark shard `s` as read, unloading the least recently read shard if the
+// cache keeps more than `limit`. Shards are kept by the cache snapshots are
+// taken of, see `snapshot` in lib/util/cxxcache.js. Returns the shard's
+// entry: `{ tick, version, features }`, `features` holding the features
+// decoded from `version` of the shard.
+function keep(cache, s) {
+    var live = cache._origin || cache;
+    var kept = live._features = live._features || { tick: 0, count: 0, shards: {} };
+    var entry = kept.shards[s];
+    if (!entry) {
+        if (kept.count >= module.exports.limit) evict(live, kept);
+        entry = kept.shards[s] = { tick: 0, version: -1, features: {} };
+        kept.count++;
+    }
+    entry.tick = ++kept.tick;
+    return entry;
+}
+
+function evict(live, kept) {
+    var oldest;
+    for (var s in kept.shards) {
+        if (oldest === undefined || kept.shards[s].tick < kept.shards[oldest].tick) oldest = s;
+    }
+    delete kept.shards[oldest];
+    kept.count--;
+    live.unload('feature', +oldest);
+}
+
+// Features stored under hash `id` in shard `s`, decoded once per version of
+// the shard. Callers set properties on the features they get, so each gets
+// its own copies. Nested values are shared and must not be modified.
+function lookup(cache, s, id, kept) {
+    var version = cache._featureVersion(s);
+    var features = {};
+    if (version >= 0) {
+        if (kept.version !== version) {
+            kept.version = version;
+            kept.features = {};
+        }
+        features = kept.features;
+    }
+    if (!(id in features)) {
+        var data = cache._getFeature(s, id);
+        features[id] = data ? JSON.parse(data) : undefined;
+    }
+    var decoded = features[id];
+    if (!decoded) return decoded;
+    var copy = {};
+    for (var fid in decoded) {
+        var feat = {};
+        for (var key in decoded[fid]) feat[key] = decoded[fid][key];
+        copy[fid] = feat;
+    }
+    return copy;
+}
+
+// Merge the features `merge(cache)` returns, a hash => feature JSON map,
+// into shard `s` and store the shard rewritten as a single segment. The
+// stored shard is only fetched if the cache does not have it loaded, and
+// is unloaded again once written.
+function writeShard(source, s, merge, callback) {
+    var cache = source._geocoder;
+    var loaded = cache.has('feature', s);
+    if (loaded) return write();
+    source.getGeocoderData('feature', s, function(err, buffer) {
+        if (err) return callback(err);
+        try {
+            cache.loadFeatures(decode(cache, buffer), s);
+        } catch (err) { return callback(err); }
+        write();
+    });
+    function write() {
+        var buffer, err;
+        try {
+            cache.loadFeatures(cache.packFeatures(merge(cache)), s);
+            buffer = cache.packFeatureShard(s);
+        } catch (e) { err = e; }
+        if (!loaded) cache.unload('feature', s);
+        if (err) return callback(err);
+        source.putGeocoderData('feature', s, buffer, callback);
+    }
+}
+
+// Normalize a stored feature shard to the binary segment format. Shards
+// written before the binary format are a JSON object of hash => feature JSON
+// and are converted on read.
+function decode(cache, buffer) {
+    if (!buffer || !buffer.length) return new Buffer(0);
+    if (typeof buffer === 'string') return cache.packFeatures(JSON.parse(buffer));
+    if (buffer[0] === 0x7b) return cache.packFeatures(JSON.parse(buffer.toString()));
+    return buffer;
+}
+
 // Strip temporary indexing attributes from feature docs.
 function cleanDoc(key, val) {
     if (key === '_hash') return;
@@ -114,4 +232,3 @@ function shard(level, id) {
     var mod = Math.pow(16,level+1);
     return Math.floor((id%(64*mod))/64);
 }
-
@@ -0,0 +1,74 @@
+var Indexer = require('./binding.node').Indexer;
+
+// This file wraps the Indexer object coming from C++
+//
+// An Indexer builds index postings for batches of documents across
+// `threads` worker threads (default 1). It is kept for the
+// duration of an index build since it tracks which terms have had
+// their degenerates indexed. That set grows with the vocabulary of
+// the build, about 8 bytes per distinct term, spilling or not.
+//
+// With `options.dir` set the indexer spills postings to run files in
+// that directory once about `options.memory` bytes (default 256MB) are
+// pending, and its `spilling` property is true.
+// - new Indexer([threads], [options])
+//
+// Starts a batch. `texts` holds, for each document, an array of
+// tokenized texts (see termops.tokenize) and `grids` each document's
+// grid ids. Counts term frequencies and calls back with
+// `(err, ids)`, the ids of the freq entries the batch touches.
+// - frequency(texts, grids, callback)
+//
+// Adds the batch frequencies to the freq entries of `cache`, which
+// must have the shards for `ids` loaded, and builds the term, phrase,
+// grid and degen postings of the batch. Calls back with
+// `(err, patched)` where `patched` maps each type to the ids it
+// will write.
+// - index(cache, callback)
+//
+// Merges the postings of `type` into `cache`, which must have the
+// shards for the ids in `patched[type]` loaded.
+// - apply(cache, type)
+//
+// Used in place of apply when spilling. Sets the postings of the
+// batch aside, writing a run file if enough are pending. Calls back
+// with `(err)`.
+// - spill(cache, callback)
+//
+// Writes any pending postings to a last run file.
+// - flush(callback)
+//
+// Returns the shards of `type` that have postings in run files.
+// - shards(type)
+//
+// Returns the number of run files written so far.
+// - runs()
+//
+// Merges the run files' postings for a shard with `buffer`, the shard
+// as stored (or null), and calls back with `(err, buffer)`, the merged
+// shard. Values are deduplicated the way store() does.
+// - merge(type, shard, buffer, callback)
+//
+// Deletes the indexer's run files.
+// - clear()
+
+module.exports = Indexer;
+
+// # exclusive
+//
+// A batch keeps its docs, counts and postings on the indexer from
+// frequency() until apply() or spill(), and the native calls of a batch
+// throw while another one's work is in flight. Runs `task(done)` once the
+// tasks queued before it have called their `done`, then calls `callback`
+// with whatever `done` was called with.
+Indexer.prototype.exclusive = function(task, callback) {
+    var pending = this._pending = this._pending || [];
+    pending.push(function() { task(done); });
+    if (pending.length === 1) pending[0]();
+
+    function done() {
+        pending.shift();
+        if (pending.length) pending[0]();
+        return callback.apply(this, arguments);
+    }
+};
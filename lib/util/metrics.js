@@ -0,0 +1,79 @@
+var Metrics = require('./binding.node').Metrics;
+
+// This file wraps the Metrics object coming from C++
+//
+// Metrics holds a latency histogram per named stage outside of
+// the V8 heap. Recording is lock-free so shard decodes record
+// from worker threads directly, see `_settle` in cxxcache.js.
+// - new Metrics(stages)
+//
+// Records `ns` nanoseconds for the stage at index `stage`.
+// - record(stage, ns)
+//
+// Returns an object mapping each stage name to its count and,
+// once it has been recorded, its mean, min, max, p50, p90, p99
+// and p999 latencies in milliseconds. Percentiles are within
+// 1/16 of the recorded values.
+// - stats()
+//
+// Clears every histogram.
+// - reset()
+
+module.exports = Metrics;
+
+// Stages of a geocode:
+// - total: a whole geocode, including result cache hits
+// - search: search of one index
+// - degen, phrase, term, relevd, grid: the steps of a search, see
+//   lib/search.js
+// - coalesce: merging grids across indexes and zoom levels
+// - relev: scoring, from the end of searches to sorted results
+// - context: context lookup of one result or reverse geocode
+// - feature: loading one result's feature
+// - fetch: one index shard read through getall
+// - decode: decoding one fetched shard, off the main thread
+Metrics.stages = ['total', 'search', 'degen', 'phrase', 'term', 'relevd',
+    'grid', 'coalesce', 'relev', 'context', 'feature', 'fetch', 'decode'];
+
+Metrics.stage = {};
+for (var i = 0; i < Metrics.stages.length; i++) Metrics.stage[Metrics.stages[i]] = i;
+
+// Milliseconds since `start`, a `process.hrtime()` result.
+Metrics.elapsed = function(start) {
+    var elapsed = process.hrtime(start);
+    return elapsed[0] * 1e3 + elapsed[1] / 1e6;
+};
+
+// # Recorder
+//
+// Times stages of a geocode into a Metrics object, if any, and into
+// `trace`, a list of `{ stage, source, ms }`, when tracing. Caches carry
+// a recorder as `recorder`: geocode sets one on each snapshot it reads so
+// shard fetches and decodes land in the query's trace.
+//
+// @param {Object} metrics a Metrics object or null
+// @param {Boolean} trace whether to keep a trace
+Metrics.Recorder = Recorder;
+
+function Recorder(metrics, trace) {
+    this.metrics = metrics || null;
+    this.trace = trace ? [] : null;
+}
+
+// Record the time since `start`, a `process.hrtime()` result, for `stage`.
+// Returns it in milliseconds.
+Recorder.prototype.time = function(stage, start, source) {
+    var elapsed = process.hrtime(start),
+        ns = elapsed[0] * 1e9 + elapsed[1];
+    if (this.metrics) this.metrics.record(Metrics.stage[stage], ns);
+    if (this.trace) this.trace.push({ stage: stage, source: source, ms: ns / 1e6 });
+    return ns / 1e6;
+};
+
+// Add a stage already recorded elsewhere to the trace.
+Recorder.prototype.add = function(stage, ms, source) {
+    if (this.trace) this.trace.push({ stage: stage, source: source, ms: ms });
+};
+
+// A recorder that records nothing, for caches outside of a geocoder.
+Recorder.none = new Recorder(null, false);
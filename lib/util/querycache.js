@@ -0,0 +1,40 @@
+var QueryCache = require('./binding.node').QueryCache;
+
+// This file wraps the QueryCache object coming from C++
+//
+// QueryCache holds serialized geocode results outside of the V8
+// heap. It is bounded to `maxsize` bytes spread over `shards`
+// independently locked LRU shards (default 16).
+// - new QueryCache(maxsize, [shards])
+//
+// Each entry is stored with the index generation it was computed
+// against. Looking it up with a different generation is a miss
+// and drops the entry.
+// - get(key, generation)
+// - set(key, value, generation)
+//
+// Drops all entries.
+// - clear()
+//
+// Returns hit/miss counters and their ratio along with the
+// number of entries, their approximate size in bytes, and the
+// number of entries evicted to stay within `maxsize`.
+// - stats()
+
+module.exports = QueryCache;
+
+// Build a cache key from a tokenized query and the options that affect the
+// result of a geocode. Stats are added to results after they are cached so
+// they don't take part.
+QueryCache.key = function(tokens, options) {
+    return JSON.stringify([tokens, options.limit]);
+};
+
+// Combined generation of a set of indexes. The generation of an index
+// cache changes on every load, write or unload of its shards, and around
+// index writes (see lib/index.js), so any of them changes the sum.
+QueryCache.generation = function(indexes) {
+    var generation = 0;
+    for (var id in indexes) generation += indexes[id]._geocoder.generation || 0;
+    return generation;
+};
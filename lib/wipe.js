@@ -22,7 +22,7 @@ function wipe(source, callback) {
         function transferGeocoderData(type, shard, callback) {
             s.getGeocoderData(type, shard, function(err, buffer) {
                 if (!buffer) return callback();
-                s.putGeocoderData(type, shard, type === 'feature' ? '{}' : new Buffer(0), callback);
+                s.putGeocoderData(type, shard, new Buffer(0), callback);
             });
         }
         q.awaitAll(function(err) {
@@ -1,11 +1,15 @@
 
 #include "binding.hpp"
+#include "querycache.hpp"
+#include "indexer.hpp"
+#include "cachehandle.hpp"
+#include "metrics.hpp"
 #include <node_version.h>
 #include <node_buffer.h>
 
-#include "pbf.hpp"
-
 #include <sstream>
+#include <cmath>
+#include <algorithm>
 
 namespace binding {
 
@@ -26,19 +30,145 @@ void Cache::Initialize(Handle<Object> target) {
     NODE_SET_PROTOTYPE_METHOD(t, "_set", _set);
     NODE_SET_PROTOTYPE_METHOD(t, "_get", _get);
     NODE_SET_PROTOTYPE_METHOD(t, "unload", unload);
-    target->Set(String::NewSymbol("Cache"),t->GetFunction());
+    NODE_SET_PROTOTYPE_METHOD(t, "loadFeatures", loadFeatures);
+    NODE_SET_PROTOTYPE_METHOD(t, "packFeatures", packFeatures);
+    NODE_SET_PROTOTYPE_METHOD(t, "_featureVersion", _featureVersion);
+    NODE_SET_PROTOTYPE_METHOD(t, "packFeatureShard", packFeatureShard);
+    NODE_SET_PROTOTYPE_METHOD(t, "_getFeature", _getFeature);
+    NODE_SET_PROTOTYPE_METHOD(t, "setAddress", setAddress);
+    NODE_SET_PROTOTYPE_METHOD(t, "hasAddress", hasAddress);
+    NODE_SET_PROTOTYPE_METHOD(t, "getAddress", getAddress);
+    NODE_SET_PROTOTYPE_METHOD(t, "_wait", _wait);
+    NODE_SET_PROTOTYPE_METHOD(t, "_settle", _settle);
+    NODE_SET_PROTOTYPE_METHOD(t, "_snapshot", _snapshot);
+    NODE_SET_PROTOTYPE_METHOD(t, "_handle", _handle);
+    NODE_SET_PROTOTYPE_METHOD(t, "release", release);
+    NODE_SET_PROTOTYPE_METHOD(t, "invalidate", invalidate);
+    t->InstanceTemplate()->SetAccessor(String::NewSymbol("shardlevel"), getShardlevel, setShardlevel);
+    t->InstanceTemplate()->SetAccessor(String::NewSymbol("generation"), getGeneration);
+    Local<Function> fn = t->GetFunction();
+    NODE_SET_METHOD(fn, "_snapshots", snapshots);
+    target->Set(String::NewSymbol("Cache"),fn);
     NanAssignPersistent(FunctionTemplate, constructor, t);
 }
 
+unsigned Cache::snapshot_count = 0;
+
+// Tell V8 about memory held outside its heap so that it collects sooner.
+static void adjust_external_memory(int64_t bytes) {
+#if NODE_VERSION_AT_LEAST(0, 11, 0)
+    Isolate::GetCurrent()->AdjustAmountOfExternalAllocatedMemory(bytes);
+#else
+    V8::AdjustAmountOfExternalAllocatedMemory(static_cast<intptr_t>(bytes));
+#endif
+}
+
+// Approximate size in bytes of a shard version.
+static std::size_t shard_bytes(Cache::larraycache const& arrc) {
+    std::size_t bytes = 0;
+    Cache::larraycache_iterator itr = arrc.begin();
+    for (; itr != arrc.end(); ++itr) {
+        bytes += sizeof(*itr) + itr->second.size();
+    }
+    return bytes;
+}
+
+static std::size_t shard_bytes(Cache::arraycache const& arrc) {
+    std::size_t bytes = 0;
+    Cache::arraycache_iterator itr = arrc.begin();
+    for (; itr != arrc.end(); ++itr) {
+        bytes += sizeof(*itr) + itr->second.size() * sizeof(Cache::int_type);
+    }
+    return bytes;
+}
+
 Cache::Cache(std::string const& id, unsigned shardlevel)
   : ObjectWrap(),
     id_(id),
     shardlevel_(shardlevel),
-    cache_(),
-    lazy_()
+    cache_(new Cache::memcache()),
+    lazy_(new Cache::lazycache()),
+    address_(),
+    inflight_(),
+    versions_(),
+    generation_(0),
+    fetching_(),
+    superseded_(),
+    pinned_bytes_(0),
+    origin_(NULL)
     { }
 
-Cache::~Cache() { }
+Cache::~Cache() {
+    detach();
+    if (pinned_bytes_) {
+        adjust_external_memory(-static_cast<int64_t>(pinned_bytes_));
+    }
+    Cache::inflightcache::iterator itr = inflight_.begin();
+    Cache::inflightcache::iterator end = inflight_.end();
+    while (itr != end) {
+        for (std::size_t i = 0; i < itr->second.size(); ++i) {
+            delete itr->second[i];
+        }
+        ++itr;
+    }
+}
+
+// Shard number from a JS argument. Shards are numbered within 32 bits, see
+// Cache.shard in lib/util/cxxcache.js and lib/util/feature.js.
+Cache::int_type Cache::shard_arg(Local<Value> shard) {
+    int64_t val = shard->IntegerValue();
+    if (val < 0 || val > 0xffffffffLL) {
+        throw std::runtime_error("shard must be a 32-bit unsigned int");
+    }
+    return static_cast<Cache::int_type>(val);
+}
+
+// Type names are interned the first time a shard of them is stored,
+// 'feature' always being 0, so shards can be keyed by number. Lookups
+// don't intern: a type that was never stored is `unknown_type`, which
+// keys no shard, so reads of arbitrary type names don't grow the table.
+static const unsigned feature_type = 0;
+
+const unsigned Cache::unknown_type;
+
+static std::map<std::string,unsigned> & type_ids() {
+    static std::map<std::string,unsigned> ids;
+    if (ids.empty()) {
+        ids["feature"] = feature_type;
+    }
+    return ids;
+}
+
+unsigned Cache::type_id(std::string const& type) {
+    std::map<std::string,unsigned> & ids = type_ids();
+    std::map<std::string,unsigned>::const_iterator itr = ids.find(type);
+    if (itr != ids.end()) {
+        return itr->second;
+    }
+    unsigned id = static_cast<unsigned>(ids.size());
+    ids[type] = id;
+    return id;
+}
+
+unsigned Cache::find_type_id(std::string const& type) {
+    std::map<std::string,unsigned> const& ids = type_ids();
+    std::map<std::string,unsigned>::const_iterator itr = ids.find(type);
+    return itr != ids.end() ? itr->second : unknown_type;
+}
+
+// Key of a shard to read.
+inline Cache::key_type key_arg(Local<Value> type, Local<Value> shard) {
+    return Cache::key(Cache::find_type_id(*String::Utf8Value(type->ToString())), Cache::shard_arg(shard));
+}
+
+// Key of a shard to store, interning its type.
+inline Cache::key_type intern_key_arg(Local<Value> type, Local<Value> shard) {
+    return Cache::key(Cache::type_id(*String::Utf8Value(type->ToString())), Cache::shard_arg(shard));
+}
+
+inline Cache::key_type feature_key(Cache::int_type shard) {
+    return Cache::key(feature_type, shard);
+}
 
 NAN_METHOD(Cache::pack)
 {
@@ -53,83 +183,51 @@ NAN_METHOD(Cache::pack)
         return NanThrowTypeError("second arg must be an Integer");
     }
     try {
-        std::string type = *String::Utf8Value(args[0]->ToString());
-        std::string shard = *String::Utf8Value(args[1]->ToString());
-        std::string key = type + "-" + shard;
         Cache* c = node::ObjectWrap::Unwrap<Cache>(args.This());
-        Cache::memcache const& mem = c->cache_;
-        Cache::mem_iterator_type itr = mem.find(key);
-        carmen::proto::object message;
-        if (itr != mem.end()) {
-            Cache::arraycache_iterator aitr = itr->second.begin();
-            Cache::arraycache_iterator aend = itr->second.end();
-            while (aitr != aend) {
-                ::carmen::proto::object_item * new_item = message.add_items(); 
-                new_item->set_key(aitr->first);
-                Cache::intarray const & varr = aitr->second;
-                std::size_t varr_size = varr.size();
-                for (std::size_t i=0;i<varr_size;++i) {
-                    new_item->add_val(static_cast<int64_t>(varr[i]));
-                }
-                ++aitr;
-            }
+        NanReturnValue(c->pack_shard(key_arg(args[0], args[1])));
+    } catch (std::exception const& ex) {
+        return NanThrowTypeError(ex.what());
+    }
+    NanReturnValue(Undefined());
+}
+
+// Encode shard `key` as a protobuf buffer from whichever of the memory
+// cache and the lazy cache holds it.
+Local<Value> Cache::pack_shard(key_type key) {
+    pin(key);
+    Cache::mem_iterator_type itr = cache_->find(key);
+    carmen::proto::object message;
+    if (itr != cache_->end()) {
+        pack_arrays(*itr->second, message);
+    } else {
+        Cache::lazycache_iterator_type litr = lazy_->find(key);
+        if (litr != lazy_->end()) {
+            pack_arrays(*litr->second, message);
         } else {
-            Cache::lazycache const& lazy = c->lazy_;
-            Cache::lazycache_iterator_type litr = lazy.find(key);
-            if (litr != lazy.end()) {
-                Cache::larraycache_iterator laitr = litr->second.begin();
-                Cache::larraycache_iterator laend = litr->second.end();
-                while (laitr != laend) {
-                    ::carmen::proto::object_item * new_item = message.add_items();
-                    new_item->set_key(static_cast<int64_t>(laitr->first));
-                    Cache::string_ref_type const& ref = laitr->second;
-                    protobuf::message item(ref.data(), ref.size());
-                    while (item.next()) {
-                        if (item.tag == 1) {
-                            item.skip();
-                        } else if (item.tag == 2) {
-                            uint64_t len = item.varint();
-                            protobuf::message pbfarray(item.getData(),static_cast<std::size_t>(len));
-                            while (pbfarray.next()) {
-                                new_item->add_val(static_cast<int64_t>(pbfarray.value));
-                            }
-                            item.skipBytes(len);
-                        } else {
-                            std::stringstream msg("");
-                            msg << "pack: hit unknown protobuf type: '" << item.tag << "'";
-                            throw std::runtime_error(msg.str());
-                        }
-                    }
-                    ++laitr;
-                }
-            } else {
-                return NanThrowTypeError("pack: cannot pack empty data");
-            }
+            throw std::runtime_error("pack: cannot pack empty data");
         }
-        int size = message.ByteSize();
-        if (size > 0)
-        {
-            std::size_t usize = static_cast<std::size_t>(size);
+    }
+    int size = message.ByteSize();
+    if (size > 0)
+    {
+        std::size_t usize = static_cast<std::size_t>(size);
 #if NODE_VERSION_AT_LEAST(0, 11, 0)
-            Local<Object> retbuf = node::Buffer::New(usize);
-            if (message.SerializeToArray(node::Buffer::Data(retbuf),size))
-            {
-                NanReturnValue(retbuf);
-            }
+        Local<Object> retbuf = node::Buffer::New(usize);
+        if (message.SerializeToArray(node::Buffer::Data(retbuf),size))
+        {
+            return retbuf;
+        }
 #else
-            node::Buffer *retbuf = node::Buffer::New(usize);
-            if (message.SerializeToArray(node::Buffer::Data(retbuf),size))
-            {
-                NanReturnValue(retbuf->handle_);
-            }
-#endif
-        } else {
-            return NanThrowTypeError("pack: invalid message ByteSize encountered");
+        node::Buffer *retbuf = node::Buffer::New(usize);
+        if (message.SerializeToArray(node::Buffer::Data(retbuf),size))
+        {
+            return Local<Value>::New(retbuf->handle_);
         }
-    } catch (std::exception const& ex) {
-        return NanThrowTypeError(ex.what());
+#endif
+    } else {
+        throw std::runtime_error("pack: invalid message ByteSize encountered");
     }
-    NanReturnValue(Undefined());
+    return Local<Value>::New(Undefined());
 }
 
 NAN_METHOD(Cache::list)
@@ -142,56 +240,11 @@ NAN_METHOD(Cache::list)
         return NanThrowTypeError("first argument must be a String");
     }
     try {
-        std::string type = *String::Utf8Value(args[0]->ToString());
         Cache* c = node::ObjectWrap::Unwrap<Cache>(args.This());
-        Cache::memcache const& mem = c->cache_;
-        Local<Array> ids = Array::New();
         if (args.Length() == 1) {
-            Cache::mem_iterator_type itr = mem.begin();
-            Cache::mem_iterator_type end = mem.end();
-            unsigned idx = 0;
-            while (itr != end) {
-                if (itr->first.size() > type.size() && itr->first.substr(0,type.size()) == type) {
-                    std::string shard = itr->first.substr(type.size()+1,itr->first.size());
-                    ids->Set(idx++,Number::New(String::New(shard.c_str())->NumberValue()));
-                }
-                ++itr;
-            }
-            Cache::lazycache const& lazy = c->lazy_;
-            Cache::lazycache_iterator_type litr = lazy.begin();
-            Cache::lazycache_iterator_type lend = lazy.end();
-            while (litr != lend) {
-                if (litr->first.size() > type.size() && litr->first.substr(0,type.size()) == type) {
-                    std::string shard = litr->first.substr(type.size()+1,litr->first.size());
-                    ids->Set(idx++,Number::New(String::New(shard.c_str())->NumberValue()));
-                }
-                ++litr;
-            }
-            NanReturnValue(ids);
+            NanReturnValue(c->list_shards(find_type_id(*String::Utf8Value(args[0]->ToString()))));
         } else if (args.Length() == 2) {
-            std::string shard = *String::Utf8Value(args[1]->ToString());
-            std::string key = type + "-" + shard;
-            Cache::mem_iterator_type itr = mem.find(key);
-            unsigned idx = 0;
-            if (itr != mem.end()) {
-                Cache::arraycache_iterator aitr = itr->second.begin();
-                Cache::arraycache_iterator aend = itr->second.end();
-                while (aitr != aend) {
-                    ids->Set(idx++,Number::New(aitr->first)->ToString());
-                    ++aitr;
-                }
-            }
-            Cache::lazycache const& lazy = c->lazy_;
-            Cache::lazycache_iterator_type litr = lazy.find(key);
-            if (litr != lazy.end()) {
-                Cache::larraycache_iterator laitr = litr->second.begin();
-                Cache::larraycache_iterator laend = litr->second.end();
-                while (laitr != laend) {
-                    ids->Set(idx++,Number::New(laitr->first)->ToString());
-                    ++laitr;
-                }
-            }
-            NanReturnValue(ids);
+            NanReturnValue(c->list_ids(key_arg(args[0], args[1])));
         }
     } catch (std::exception const& ex) {
         return NanThrowTypeError(ex.what());
@@ -199,6 +252,63 @@ NAN_METHOD(Cache::list)
     NanReturnValue(Undefined());
 }
 
+// Shards of `type` in the memory cache followed by those in the lazy cache.
+// Keys sort by type first, so a type's shards are a single range of each.
+Local<Array> Cache::list_shards(unsigned type) {
+    if (type == unknown_type) {
+        return Array::New();
+    }
+    key_type begin = key(type, 0);
+    key_type end = key(type + 1, 0);
+    if (origin_) {
+        Cache::mem_iterator_type oitr = origin_->cache_->lower_bound(begin);
+        for (; oitr != origin_->cache_->end() && oitr->first < end; ++oitr) {
+            pin(oitr->first);
+        }
+        Cache::lazycache_iterator_type olitr = origin_->lazy_->lower_bound(begin);
+        for (; olitr != origin_->lazy_->end() && olitr->first < end; ++olitr) {
+            pin(olitr->first);
+        }
+    }
+    Local<Array> ids = Array::New();
+    unsigned idx = 0;
+    Cache::mem_iterator_type itr = cache_->lower_bound(begin);
+    for (; itr != cache_->end() && itr->first < end; ++itr) {
+        ids->Set(idx++,Number::New(static_cast<double>(key_shard(itr->first))));
+    }
+    Cache::lazycache_iterator_type litr = lazy_->lower_bound(begin);
+    for (; litr != lazy_->end() && litr->first < end; ++litr) {
+        ids->Set(idx++,Number::New(static_cast<double>(key_shard(litr->first))));
+    }
+    return ids;
+}
+
+// Ids of the arrays in shard `key`, as strings.
+Local<Array> Cache::list_ids(key_type key) {
+    pin(key);
+    Local<Array> ids = Array::New();
+    unsigned idx = 0;
+    Cache::mem_iterator_type itr = cache_->find(key);
+    if (itr != cache_->end()) {
+        Cache::arraycache_iterator aitr = itr->second->begin();
+        Cache::arraycache_iterator aend = itr->second->end();
+        while (aitr != aend) {
+            ids->Set(idx++,Number::New(aitr->first)->ToString());
+            ++aitr;
+        }
+    }
+    Cache::lazycache_iterator_type litr = lazy_->find(key);
+    if (litr != lazy_->end()) {
+        Cache::larraycache_iterator laitr = litr->second->begin();
+        Cache::larraycache_iterator laend = litr->second->end();
+        while (laitr != laend) {
+            ids->Set(idx++,Number::New(laitr->first)->ToString());
+            ++laitr;
+        }
+    }
+    return ids;
+}
+
 NAN_METHOD(Cache::_set)
 {
     NanScope();
@@ -222,69 +332,28 @@ NAN_METHOD(Cache::_set)
         return NanThrowTypeError("an array expected for fourth argument");
     }
     try {
-        std::string type = *String::Utf8Value(args[0]->ToString());
-        std::string shard = *String::Utf8Value(args[1]->ToString());
-        std::string key = type + "-" + shard;
-        Cache* c = node::ObjectWrap::Unwrap<Cache>(args.This());
-        Cache::memcache & mem = c->cache_;
-        Cache::mem_iterator_type itr = mem.find(key);
-        if (itr == mem.end()) {
-            c->cache_.insert(std::make_pair(key,Cache::arraycache()));
-        }
-        Cache::arraycache & arrc = c->cache_[key];
-        Cache::arraycache::key_type key_id = static_cast<Cache::arraycache::key_type>(args[2]->IntegerValue());
-        Cache::arraycache_iterator itr2 = arrc.find(key_id);
-        if (itr2 == arrc.end()) {
-            arrc.insert(std::make_pair(key_id,Cache::intarray()));
-        }
-        Cache::intarray & vv = arrc[key_id];
-        if (itr2 != arrc.end()) {
-            vv.clear();
-        }
-        unsigned array_size = data->Length();
-        vv.reserve(array_size);
-        for (unsigned i=0;i<array_size;++i) {
-#ifdef USE_CXX11
-            vv.emplace_back(data->Get(i)->NumberValue());
-#else
-            vv.push_back(data->Get(i)->NumberValue());
-#endif
-        }
+        Cache::key_type key = intern_key_arg(args[0], args[1]);
+        Cache* c = node::ObjectWrap::Unwrap<Cache>(args.This())->live();
+        Cache::int_type key_id = static_cast<Cache::int_type>(args[2]->IntegerValue());
+        Cache::intarray vv;
+        array_arg(data, vv);
+        c->set(key, key_id, vv);
     } catch (std::exception const& ex) {
         return NanThrowTypeError(ex.what());
     }
     NanReturnValue(Undefined());
 }
 
-void load_into_cache(Cache::larraycache & larrc,
-                            std::string const& key,
-                            const char * data,
-                            size_t size) {
-    protobuf::message message(data,size);
-    while (message.next()) {
-        if (message.tag == 1) {
-            uint64_t len = message.varint();
-            protobuf::message item(message.getData(), static_cast<std::size_t>(len));
-            while (item.next()) {
-                if (item.tag == 1) {
-                    uint64_t key_id = item.varint();
-                    // NOTE: emplace is faster with libcxx if using std::string
-                    // if using boost::string_ref, std::move is faster
+// Copy the numbers of a JS array.
+void Cache::array_arg(Local<Array> data, intarray & vv) {
+    unsigned array_size = data->Length();
+    vv.reserve(array_size);
+    for (unsigned i=0;i<array_size;++i) {
 #ifdef USE_CXX11
-                    larrc.insert(std::make_pair(key_id,std::move(Cache::string_ref_type(message.getData(),len))));
+        vv.emplace_back(data->Get(i)->NumberValue());
 #else
-                    larrc.insert(std::make_pair(key_id,Cache::string_ref_type(message.getData(),len)));
+        vv.push_back(data->Get(i)->NumberValue());
 #endif
-                }
-                // it is safe to break immediately because tag 1 should come first
-                break;
-            }
-            message.skipBytes(len);
-        } else {
-            std::stringstream msg("");
-            msg << "load: hit unknown protobuf type: '" << message.tag << "'";
-            throw std::runtime_error(msg.str());
-        }
     }
 }
 
@@ -311,48 +380,40 @@ NAN_METHOD(Cache::loadSync)
         return NanThrowTypeError("third arg 'shard' must be an Integer");
     }
     try {
-        std::string type = *String::Utf8Value(args[1]->ToString());
-        std::string shard = *String::Utf8Value(args[2]->ToString());
-        std::string key = type + "-" + shard;
-        Cache* c = node::ObjectWrap::Unwrap<Cache>(args.This());
-        Cache::memcache & mem = c->cache_;
-        Cache::mem_iterator_type itr = mem.find(key);
-        if (itr != mem.end()) {
-            c->cache_.insert(std::make_pair(key,arraycache()));
-        }
-        Cache::memcache::iterator itr2 = mem.find(key);
-        if (itr2 != mem.end()) {
-            mem.erase(itr2);
-        }
-        Cache::lazycache & lazy = c->lazy_;
-        Cache::lazycache_iterator_type litr = lazy.find(key);
-        if (litr == lazy.end()) {
-            c->lazy_.insert(std::make_pair(key,Cache::larraycache()));
-        }
-        load_into_cache(c->lazy_[key],key,node::Buffer::Data(obj),node::Buffer::Length(obj));
+        Cache* c = node::ObjectWrap::Unwrap<Cache>(args.This())->live();
+        c->load_shard(intern_key_arg(args[1], args[2]),node::Buffer::Data(obj),node::Buffer::Length(obj));
     } catch (std::exception const& ex) {
         return NanThrowTypeError(ex.what());
     }
     NanReturnValue(Undefined());
 }
 
+void Cache::load_shard(key_type key, const char * data, std::size_t size) {
+    // Build the new version of the shard before publishing it so that
+    // a decode error leaves the current version in place.
+    Cache::larraycache_ptr arrc(new Cache::larraycache());
+    load_into_cache(*arrc,data,size);
+    publish(key, arrc);
+    bump(key);
+}
+
 struct load_baton {
     uv_work_t request;
     Cache * c;
     NanCallback cb;
-    Cache::larraycache arrc;
-    std::string key;
+    Cache::larraycache_ptr arrc;
+    Cache::key_type key;
     std::string data;
     bool error;
     std::string error_name;
-    load_baton(std::string const& _key,
+    load_baton(Cache::key_type _key,
                const char * _data,
                size_t size,
                Local<Function> callbackHandle,
                Cache * _c) :
       c(_c),
       cb(callbackHandle),
-      arrc(),
+      arrc(new Cache::larraycache()),
       key(_key),
       data(_data,size),
       error(false),
@@ -369,7 +430,7 @@ struct load_baton {
 void Cache::AsyncLoad(uv_work_t* req) {
     load_baton *closure = static_cast<load_baton *>(req->data);
     try {
-        load_into_cache(closure->arrc,closure->key,closure->data.data(),closure->data.size());
+        load_into_cache(*closure->arrc,closure->data.data(),closure->data.size());
     }
     catch (std::exception const& ex)
     {
@@ -386,15 +447,10 @@ void Cache::AfterLoad(uv_work_t* req) {
         Local<Value> argv[1] = { Exception::Error(String::New(closure->error_name.c_str())) };
         closure->cb.Call(1, argv);
     } else {
-        Cache::memcache::iterator itr2 = closure->c->cache_.find(closure->key);
-        if (itr2 != closure->c->cache_.end()) {
-            closure->c->cache_.erase(itr2);
-        }
-#ifdef USE_CXX11
-        closure->c->lazy_[closure->key] = std::move(closure->arrc);
-#else
-        closure->c->lazy_[closure->key] = closure->arrc;
-#endif
+        // Publish the version built off the main thread. Snapshots taken
+        // before keep reading the previous version.
+        closure->c->publish(closure->key, closure->arrc);
+        closure->c->bump(closure->key);
         Local<Value> argv[1] = { Local<Value>::New(Null()) };
         closure->cb.Call(1, argv);
     }
@@ -432,21 +488,392 @@ NAN_METHOD(Cache::load)
         return NanThrowTypeError("third arg 'shard' must be an Integer");
     }
     try {
-        std::string type = *String::Utf8Value(args[1]->ToString());
-        std::string shard = *String::Utf8Value(args[2]->ToString());
-        std::string key = type + "-" + shard;
-        load_baton *closure = new load_baton(key,
-                                             node::Buffer::Data(obj),
-                                             node::Buffer::Length(obj),
-                                             args[3].As<Function>(),
-                                             node::ObjectWrap::Unwrap<Cache>(args.This()));
-        uv_queue_work(uv_default_loop(), &closure->request, AsyncLoad, (uv_after_work_cb)AfterLoad);
+        Cache* c = node::ObjectWrap::Unwrap<Cache>(args.This())->live();
+        c->load_shard(intern_key_arg(args[1], args[2]),
+                      node::Buffer::Data(obj),
+                      node::Buffer::Length(obj),
+                      args[3].As<Function>());
         NanReturnValue(Undefined());
     } catch (std::exception const& ex) {
         return NanThrowTypeError(ex.what());
     }
 }
 
+// Decode shard `key` off the main thread and publish it before calling
+// back with `(err)`.
+void Cache::load_shard(key_type key, const char * data, std::size_t size, Local<Function> callback) {
+    load_baton *closure = new load_baton(key, data, size, callback, this);
+    uv_queue_work(uv_default_loop(), &closure->request, AsyncLoad, (uv_after_work_cb)AfterLoad);
+}
+
+// Call and drop the callbacks waiting on shard `key` with `(err)`, or
+// `(err, ms)` given the time the shard took to decode.
+void Cache::notify(key_type key, Handle<Value> err, Handle<Value> ms) {
+    Cache::inflightcache::iterator itr = inflight_.find(key);
+    if (itr == inflight_.end()) {
+        return;
+    }
+    Cache::waiters waiting;
+    waiting.swap(itr->second);
+    inflight_.erase(itr);
+    for (std::size_t i = 0; i < waiting.size(); ++i) {
+        TryCatch try_catch;
+        Local<Value> argv[2] = { Local<Value>::New(err), Local<Value>::New(ms) };
+        waiting[i]->Call(ms.IsEmpty() ? 1 : 2, argv);
+        delete waiting[i];
+        if (try_catch.HasCaught()) {
+            node::FatalException(try_catch);
+        }
+    }
+}
+
+// A snapshot holds the shard tables its origin had published when it was
+// taken, so every shard loaded then reads at that version. A shard the
+// origin loads later, e.g. fetched for the snapshot by getall, is not in
+// them: it is pinned on first touch and read at that version from then on.
+void Cache::pin(key_type key) {
+    if (!origin_ || cache_->find(key) != cache_->end() || lazy_->find(key) != lazy_->end()) {
+        return;
+    }
+    Cache::mem_iterator_type itr = origin_->cache_->find(key);
+    if (itr != origin_->cache_->end()) {
+        writable_cache().insert(*itr);
+    }
+    Cache::lazycache_iterator_type litr = origin_->lazy_->find(key);
+    if (litr != origin_->lazy_->end()) {
+        writable_lazy().insert(*litr);
+    }
+}
+
+// The memory cache table, copied first if a snapshot holds it. The copy
+// shares every shard version, it only costs a pointer per shard.
+Cache::memcache & Cache::writable_cache() {
+    if (cache_.use_count() > 1) {
+        cache_.reset(new Cache::memcache(*cache_));
+    }
+    return *cache_;
+}
+
+// The lazy cache table, copied first if a snapshot holds it.
+Cache::lazycache & Cache::writable_lazy() {
+    if (lazy_.use_count() > 1) {
+        lazy_.reset(new Cache::lazycache(*lazy_));
+    }
+    return *lazy_;
+}
+
+// Replace shard `key` with the lazily loaded version `arrc`.
+void Cache::publish(key_type key, larraycache_ptr const& arrc) {
+    Cache::mem_iterator_type itr = cache_->find(key);
+    if (itr != cache_->end()) {
+        Cache::arraycache_ptr old = itr->second;
+        writable_cache().erase(key);
+        supersede(old);
+    }
+    Cache::larraycache_ptr & slot = writable_lazy()[key];
+    Cache::larraycache_ptr old = slot;
+    slot = arrc;
+    supersede(old);
+}
+
+// Count a load, write or unload of shard `key`, see _wait. Anything but
+// a feature shard also changes the generation results cached by
+// QueryCache are checked against. Features are loaded and unloaded by
+// reads, see lib/util/feature.js, index writes invalidate() instead.
+void Cache::bump(key_type key) {
+    ++versions_[key];
+    if ((key >> 32) != feature_type) {
+        ++generation_;
+    }
+}
+
+uint64_t Cache::version(key_type key) const {
+    Cache::versionarray::const_iterator itr = versions_.find(key);
+    return itr != versions_.end() ? itr->second : 0;
+}
+
+// Called with a shard version the cache no longer holds. If a snapshot
+// still reads it, its memory is reported to V8 until sweep() finds it
+// released.
+template <typename T>
+void Cache::supersede(shared_ptr<T> const& version) {
+    // the caller holds `version`, any other owner is a snapshot
+    if (!version || version.use_count() < 2) {
+        return;
+    }
+    std::size_t bytes = shard_bytes(*version);
+    superseded_.push_back(std::make_pair(weak_ptr<void>(version), bytes));
+    pinned_bytes_ += bytes;
+    adjust_external_memory(static_cast<int64_t>(bytes));
+}
+
+// Stop reporting superseded versions every snapshot has released.
+void Cache::sweep() {
+    std::size_t freed = 0;
+    Cache::supersededarray::iterator itr = superseded_.begin();
+    while (itr != superseded_.end()) {
+        if (itr->first.expired()) {
+            freed += itr->second;
+            itr = superseded_.erase(itr);
+        } else {
+            ++itr;
+        }
+    }
+    if (freed) {
+        pinned_bytes_ -= freed;
+        adjust_external_memory(-static_cast<int64_t>(freed));
+    }
+}
+
+// Release the shard tables of a snapshot and its hold on the origin.
+// Leaves an empty cache, a no-op on a cache that is not a snapshot.
+void Cache::detach() {
+    if (!origin_) {
+        return;
+    }
+    cache_.reset(new Cache::memcache());
+    lazy_.reset(new Cache::lazycache());
+    address_.clear();
+    Cache * origin = origin_;
+    origin_ = NULL;
+    --snapshot_count;
+    origin->sweep();
+    origin->_unref();
+}
+
+// Address data is derived from a feature shard. Snapshots share the origin's
+// address data for as long as they read the same version of the shard.
+Cache * Cache::address_cache(key_type key) {
+    if (!origin_) {
+        return this;
+    }
+    pin(key);
+    Cache::lazycache_iterator_type litr = lazy_->find(key);
+    Cache::lazycache_iterator_type olitr = origin_->lazy_->find(key);
+    bool pinned = litr != lazy_->end();
+    bool current = olitr != origin_->lazy_->end();
+    if (pinned != current || (pinned && litr->second != olitr->second)) {
+        return this;
+    }
+    return origin_;
+}
+
+NAN_METHOD(Cache::_snapshot)
+{
+    NanScope();
+    try {
+        Cache* c = node::ObjectWrap::Unwrap<Cache>(args.This())->live();
+        Local<Value> argv[2] = { String::New(c->id_.c_str()), Number::New(c->shardlevel_) };
+        Local<Object> obj = NanPersistentToLocal(constructor)->GetFunction()->NewInstance(2, argv);
+        if (obj.IsEmpty()) {
+            NanReturnValue(Undefined());
+        }
+        Cache* snap = node::ObjectWrap::Unwrap<Cache>(obj);
+        snap->origin_ = c;
+        ++snapshot_count;
+        snap->cache_ = c->cache_;
+        snap->lazy_ = c->lazy_;
+        c->_ref();
+        NanReturnValue(obj);
+    } catch (std::exception const& ex) {
+        return NanThrowTypeError(ex.what());
+    }
+}
+
+NAN_METHOD(Cache::release)
+{
+    NanScope();
+    Cache* c = node::ObjectWrap::Unwrap<Cache>(args.This());
+    c->detach();
+    NanReturnValue(Undefined());
+}
+
+// Number of snapshots not yet released or collected, to check they are
+// not leaked.
+NAN_METHOD(Cache::snapshots)
+{
+    NanScope();
+    NanReturnValue(Number::New(snapshot_count));
+}
+
+NAN_METHOD(Cache::_handle)
+{
+    NanScope();
+    if (args.Length() < 1 || !args[0]->IsString()) {
+        return NanThrowTypeError("first arg 'type' must be a String");
+    }
+    Local<Value> argv[2] = { args.This(), args[0] };
+    Local<Object> obj = NanPersistentToLocal(CacheHandle::constructor)->GetFunction()->NewInstance(2, argv);
+    if (obj.IsEmpty()) {
+        NanReturnValue(Undefined());
+    }
+    NanReturnValue(obj);
+}
+
+NAN_METHOD(Cache::_wait)
+{
+    NanScope();
+    if (args.Length() < 3) {
+        return NanThrowTypeError("expected three args: 'type', 'shard' and 'callback'");
+    }
+    if (!args[0]->IsString()) {
+        return NanThrowTypeError("first arg must be a String");
+    }
+    if (!args[1]->IsNumber()) {
+        return NanThrowTypeError("second arg must be an Integer");
+    }
+    if (!args[2]->IsFunction()) {
+        return NanThrowTypeError("third arg must be a Function");
+    }
+    try {
+        Cache::key_type key = intern_key_arg(args[0], args[1]);
+        Cache* c = node::ObjectWrap::Unwrap<Cache>(args.This())->live();
+        Cache::inflightcache::iterator itr = c->inflight_.find(key);
+        bool first = itr == c->inflight_.end();
+        if (first) {
+            itr = c->inflight_.insert(std::make_pair(key,Cache::waiters())).first;
+            // A load, write or unload made while the fetch is in flight is
+            // newer than what it returns, see AfterSettle.
+            c->fetching_[key] = c->version(key);
+        }
+        itr->second.push_back(new NanCallback(args[2].As<Function>()));
+        NanReturnValue(Boolean::New(first));
+    } catch (std::exception const& ex) {
+        return NanThrowTypeError(ex.what());
+    }
+}
+
+struct settle_baton {
+    uv_work_t request;
+    Cache * c;
+    Cache::larraycache_ptr arrc;
+    Cache::key_type key;
+    // version of the shard when the fetch started
+    uint64_t version;
+    std::string data;
+    // histogram decode time is recorded to, if any
+    Metrics * metrics;
+    unsigned stage;
+    uint64_t ns;
+    bool error;
+    std::string error_name;
+    settle_baton(Cache::key_type _key,
+                 uint64_t _version,
+                 const char * _data,
+                 size_t size,
+                 Cache * _c,
+                 Metrics * _metrics,
+                 unsigned _stage) :
+      c(_c),
+      arrc(new Cache::larraycache()),
+      key(_key),
+      version(_version),
+      data(_data,size),
+      metrics(_metrics),
+      stage(_stage),
+      ns(0),
+      error(false),
+      error_name() {
+        request.data = this;
+        c->_ref();
+        if (metrics) metrics->_ref();
+      }
+    ~settle_baton() {
+         c->_unref();
+         if (metrics) metrics->_unref();
+    }
+};
+
+void Cache::AsyncSettle(uv_work_t* req) {
+    settle_baton *closure = static_cast<settle_baton *>(req->data);
+    uint64_t start = uv_hrtime();
+    try {
+        load_into_cache(*closure->arrc,closure->data.data(),closure->data.size());
+    }
+    catch (std::exception const& ex)
+    {
+        closure->error = true;
+        closure->error_name = ex.what();
+    }
+    closure->ns = uv_hrtime() - start;
+    if (closure->metrics) {
+        closure->metrics->add(closure->stage, closure->ns);
+    }
+}
+
+void Cache::AfterSettle(uv_work_t* req) {
+    NanScope();
+    settle_baton *closure = static_cast<settle_baton *>(req->data);
+    if (closure->error) {
+        closure->c->notify(closure->key, Exception::Error(String::New(closure->error_name.c_str())));
+    } else {
+        // Drop the fetched version if the shard was loaded, written or
+        // unloaded since the fetch started: it may be older.
+        if (closure->c->version(closure->key) == closure->version) {
+            closure->c->publish(closure->key, closure->arrc);
+        }
+        closure->c->notify(closure->key, Null(), Number::New(static_cast<double>(closure->ns) / 1e6));
+    }
+    delete closure;
+}
+
+NAN_METHOD(Cache::_settle)
+{
+    NanScope();
+    if (args.Length() < 4) {
+        return NanThrowTypeError("expected four args: 'type', 'shard', 'error' and 'buffer'");
+    }
+    Metrics * metrics = NULL;
+    unsigned stage = 0;
+    if (args.Length() > 5 && args[4]->IsObject() && NanPersistentToLocal(Metrics::constructor)->HasInstance(args[4])) {
+        if (!args[5]->IsNumber()) {
+            return NanThrowTypeError("sixth arg 'stage' must be an Integer");
+        }
+        metrics = node::ObjectWrap::Unwrap<Metrics>(args[4]->ToObject());
+        stage = static_cast<unsigned>(args[5]->IntegerValue());
+        if (stage >= metrics->histograms_.size()) {
+            return NanThrowTypeError("unknown stage");
+        }
+    }
+    if (!args[0]->IsString()) {
+        return NanThrowTypeError("first arg must be a String");
+    }
+    if (!args[1]->IsNumber()) {
+        return NanThrowTypeError("second arg must be an Integer");
+    }
+    try {
+        Cache::key_type key = intern_key_arg(args[0], args[1]);
+        Cache* c = node::ObjectWrap::Unwrap<Cache>(args.This())->live();
+        uint64_t version = c->version(key);
+        Cache::versionarray::iterator fitr = c->fetching_.find(key);
+        if (fitr != c->fetching_.end()) {
+            version = fitr->second;
+            c->fetching_.erase(fitr);
+        }
+        if (!args[2]->IsNull() && !args[2]->IsUndefined()) {
+            c->notify(key, args[2]);
+        } else if (args[3]->IsObject() && node::Buffer::HasInstance(args[3])) {
+            // Decode off the main thread. Misses for this shard keep joining
+            // the waiters until the decoded shard is published.
+            Local<Object> obj = args[3]->ToObject();
+            settle_baton *closure = new settle_baton(key,
+                                                     version,
+                                                     node::Buffer::Data(obj),
+                                                     node::Buffer::Length(obj),
+                                                     c,
+                                                     metrics,
+                                                     stage);
+            uv_queue_work(uv_default_loop(), &closure->request, AsyncSettle, (uv_after_work_cb)AfterSettle);
+        } else {
+            // no data for this shard
+            c->notify(key, Null());
+        }
+    } catch (std::exception const& ex) {
+        return NanThrowTypeError(ex.what());
+    }
+    NanReturnValue(Undefined());
+}
+
 NAN_METHOD(Cache::has)
 {
     NanScope();
@@ -460,27 +887,108 @@ NAN_METHOD(Cache::has)
         return NanThrowTypeError("second arg must be an Integer");
     }
     try {
-        std::string type = *String::Utf8Value(args[0]->ToString());
-        std::string shard = *String::Utf8Value(args[1]->ToString());
-        std::string key = type + "-" + shard;
         Cache* c = node::ObjectWrap::Unwrap<Cache>(args.This());
-        Cache::memcache const& mem = c->cache_;
-        Cache::mem_iterator_type itr = mem.find(key);
-        if (itr != mem.end()) {
-            NanReturnValue(True());
-        } else {
-            Cache::lazycache const& lazy = c->lazy_;
-            Cache::lazycache_iterator_type litr = lazy.find(key);
-            if (litr != lazy.end()) {
-                NanReturnValue(True());
-            }
-            NanReturnValue(False());
-        }
+        NanReturnValue(Boolean::New(c->has_shard(key_arg(args[0], args[1]))));
     } catch (std::exception const& ex) {
         return NanThrowTypeError(ex.what());
     }
 }
 
+bool Cache::has_shard(key_type key) {
+    pin(key);
+    return cache_->find(key) != cache_->end() || lazy_->find(key) != lazy_->end();
+}
+
+// Copy array `id` of shard `key` into `array`, decoding it if the shard is
+// lazily loaded. Returns false if the shard or the id is not loaded.
+bool Cache::get(key_type key, int_type id, intarray & array) {
+    pin(key);
+    Cache::mem_iterator_type itr = cache_->find(key);
+    if (itr != cache_->end()) {
+        Cache::arraycache_iterator aitr = itr->second->find(static_cast<Cache::arraycache::key_type>(id));
+        if (aitr == itr->second->end()) {
+            return false;
+        }
+        array = aitr->second;
+        return true;
+    }
+    Cache::lazycache_iterator_type litr = lazy_->find(key);
+    if (litr == lazy_->end()) {
+        return false;
+    }
+    Cache::larraycache_iterator laitr = litr->second->find(id);
+    if (laitr == litr->second->end()) {
+        return false;
+    }
+    decode_array(laitr->second, array);
+    return true;
+}
+
+// Replace array `id` of shard `key` with the contents of `array`. The shard
+// is copied first if a snapshot holds it.
+void Cache::set(key_type key, int_type id, intarray & array) {
+    Cache::arraycache_ptr & arrc = writable_cache()[key];
+    if (!arrc) {
+        arrc.reset(new Cache::arraycache());
+    } else if (arrc.use_count() > 1) {
+        Cache::arraycache_ptr old = arrc;
+        arrc.reset(new Cache::arraycache(*old));
+        supersede(old);
+    }
+    (*arrc)[static_cast<Cache::arraycache::key_type>(id)].swap(array);
+    bump(key);
+}
+
+// `shardlevel` is backed by the native value so that shards computed in
+// JS, by CacheHandle and by the Indexer always agree. Set it before any
+// shard is loaded.
+NAN_GETTER(Cache::getShardlevel)
+{
+    NanScope();
+    Cache* c = node::ObjectWrap::Unwrap<Cache>(args.This());
+    NanReturnValue(Number::New(c->shardlevel()));
+}
+
+NAN_SETTER(Cache::setShardlevel)
+{
+    NanScope();
+    if (!value->IsNumber()) {
+        NanThrowTypeError("shardlevel must be a number");
+        return;
+    }
+    Cache* c = node::ObjectWrap::Unwrap<Cache>(args.This())->live();
+    c->shardlevel_ = static_cast<unsigned>(value->IntegerValue());
+}
+
+// The live cache's generation, see bump().
+NAN_GETTER(Cache::getGeneration)
+{
+    NanScope();
+    Cache* c = node::ObjectWrap::Unwrap<Cache>(args.This())->live();
+    NanReturnValue(Number::New(static_cast<double>(c->generation_)));
+}
+
+// Change the generation without loading anything, so that results cached
+// before are not served.
+NAN_METHOD(Cache::invalidate)
+{
+    NanScope();
+    Cache* c = node::ObjectWrap::Unwrap<Cache>(args.This())->live();
+    ++c->generation_;
+    NanReturnValue(Undefined());
+}
+
+// Key of the shard holding `id`, matching Cache.shard in
+// lib/util/cxxcache.js.
+Cache::key_type Cache::shard_key(unsigned type, int_type id) const {
+    int_type shard = 0;
+    unsigned level = shardlevel();
+    if (level > 0) {
+        shard = (id >> (32 - level * 4)) & 0xffffffff;
+    }
+    return key(type, shard);
+}
+
 NAN_METHOD(Cache::_get)
 {
     NanScope();
@@ -497,108 +1005,583 @@ NAN_METHOD(Cache::_get)
         return NanThrowTypeError("third arg must be an Integer");
     }
     try {
-        std::string type = *String::Utf8Value(args[0]->ToString());
-        std::string shard = *String::Utf8Value(args[1]->ToString());
+        Cache::key_type key = key_arg(args[0], args[1]);
         uint64_t id = static_cast<uint64_t>(args[2]->IntegerValue());
-        std::string key = type + "-" + shard;
         Cache* c = node::ObjectWrap::Unwrap<Cache>(args.This());
-        Cache::memcache const& mem = c->cache_;
-        Cache::mem_iterator_type itr = mem.find(key);
-        if (itr == mem.end()) {
-            Cache::lazycache const& lazy = c->lazy_;
-            Cache::lazycache_iterator_type litr = lazy.find(key);
-            if (litr == lazy.end()) {
-                NanReturnValue(Undefined());
+        NanReturnValue(c->get_array(key, id));
+    } catch (std::exception const& ex) {
+        return NanThrowTypeError(ex.what());
+    }
+}
+
+// Array `id` of shard `key` as a JS array, or undefined.
+Local<Value> Cache::get_array(key_type key, int_type id) {
+    Cache::intarray array;
+    if (!get(key, id, array)) {
+        return Local<Value>::New(Undefined());
+    }
+    std::size_t vals_size = array.size();
+    Local<Array> arr_obj = Array::New(static_cast<int>(vals_size));
+    for (unsigned k=0;k<vals_size;++k) {
+        arr_obj->Set(k,Number::New(array[k]));
+    }
+    return arr_obj;
+}
+
+NAN_METHOD(Cache::unload)
+{
+    NanScope();
+    if (args.Length() < 2) {
+        return NanThrowTypeError("expected at least two args: 'type' and 'shard'");
+    }
+    if (!args[0]->IsString()) {
+        return NanThrowTypeError("first arg must be a String");
+    }
+    if (!args[1]->IsNumber()) {
+        return NanThrowTypeError("second arg must be an Integer");
+    }
+    try {
+        Cache* c = node::ObjectWrap::Unwrap<Cache>(args.This())->live();
+        NanReturnValue(Boolean::New(c->unload_shard(key_arg(args[0], args[1]))));
+    } catch (std::exception const& ex) {
+        return NanThrowTypeError(ex.what());
+    }
+}
+
+// Drop shard `key` and any address data derived from it. Returns whether
+// the shard was loaded.
+bool Cache::unload_shard(key_type key) {
+    bool hit = false;
+    Cache::mem_iterator_type itr = cache_->find(key);
+    if (itr != cache_->end()) {
+        Cache::arraycache_ptr old = itr->second;
+        writable_cache().erase(key);
+        supersede(old);
+        hit = true;
+    }
+    Cache::lazycache_iterator_type litr = lazy_->find(key);
+    if (litr != lazy_->end()) {
+        Cache::larraycache_ptr old = litr->second;
+        writable_lazy().erase(key);
+        supersede(old);
+        hit = true;
+    }
+    address_.erase(key);
+    if (hit) {
+        bump(key);
+    }
+    return hit;
+}
+
+// Feature shards are a sequence of segments, each of which is laid out as
+//
+//   uint8  version
+//   uint32 count
+//   uint32 body length
+//   count x { uint32 id, uint32 offset, uint32 length }
+//   body: feature JSON, offsets relative to the start of the body
+//
+// (all integers little endian). The header lets a reader index a segment
+// without touching feature bodies. Segments loaded later win over earlier
+// ones for the same id so writers can append rather than rewrite a shard.
+static const unsigned char feature_version = 1;
+static const std::size_t feature_header_size = 9;
+static const std::size_t feature_entry_size = 12;
+
+inline uint32_t read_uint32(const char * data) {
+    const unsigned char * p = reinterpret_cast<const unsigned char *>(data);
+    return static_cast<uint32_t>(p[0]) |
+           (static_cast<uint32_t>(p[1]) << 8) |
+           (static_cast<uint32_t>(p[2]) << 16) |
+           (static_cast<uint32_t>(p[3]) << 24);
+}
+
+inline void write_uint32(std::string & out, uint32_t val) {
+    out.push_back(static_cast<char>(val & 0xff));
+    out.push_back(static_cast<char>((val >> 8) & 0xff));
+    out.push_back(static_cast<char>((val >> 16) & 0xff));
+    out.push_back(static_cast<char>((val >> 24) & 0xff));
+}
+
+void load_features(Cache::larraycache & larrc,
+                   const char * data,
+                   std::size_t size) {
+    std::size_t pos = 0;
+    while (pos < size) {
+        std::size_t remaining = size - pos;
+        if (remaining < feature_header_size) {
+            throw std::runtime_error("loadFeatures: truncated segment header");
+        }
+        if (static_cast<unsigned char>(data[pos]) != feature_version) {
+            std::stringstream msg("");
+            msg << "loadFeatures: unknown segment version '" << static_cast<unsigned>(static_cast<unsigned char>(data[pos])) << "'";
+            throw std::runtime_error(msg.str());
+        }
+        std::size_t count = read_uint32(data + pos + 1);
+        std::size_t body_size = read_uint32(data + pos + 5);
+        remaining -= feature_header_size;
+        if (count > remaining / feature_entry_size) {
+            throw std::runtime_error("loadFeatures: truncated segment offset table");
+        }
+        remaining -= count * feature_entry_size;
+        if (body_size > remaining) {
+            throw std::runtime_error("loadFeatures: truncated segment body");
+        }
+        const char * entry = data + pos + feature_header_size;
+        const char * body = entry + count * feature_entry_size;
+        for (std::size_t i = 0; i < count; ++i, entry += feature_entry_size) {
+            Cache::int_type id = read_uint32(entry);
+            std::size_t offset = read_uint32(entry + 4);
+            std::size_t length = read_uint32(entry + 8);
+            if (offset > body_size || length > body_size - offset) {
+                throw std::runtime_error("loadFeatures: feature offset out of range");
             }
-            Cache::larraycache_iterator laitr = litr->second.find(id);
-            if (laitr == litr->second.end()) {
-                NanReturnValue(Undefined());
-            } else {
-                // NOTE: we cannot call array.reserve here since
-                // the total length is not known
-                Cache::intarray array;
-                Cache::string_ref_type const& ref = laitr->second;
-                protobuf::message item(ref.data(), ref.size());
-                while (item.next()) {
-                    if (item.tag == 1) {
-                        item.skip();
-                    } else if (item.tag == 2) {
-                        uint64_t len = item.varint();
-                        protobuf::message pbfarray(item.getData(),static_cast<std::size_t>(len));
-                        while (pbfarray.next()) {
+            larrc[id] = Cache::string_ref_type(body + offset, length);
+        }
+        pos += feature_header_size + count * feature_entry_size + body_size;
+    }
+}
+
+void pack_features(std::string & out,
+                   std::map<Cache::int_type,std::string> const& features) {
+    std::size_t body_size = 0;
+    std::map<Cache::int_type,std::string>::const_iterator itr = features.begin();
+    std::map<Cache::int_type,std::string>::const_iterator end = features.end();
+    for (; itr != end; ++itr) {
+        body_size += itr->second.size();
+    }
+    if (body_size > 0xffffffff) {
+        throw std::runtime_error("packFeatures: segment exceeds 4GB");
+    }
+    out.reserve(out.size() + feature_header_size + features.size() * feature_entry_size + body_size);
+    out.push_back(static_cast<char>(feature_version));
+    write_uint32(out, static_cast<uint32_t>(features.size()));
+    write_uint32(out, static_cast<uint32_t>(body_size));
+    uint32_t offset = 0;
+    for (itr = features.begin(); itr != end; ++itr) {
+        write_uint32(out, static_cast<uint32_t>(itr->first));
+        write_uint32(out, offset);
+        write_uint32(out, static_cast<uint32_t>(itr->second.size()));
+        offset += static_cast<uint32_t>(itr->second.size());
+    }
+    for (itr = features.begin(); itr != end; ++itr) {
+        out.append(itr->second);
+    }
+}
+
+NAN_METHOD(Cache::loadFeatures)
+{
+    NanScope();
+    if (args.Length() < 2) {
+        return NanThrowTypeError("expected two args: 'buffer' and 'shard'");
+    }
+    if (!args[0]->IsObject()) {
+        return NanThrowTypeError("first argument must be a Buffer");
+    }
+    Local<Object> obj = args[0]->ToObject();
+    if (obj->IsNull() || obj->IsUndefined()) {
+        return NanThrowTypeError("a buffer expected for first argument");
+    }
+    if (!node::Buffer::HasInstance(obj)) {
+        return NanThrowTypeError("first argument must be a Buffer");
+    }
+    if (!args[1]->IsNumber()) {
+        return NanThrowTypeError("second arg 'shard' must be an Integer");
+    }
+    try {
+        Cache::key_type key = feature_key(shard_arg(args[1]));
+        Cache* c = node::ObjectWrap::Unwrap<Cache>(args.This())->live();
+        // Decode into a scratch table first so a malformed segment leaves
+        // the features already loaded for this shard untouched.
+        Cache::larraycache loaded;
+        load_features(loaded,node::Buffer::Data(obj),node::Buffer::Length(obj));
+        // Address data is derived from feature JSON, drop it for the shard
+        // rather than track which features a segment replaces.
+        c->address_.erase(key);
+        c->bump(key);
+        Cache::larraycache_ptr & larrc_ptr = c->writable_lazy()[key];
+        if (!larrc_ptr) {
+            larrc_ptr.reset(new Cache::larraycache());
+        } else if (larrc_ptr.use_count() > 1) {
+            Cache::larraycache_ptr old = larrc_ptr;
+            larrc_ptr.reset(new Cache::larraycache(*old));
+            c->supersede(old);
+        }
+        Cache::larraycache & larrc = *larrc_ptr;
+        Cache::larraycache::iterator litr = loaded.begin();
+        Cache::larraycache::iterator lend = loaded.end();
+        while (litr != lend) {
 #ifdef USE_CXX11
-                            array.emplace_back(pbfarray.value);
+            larrc[litr->first] = std::move(litr->second);
 #else
-                            array.push_back(pbfarray.value);
+            larrc[litr->first] = litr->second;
 #endif
-                        }
-                        item.skipBytes(len);
-                    } else {
-                        std::stringstream msg("");
-                        msg << "cxx get: hit unknown protobuf type: '" << item.tag << "'";
-                        throw std::runtime_error(msg.str());
-                    }
-                }
-                std::size_t vals_size = array.size();
-                Local<Array> arr_obj = Array::New(static_cast<int>(vals_size));
-                for (unsigned k=0;k<vals_size;++k) {
-                    arr_obj->Set(k,Number::New(array[k]));
-                }
-                NanReturnValue(arr_obj);
+            ++litr;
+        }
+    } catch (std::exception const& ex) {
+        return NanThrowTypeError(ex.what());
+    }
+    NanReturnValue(Undefined());
+}
+
+NAN_METHOD(Cache::packFeatures)
+{
+    NanScope();
+    if (args.Length() < 1) {
+        return NanThrowTypeError("expected one arg: 'features'");
+    }
+    if (!args[0]->IsObject()) {
+        return NanThrowTypeError("first argument must be an Object");
+    }
+    try {
+        Local<Object> features = args[0]->ToObject();
+        Local<Array> ids = features->GetPropertyNames();
+        std::map<Cache::int_type,std::string> sorted;
+        uint32_t ids_size = ids->Length();
+        for (uint32_t i=0;i<ids_size;++i) {
+            Local<Value> id = ids->Get(i);
+            Local<Value> data = features->Get(id);
+            if (!data->IsString()) {
+                throw std::runtime_error("packFeatures: feature data must be a String");
             }
-        } else {
-            Cache::arraycache_iterator aitr = itr->second.find(id);
-            if (aitr == itr->second.end()) {
-                NanReturnValue(Undefined());
-            } else {
-                Cache::intarray const& array = aitr->second;
-                unsigned vals_size = array.size();
-                Local<Array> arr_obj = Array::New(static_cast<int>(vals_size));
-                for (unsigned k=0;k<vals_size;++k) {
-                    arr_obj->Set(k,Number::New(array[k]));
-                }
-                NanReturnValue(arr_obj);
+            double id_val = id->NumberValue();
+            if (!(id_val >= 0 && id_val <= 0xffffffff)) {
+                throw std::runtime_error("packFeatures: feature id must be a 32-bit unsigned int");
             }
+            String::Utf8Value utf8(data);
+            sorted[static_cast<Cache::int_type>(id_val)] = std::string(*utf8, static_cast<std::size_t>(utf8.length()));
         }
+        std::string segment;
+        pack_features(segment, sorted);
+#if NODE_VERSION_AT_LEAST(0, 11, 0)
+        Local<Object> retbuf = node::Buffer::New(segment.data(),segment.size());
+        NanReturnValue(retbuf);
+#else
+        node::Buffer *retbuf = node::Buffer::New(segment.data(),segment.size());
+        NanReturnValue(retbuf->handle_);
+#endif
     } catch (std::exception const& ex) {
         return NanThrowTypeError(ex.what());
     }
 }
 
-NAN_METHOD(Cache::unload)
+// Version of feature shard `shard` this cache reads, counting the loads,
+// writes and unloads made to it, see bump(). -1 for a snapshot that reads
+// a version its cache has since replaced.
+NAN_METHOD(Cache::_featureVersion)
+{
+    NanScope();
+    if (args.Length() < 1 || !args[0]->IsNumber()) {
+        return NanThrowTypeError("first arg must be an Integer");
+    }
+    try {
+        Cache::key_type key = feature_key(shard_arg(args[0]));
+        Cache* c = node::ObjectWrap::Unwrap<Cache>(args.This());
+        if (c->origin_ && c->address_cache(key) == c) {
+            NanReturnValue(Number::New(-1));
+        }
+        NanReturnValue(Number::New(static_cast<double>(c->live()->version(key))));
+    } catch (std::exception const& ex) {
+        return NanThrowTypeError(ex.what());
+    }
+}
+
+// Pack every feature loaded for `shard` into a single segment, used to
+// rewrite a shard once features are merged into it.
+NAN_METHOD(Cache::packFeatureShard)
+{
+    NanScope();
+    if (args.Length() < 1 || !args[0]->IsNumber()) {
+        return NanThrowTypeError("first arg must be an Integer");
+    }
+    try {
+        Cache::key_type key = feature_key(shard_arg(args[0]));
+        Cache* c = node::ObjectWrap::Unwrap<Cache>(args.This());
+        c->pin(key);
+        Cache::lazycache_iterator_type litr = c->lazy_->find(key);
+        if (litr == c->lazy_->end()) {
+            throw std::runtime_error("packFeatureShard: shard is not loaded");
+        }
+        std::string segment;
+        pack_features(segment, *litr->second);
+#if NODE_VERSION_AT_LEAST(0, 11, 0)
+        Local<Object> retbuf = node::Buffer::New(segment.data(),segment.size());
+        NanReturnValue(retbuf);
+#else
+        node::Buffer *retbuf = node::Buffer::New(segment.data(),segment.size());
+        NanReturnValue(retbuf->handle_);
+#endif
+    } catch (std::exception const& ex) {
+        return NanThrowTypeError(ex.what());
+    }
+}
+
+NAN_METHOD(Cache::_getFeature)
 {
     NanScope();
     if (args.Length() < 2) {
-        return NanThrowTypeError("expected at least two args: 'type' and 'shard'");
+        return NanThrowTypeError("expected two args: shard and id");
     }
-    if (!args[0]->IsString()) {
-        return NanThrowTypeError("first arg must be a String");
+    if (!args[0]->IsNumber()) {
+        return NanThrowTypeError("first arg must be an Integer");
     }
     if (!args[1]->IsNumber()) {
         return NanThrowTypeError("second arg must be an Integer");
     }
-    bool hit = false;
     try {
-        std::string type = *String::Utf8Value(args[0]->ToString());
-        std::string shard = *String::Utf8Value(args[1]->ToString());
-        std::string key = type + "-" + shard;
+        Cache::key_type key = feature_key(shard_arg(args[0]));
+        uint64_t id = static_cast<uint64_t>(args[1]->IntegerValue());
         Cache* c = node::ObjectWrap::Unwrap<Cache>(args.This());
-        Cache::memcache & mem = c->cache_;
-        Cache::memcache::iterator itr = mem.find(key);
-        if (itr != mem.end()) {
-            hit = true;
-            mem.erase(itr);
-        }
-        Cache::lazycache & lazy = c->lazy_;
-        Cache::lazycache::iterator litr = lazy.find(key);
-        if (litr != lazy.end()) {
-            hit = true;
-            lazy.erase(litr);
+        c->pin(key);
+        Cache::lazycache const& lazy = *c->lazy_;
+        Cache::lazycache_iterator_type litr = lazy.find(key);
+        if (litr == lazy.end()) {
+            NanReturnValue(Undefined());
+        }
+        Cache::larraycache_iterator laitr = litr->second->find(id);
+        if (laitr == litr->second->end()) {
+            NanReturnValue(Undefined());
+        }
+        Cache::string_ref_type const& ref = laitr->second;
+        NanReturnValue(String::New(ref.data(), static_cast<int>(ref.size())));
+    } catch (std::exception const& ex) {
+        return NanThrowTypeError(ex.what());
+    }
+}
+
+template <typename T>
+void copy_typed_array(Local<Value> val,
+                      ExternalArrayType type,
+                      std::vector<T> & out,
+                      const char * name) {
+    if (!val->IsObject()) {
+        std::stringstream msg("");
+        msg << "'" << name << "' must be a typed array";
+        throw std::runtime_error(msg.str());
+    }
+    Local<Object> obj = val->ToObject();
+    if (!obj->HasIndexedPropertiesInExternalArrayData() ||
+        obj->GetIndexedPropertiesExternalArrayDataType() != type) {
+        std::stringstream msg("");
+        msg << "'" << name << "' has the wrong typed array type";
+        throw std::runtime_error(msg.str());
+    }
+    const T * data = static_cast<const T *>(obj->GetIndexedPropertiesExternalArrayData());
+    int length = obj->GetIndexedPropertiesExternalArrayDataLength();
+    out.assign(data, data + length);
+}
+
+// Fill in cumulative distances along each line and check that ranges,
+// parity and line offsets agree with each other.
+void prepare_address(Cache::address_ref & addr) {
+    if (addr.lines.empty()) {
+        throw std::runtime_error("setAddress: 'lines' must have at least one offset");
+    }
+    std::size_t line_count = addr.lines.size() - 1;
+    if (addr.ranges.size() != line_count * 4) {
+        throw std::runtime_error("setAddress: expected four ranges per line");
+    }
+    if (addr.parity.size() != line_count * 2) {
+        throw std::runtime_error("setAddress: expected two parity values per line");
+    }
+    if (addr.coords.size() % 2 != 0 || addr.lines.back() != addr.coords.size() / 2) {
+        throw std::runtime_error("setAddress: line offsets do not match coordinates");
+    }
+    addr.dist.assign(addr.coords.size() / 2, 0);
+    for (std::size_t i = 0; i < line_count; ++i) {
+        if (addr.lines[i] > addr.lines[i + 1]) {
+            throw std::runtime_error("setAddress: line offsets must be ascending");
+        }
+        double distance = 0;
+        for (std::size_t j = addr.lines[i] + 1; j < addr.lines[i + 1]; ++j) {
+            double dx = addr.coords[(j - 1) * 2] - addr.coords[j * 2];
+            double dy = addr.coords[(j - 1) * 2 + 1] - addr.coords[j * 2 + 1];
+            distance += std::sqrt(dx * dx + dy * dy);
+            addr.dist[j] = distance;
+        }
+    }
+}
+
+inline bool falsy_range(double val) {
+    return std::isnan(val) || val == 0;
+}
+
+inline double round_coord(double val) {
+    return std::floor(val * 1e6 + 0.5) / 1e6;
+}
+
+// Interpolate `address` along the first line whose left or right range
+// contains it. Mirrors the TIGER interpolation previously done in
+// lib/pure/applyaddress.js.
+bool interpolate_address(Cache::address_ref const& addr,
+                         double address,
+                         double & x,
+                         double & y) {
+    unsigned char paritymask = std::fmod(address, 2) == 0 ? 2 : 1;
+    std::size_t line_count = addr.lines.size() - 1;
+    for (std::size_t i = 0; i < line_count; ++i) {
+        double lfromhn = addr.ranges[i * 4];
+        double ltohn = addr.ranges[i * 4 + 1];
+        double rfromhn = addr.ranges[i * 4 + 2];
+        double rtohn = addr.ranges[i * 4 + 3];
+
+        // no usable data at all
+        if (falsy_range(lfromhn) && falsy_range(rfromhn) &&
+            falsy_range(ltohn) && falsy_range(rtohn)) continue;
+
+        // a missing end of range counts as 0
+        if (std::isnan(ltohn)) ltohn = 0;
+        if (std::isnan(rtohn)) rtohn = 0;
+
+        double start, end;
+        if (!std::isnan(lfromhn) &&
+            address >= std::min(lfromhn, ltohn) &&
+            address <= std::max(lfromhn, ltohn) &&
+            (addr.parity[i * 2] & paritymask)) {
+            start = lfromhn;
+            end = ltohn;
+        } else if (!std::isnan(rfromhn) &&
+            address >= std::min(rfromhn, rtohn) &&
+            address <= std::max(rfromhn, rtohn) &&
+            (addr.parity[i * 2 + 1] & paritymask)) {
+            start = rfromhn;
+            end = rtohn;
+        } else {
+            continue;
+        }
+
+        std::size_t first = addr.lines[i];
+        std::size_t count = addr.lines[i + 1] - first;
+        if (count < 2) continue;
+
+        bool reverse = start > end;
+        if (reverse) std::swap(start, end);
+
+        // a normalized number between 0 and 1
+        double part = end > start ? (address - start) / (end - start) : 0;
+        double distance = addr.dist[first + count - 1];
+        double unnorm = part * distance;
+
+        // Walk the line from the start of the range. When the range runs
+        // against the line direction, points are visited back to front and
+        // distances are measured from the last point.
+        std::size_t prev = reverse ? first + count - 1 : first;
+        std::size_t curr = prev;
+        double prev_dist = 0;
+        double curr_dist = 0;
+        for (std::size_t stop = 1; stop < count; ++stop) {
+            prev = curr;
+            prev_dist = curr_dist;
+            curr = reverse ? first + count - 1 - stop : first + stop;
+            curr_dist = reverse ? distance - addr.dist[curr] : addr.dist[curr];
+            if (curr_dist > unnorm || stop == count - 1) break;
+        }
+
+        double interp = (unnorm - prev_dist) / (curr_dist - prev_dist);
+        x = round_coord(addr.coords[curr * 2] * interp + addr.coords[prev * 2] * (1 - interp));
+        y = round_coord(addr.coords[curr * 2 + 1] * interp + addr.coords[prev * 2 + 1] * (1 - interp));
+        return true;
+    }
+    return false;
+}
+
+NAN_METHOD(Cache::setAddress)
+{
+    NanScope();
+    if (args.Length() < 6) {
+        return NanThrowTypeError("expected six args: 'shard', 'id', 'ranges', 'parity', 'coords', 'lines'");
+    }
+    if (!args[0]->IsNumber()) {
+        return NanThrowTypeError("first arg must be an Integer");
+    }
+    if (!args[1]->IsNumber()) {
+        return NanThrowTypeError("second arg must be an Integer");
+    }
+    try {
+        Cache::key_type key = feature_key(shard_arg(args[0]));
+        uint64_t id = static_cast<uint64_t>(args[1]->IntegerValue());
+        Cache::address_ref addr;
+        copy_typed_array(args[2], kExternalDoubleArray, addr.ranges, "ranges");
+        copy_typed_array(args[3], kExternalUnsignedByteArray, addr.parity, "parity");
+        copy_typed_array(args[4], kExternalDoubleArray, addr.coords, "coords");
+        copy_typed_array(args[5], kExternalUnsignedIntArray, addr.lines, "lines");
+        prepare_address(addr);
+        Cache* c = node::ObjectWrap::Unwrap<Cache>(args.This())->address_cache(key);
+#ifdef USE_CXX11
+        c->address_[key][id] = std::move(addr);
+#else
+        c->address_[key][id] = addr;
+#endif
+    } catch (std::exception const& ex) {
+        return NanThrowTypeError(ex.what());
+    }
+    NanReturnValue(Undefined());
+}
+
+NAN_METHOD(Cache::hasAddress)
+{
+    NanScope();
+    if (args.Length() < 2) {
+        return NanThrowTypeError("expected two args: 'shard' and 'id'");
+    }
+    if (!args[0]->IsNumber()) {
+        return NanThrowTypeError("first arg must be an Integer");
+    }
+    if (!args[1]->IsNumber()) {
+        return NanThrowTypeError("second arg must be an Integer");
+    }
+    try {
+        Cache::key_type key = feature_key(shard_arg(args[0]));
+        uint64_t id = static_cast<uint64_t>(args[1]->IntegerValue());
+        Cache* c = node::ObjectWrap::Unwrap<Cache>(args.This())->address_cache(key);
+        Cache::addresscache::const_iterator itr = c->address_.find(key);
+        if (itr != c->address_.end() && itr->second.find(id) != itr->second.end()) {
+            NanReturnValue(True());
+        }
+        NanReturnValue(False());
+    } catch (std::exception const& ex) {
+        return NanThrowTypeError(ex.what());
+    }
+}
+
+NAN_METHOD(Cache::getAddress)
+{
+    NanScope();
+    if (args.Length() < 3) {
+        return NanThrowTypeError("expected three args: 'shard', 'id' and 'address'");
+    }
+    if (!args[0]->IsNumber()) {
+        return NanThrowTypeError("first arg must be an Integer");
+    }
+    if (!args[1]->IsNumber()) {
+        return NanThrowTypeError("second arg must be an Integer");
+    }
+    if (!args[2]->IsNumber()) {
+        return NanThrowTypeError("third arg must be a Number");
+    }
+    try {
+        Cache::key_type key = feature_key(shard_arg(args[0]));
+        uint64_t id = static_cast<uint64_t>(args[1]->IntegerValue());
+        Cache* c = node::ObjectWrap::Unwrap<Cache>(args.This())->address_cache(key);
+        Cache::addresscache::const_iterator itr = c->address_.find(key);
+        if (itr == c->address_.end()) {
+            NanReturnValue(Undefined());
+        }
+        Cache::addressarray::const_iterator aitr = itr->second.find(id);
+        if (aitr == itr->second.end()) {
+            NanReturnValue(Undefined());
+        }
+        double x, y;
+        if (!interpolate_address(aitr->second, args[2]->NumberValue(), x, y)) {
+            NanReturnValue(Undefined());
         }
+        Local<Array> point = Array::New(2);
+        point->Set(0, Number::New(x));
+        point->Set(1, Number::New(y));
+        NanReturnValue(point);
     } catch (std::exception const& ex) {
         return NanThrowTypeError(ex.what());
     }
-    NanReturnValue(Boolean::New(hit));
 }
 
 NAN_METHOD(Cache::New)
@@ -622,7 +1605,6 @@ NAN_METHOD(Cache::New)
         Cache* im = new Cache(id,shardlevel);
         im->Wrap(args.This());
         args.This()->Set(String::NewSymbol("id"),args[0]);
-        args.This()->Set(String::NewSymbol("shardlevel"),args[1]);
         NanReturnValue(args.This());
     } catch (std::exception const& ex) {
         return NanThrowTypeError(ex.what());
@@ -633,6 +1615,10 @@ NAN_METHOD(Cache::New)
 extern "C" {
     static void start(Handle<Object> target) {
         Cache::Initialize(target);
+        QueryCache::Initialize(target);
+        Indexer::Initialize(target);
+        CacheHandle::Initialize(target);
+        Metrics::Initialize(target);
     }
 }
 
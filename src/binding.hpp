@@ -17,28 +17,77 @@
 #include <string>
 #include <map>
 #include <vector>
-#include "index.pb.h"
+#ifdef USE_CXX11
+#include <memory>
+#else
+#include <tr1/memory>
+#endif
 #pragma clang diagnostic pop
 
+#include "shard.hpp"
+
 namespace binding {
 
+#ifdef USE_CXX11
+using std::shared_ptr;
+using std::weak_ptr;
+#else
+using std::tr1::shared_ptr;
+using std::tr1::weak_ptr;
+#endif
+
 class Cache: public node::ObjectWrap {
     ~Cache();
 public:
-    typedef uint64_t int_type;
+    typedef binding::int_type int_type;
+    // shards are keyed by interned type id and shard number, see key()
+    typedef uint64_t key_type;
     // lazy ref item
-    typedef std::string string_ref_type;
-    typedef std::map<int_type,string_ref_type> larraycache;
+    typedef binding::string_ref_type string_ref_type;
+    typedef binding::larraycache larraycache;
     typedef larraycache::const_iterator larraycache_iterator;
-    typedef std::map<std::string,larraycache> lazycache;
+    // shards are reference counted versions, and so are the tables of
+    // shards. A version or a table that is shared with a snapshot is
+    // copied rather than modified.
+    typedef shared_ptr<larraycache> larraycache_ptr;
+    typedef std::map<key_type,larraycache_ptr> lazycache;
+    typedef shared_ptr<lazycache> lazycache_ptr;
     typedef lazycache::const_iterator lazycache_iterator_type;
 
     // fully cached item
-    typedef std::vector<int_type> intarray;
-    typedef std::map<uint32_t,intarray> arraycache;
+    typedef binding::intarray intarray;
+    typedef binding::arraycache arraycache;
     typedef arraycache::const_iterator arraycache_iterator;
-    typedef std::map<std::string,arraycache> memcache;
+    typedef shared_ptr<arraycache> arraycache_ptr;
+    typedef std::map<key_type,arraycache_ptr> memcache;
+    typedef shared_ptr<memcache> memcache_ptr;
     typedef memcache::const_iterator mem_iterator_type;
+
+    // address interpolation data prepared from a feature's TIGER ranges
+    // and LineString geometry. Stored alongside feature shards.
+    struct address_ref {
+        // lfromhn, ltohn, rfromhn, rtohn per line, NaN when missing
+        std::vector<double> ranges;
+        // left, right parity mask per line (1: odd, 2: even)
+        std::vector<unsigned char> parity;
+        // x, y per point
+        std::vector<double> coords;
+        // cumulative distance along its line per point
+        std::vector<double> dist;
+        // offset of the first point of each line, plus total point count
+        std::vector<uint32_t> lines;
+    };
+    typedef std::map<int_type,address_ref> addressarray;
+    typedef std::map<key_type,addressarray> addresscache;
+
+    // callbacks waiting on a shard fetch that is in flight
+    typedef std::vector<NanCallback*> waiters;
+    typedef std::map<key_type,waiters> inflightcache;
+    // per shard count of the loads, writes and unloads made to it
+    typedef std::map<key_type,uint64_t> versionarray;
+    // shard versions the cache replaced or dropped while a snapshot still
+    // reads them, with the bytes reported to V8 for each
+    typedef std::vector<std::pair<weak_ptr<void>,std::size_t> > supersededarray;
     static v8::Persistent<v8::FunctionTemplate> constructor;
     static void Initialize(v8::Handle<v8::Object> target);
     static NAN_METHOD(New);
@@ -52,15 +101,86 @@ public:
     static NAN_METHOD(_get);
     static NAN_METHOD(_set);
     static NAN_METHOD(unload);
+    static NAN_METHOD(loadFeatures);
+    static NAN_METHOD(packFeatures);
+    static NAN_METHOD(_featureVersion);
+    static NAN_METHOD(packFeatureShard);
+    static NAN_METHOD(_getFeature);
+    static NAN_METHOD(setAddress);
+    static NAN_METHOD(hasAddress);
+    static NAN_METHOD(getAddress);
+    static NAN_METHOD(_wait);
+    static NAN_METHOD(_settle);
+    static NAN_METHOD(_snapshot);
+    static NAN_METHOD(_handle);
+    static NAN_METHOD(release);
+    static NAN_METHOD(snapshots);
+    static unsigned snapshot_count;
+    static NAN_GETTER(getShardlevel);
+    static NAN_SETTER(setShardlevel);
+    static NAN_GETTER(getGeneration);
+    static NAN_METHOD(invalidate);
+    static void AsyncSettle(uv_work_t* req);
+    static void AfterSettle(uv_work_t* req);
     static void AsyncRun(uv_work_t* req);
     static void AfterRun(uv_work_t* req);
     Cache(std::string const& id, unsigned shardlevel);
     void _ref() { Ref(); }
     void _unref() { Unref(); }
+    // Interned id of a type name, shared by all caches. Only called from
+    // the main thread.
+    static unsigned type_id(std::string const& type);
+    // Id of a type name if it has been interned, unknown_type otherwise.
+    static const unsigned unknown_type = 0xffffffff;
+    static unsigned find_type_id(std::string const& type);
+    static key_type key(unsigned type, int_type shard) {
+        return (static_cast<key_type>(type) << 32) | shard;
+    }
+    static int_type key_shard(key_type key) { return key & 0xffffffff; }
+    static int_type shard_arg(v8::Local<v8::Value> shard);
+    static void array_arg(v8::Local<v8::Array> data, intarray & vv);
+    void notify(key_type key, v8::Handle<v8::Value> err, v8::Handle<v8::Value> ms = v8::Handle<v8::Value>());
+    void pin(key_type key);
+    memcache & writable_cache();
+    lazycache & writable_lazy();
+    void publish(key_type key, larraycache_ptr const& arrc);
+    void bump(key_type key);
+    uint64_t version(key_type key) const;
+    template <typename T>
+    void supersede(shared_ptr<T> const& version);
+    void sweep();
+    void detach();
+    bool has_shard(key_type key);
+    bool get(key_type key, int_type id, intarray & array);
+    v8::Local<v8::Value> get_array(key_type key, int_type id);
+    void set(key_type key, int_type id, intarray & array);
+    void load_shard(key_type key, const char * data, std::size_t size);
+    void load_shard(key_type key, const char * data, std::size_t size, v8::Local<v8::Function> callback);
+    bool unload_shard(key_type key);
+    v8::Local<v8::Value> pack_shard(key_type key);
+    v8::Local<v8::Array> list_shards(unsigned type);
+    v8::Local<v8::Array> list_ids(key_type key);
+    key_type shard_key(unsigned type, int_type id) const;
+    Cache * live() { return origin_ ? origin_ : this; }
+    // The live cache's level, which snapshots and handles share.
+    unsigned shardlevel() const { return origin_ ? origin_->shardlevel_ : shardlevel_; }
+    Cache * address_cache(key_type key);
     std::string id_;
     unsigned shardlevel_;
-    memcache cache_;
-    lazycache lazy_;
+    memcache_ptr cache_;
+    lazycache_ptr lazy_;
+    addresscache address_;
+    inflightcache inflight_;
+    versionarray versions_;
+    // count of the loads, writes and unloads of any shard but features
+    uint64_t generation_;
+    // version of each shard when its in-flight fetch started
+    versionarray fetching_;
+    supersededarray superseded_;
+    // bytes of superseded_ reported as external memory
+    std::size_t pinned_bytes_;
+    // set for snapshots: the cache whose shard tables were captured
+    Cache * origin_;
 };
 
 }
@@ -0,0 +1,265 @@
+#include "cachehandle.hpp"
+#include <node_buffer.h>
+
+namespace binding {
+
+using namespace v8;
+
+Persistent<FunctionTemplate> CacheHandle::constructor;
+
+void CacheHandle::Initialize(Handle<Object> target) {
+    NanScope();
+    Local<FunctionTemplate> t = FunctionTemplate::New(CacheHandle::New);
+    t->InstanceTemplate()->SetInternalFieldCount(1);
+    t->SetClassName(String::NewSymbol("CacheHandle"));
+    NODE_SET_PROTOTYPE_METHOD(t, "has", has);
+    NODE_SET_PROTOTYPE_METHOD(t, "load", load);
+    NODE_SET_PROTOTYPE_METHOD(t, "loadSync", loadSync);
+    NODE_SET_PROTOTYPE_METHOD(t, "pack", pack);
+    NODE_SET_PROTOTYPE_METHOD(t, "list", list);
+    NODE_SET_PROTOTYPE_METHOD(t, "get", get);
+    NODE_SET_PROTOTYPE_METHOD(t, "_get", _get);
+    NODE_SET_PROTOTYPE_METHOD(t, "set", set);
+    NODE_SET_PROTOTYPE_METHOD(t, "_set", _set);
+    NODE_SET_PROTOTYPE_METHOD(t, "unload", unload);
+    target->Set(String::NewSymbol("CacheHandle"),t->GetFunction());
+    NanAssignPersistent(FunctionTemplate, constructor, t);
+}
+
+// The handle object keeps its cache alive through a hidden reference to
+// the cache object, see New, rather than a Ref() on it: caches keep their
+// handles (see Cache#handle), and a Ref() would make that cycle
+// uncollectable.
+CacheHandle::CacheHandle(Cache * cache, unsigned type)
+  : ObjectWrap(),
+    cache_(cache),
+    type_(type) { }
+
+CacheHandle::~CacheHandle() { }
+
+NAN_METHOD(CacheHandle::has)
+{
+    NanScope();
+    if (args.Length() < 1 || !args[0]->IsNumber()) {
+        return NanThrowTypeError("first arg must be an Integer");
+    }
+    try {
+        CacheHandle* h = node::ObjectWrap::Unwrap<CacheHandle>(args.This());
+        NanReturnValue(Boolean::New(h->cache_->has_shard(Cache::key(h->type_, Cache::shard_arg(args[0])))));
+    } catch (std::exception const& ex) {
+        return NanThrowTypeError(ex.what());
+    }
+}
+
+NAN_METHOD(CacheHandle::loadSync)
+{
+    NanScope();
+    if (args.Length() < 2) {
+        return NanThrowTypeError("expected two args: 'buffer' and 'shard'");
+    }
+    if (!args[0]->IsObject() || !node::Buffer::HasInstance(args[0])) {
+        return NanThrowTypeError("first argument must be a Buffer");
+    }
+    if (!args[1]->IsNumber()) {
+        return NanThrowTypeError("second arg 'shard' must be an Integer");
+    }
+    try {
+        CacheHandle* h = node::ObjectWrap::Unwrap<CacheHandle>(args.This());
+        Local<Object> obj = args[0]->ToObject();
+        h->cache_->live()->load_shard(Cache::key(h->type_, Cache::shard_arg(args[1])),
+                                      node::Buffer::Data(obj),
+                                      node::Buffer::Length(obj));
+    } catch (std::exception const& ex) {
+        return NanThrowTypeError(ex.what());
+    }
+    NanReturnValue(Undefined());
+}
+
+NAN_METHOD(CacheHandle::load)
+{
+    NanScope();
+    if (args.Length() < 3 || !args[2]->IsFunction()) {
+        return loadSync(args);
+    }
+    if (!args[0]->IsObject() || !node::Buffer::HasInstance(args[0])) {
+        return NanThrowTypeError("first argument must be a Buffer");
+    }
+    if (!args[1]->IsNumber()) {
+        return NanThrowTypeError("second arg 'shard' must be an Integer");
+    }
+    try {
+        CacheHandle* h = node::ObjectWrap::Unwrap<CacheHandle>(args.This());
+        Local<Object> obj = args[0]->ToObject();
+        h->cache_->live()->load_shard(Cache::key(h->type_, Cache::shard_arg(args[1])),
+                                      node::Buffer::Data(obj),
+                                      node::Buffer::Length(obj),
+                                      args[2].As<Function>());
+    } catch (std::exception const& ex) {
+        return NanThrowTypeError(ex.what());
+    }
+    NanReturnValue(Undefined());
+}
+
+NAN_METHOD(CacheHandle::pack)
+{
+    NanScope();
+    if (args.Length() < 1 || !args[0]->IsNumber()) {
+        return NanThrowTypeError("first arg must be an Integer");
+    }
+    try {
+        CacheHandle* h = node::ObjectWrap::Unwrap<CacheHandle>(args.This());
+        NanReturnValue(h->cache_->pack_shard(Cache::key(h->type_, Cache::shard_arg(args[0]))));
+    } catch (std::exception const& ex) {
+        return NanThrowTypeError(ex.what());
+    }
+}
+
+NAN_METHOD(CacheHandle::list)
+{
+    NanScope();
+    try {
+        CacheHandle* h = node::ObjectWrap::Unwrap<CacheHandle>(args.This());
+        if (args.Length() < 1) {
+            NanReturnValue(h->cache_->list_shards(h->type_));
+        }
+        if (!args[0]->IsNumber()) {
+            return NanThrowTypeError("first arg must be an Integer");
+        }
+        NanReturnValue(h->cache_->list_ids(Cache::key(h->type_, Cache::shard_arg(args[0]))));
+    } catch (std::exception const& ex) {
+        return NanThrowTypeError(ex.what());
+    }
+}
+
+NAN_METHOD(CacheHandle::get)
+{
+    NanScope();
+    if (args.Length() < 1 || !args[0]->IsNumber()) {
+        return NanThrowTypeError("first arg must be an Integer");
+    }
+    try {
+        CacheHandle* h = node::ObjectWrap::Unwrap<CacheHandle>(args.This());
+        Cache::int_type id = static_cast<Cache::int_type>(args[0]->IntegerValue());
+        NanReturnValue(h->cache_->get_array(h->cache_->shard_key(h->type_, id), id));
+    } catch (std::exception const& ex) {
+        return NanThrowTypeError(ex.what());
+    }
+}
+
+NAN_METHOD(CacheHandle::_get)
+{
+    NanScope();
+    if (args.Length() < 2) {
+        return NanThrowTypeError("expected two args: shard and id");
+    }
+    if (!args[0]->IsNumber()) {
+        return NanThrowTypeError("first arg must be an Integer");
+    }
+    if (!args[1]->IsNumber()) {
+        return NanThrowTypeError("second arg must be an Integer");
+    }
+    try {
+        CacheHandle* h = node::ObjectWrap::Unwrap<CacheHandle>(args.This());
+        Cache::int_type id = static_cast<Cache::int_type>(args[1]->IntegerValue());
+        NanReturnValue(h->cache_->get_array(Cache::key(h->type_, Cache::shard_arg(args[0])), id));
+    } catch (std::exception const& ex) {
+        return NanThrowTypeError(ex.what());
+    }
+}
+
+NAN_METHOD(CacheHandle::set)
+{
+    NanScope();
+    if (args.Length() < 2) {
+        return NanThrowTypeError("expected two args: 'id' and 'data'");
+    }
+    if (!args[0]->IsNumber()) {
+        return NanThrowTypeError("first arg must be an Integer");
+    }
+    if (!args[1]->IsArray()) {
+        return NanThrowTypeError("second arg must be an Array");
+    }
+    try {
+        CacheHandle* h = node::ObjectWrap::Unwrap<CacheHandle>(args.This());
+        Cache* c = h->cache_->live();
+        Cache::int_type id = static_cast<Cache::int_type>(args[0]->IntegerValue());
+        Cache::intarray vv;
+        Cache::array_arg(Local<Array>::Cast(args[1]), vv);
+        c->set(c->shard_key(h->type_, id), id, vv);
+    } catch (std::exception const& ex) {
+        return NanThrowTypeError(ex.what());
+    }
+    NanReturnValue(Undefined());
+}
+
+NAN_METHOD(CacheHandle::_set)
+{
+    NanScope();
+    if (args.Length() < 3) {
+        return NanThrowTypeError("expected three args: 'shard', 'id' and 'data'");
+    }
+    if (!args[0]->IsNumber()) {
+        return NanThrowTypeError("first arg must be an Integer");
+    }
+    if (!args[1]->IsNumber()) {
+        return NanThrowTypeError("second arg must be an Integer");
+    }
+    if (!args[2]->IsArray()) {
+        return NanThrowTypeError("third arg must be an Array");
+    }
+    try {
+        CacheHandle* h = node::ObjectWrap::Unwrap<CacheHandle>(args.This());
+        Cache::key_type key = Cache::key(h->type_, Cache::shard_arg(args[0]));
+        Cache::int_type id = static_cast<Cache::int_type>(args[1]->IntegerValue());
+        Cache::intarray vv;
+        Cache::array_arg(Local<Array>::Cast(args[2]), vv);
+        h->cache_->live()->set(key, id, vv);
+    } catch (std::exception const& ex) {
+        return NanThrowTypeError(ex.what());
+    }
+    NanReturnValue(Undefined());
+}
+
+NAN_METHOD(CacheHandle::unload)
+{
+    NanScope();
+    if (args.Length() < 1 || !args[0]->IsNumber()) {
+        return NanThrowTypeError("first arg must be an Integer");
+    }
+    try {
+        CacheHandle* h = node::ObjectWrap::Unwrap<CacheHandle>(args.This());
+        NanReturnValue(Boolean::New(h->cache_->live()->unload_shard(Cache::key(h->type_, Cache::shard_arg(args[0])))));
+    } catch (std::exception const& ex) {
+        return NanThrowTypeError(ex.what());
+    }
+}
+
+NAN_METHOD(CacheHandle::New)
+{
+    NanScope();
+    if (!args.IsConstructCall()) {
+        return NanThrowTypeError("Cannot call constructor as function, you need to use 'new' keyword");
+    }
+    if (args.Length() < 2) {
+        return NanThrowTypeError("expected 'cache' and 'type' arguments");
+    }
+    if (!args[0]->IsObject() || !NanPersistentToLocal(Cache::constructor)->HasInstance(args[0])) {
+        return NanThrowTypeError("first argument 'cache' must be a Cache");
+    }
+    if (!args[1]->IsString()) {
+        return NanThrowTypeError("second argument 'type' must be a String");
+    }
+    try {
+        Cache* c = node::ObjectWrap::Unwrap<Cache>(args[0]->ToObject());
+        CacheHandle* im = new CacheHandle(c, Cache::type_id(*String::Utf8Value(args[1]->ToString())));
+        im->Wrap(args.This());
+        args.This()->SetHiddenValue(String::NewSymbol("cache"),args[0]);
+        args.This()->Set(String::NewSymbol("type"),args[1]);
+        NanReturnValue(args.This());
+    } catch (std::exception const& ex) {
+        return NanThrowTypeError(ex.what());
+    }
+    NanReturnValue(Undefined());
+}
+
+} // namespace binding
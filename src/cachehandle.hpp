@@ -0,0 +1,48 @@
+#ifndef __CARMEN_CACHEHANDLE_HPP__
+#define __CARMEN_CACHEHANDLE_HPP__
+
+// v8
+#include <v8.h>
+
+// node
+#include <node.h>
+#include <node_object_wrap.h>
+
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wconversion"
+#pragma clang diagnostic ignored "-Wshadow"
+#pragma clang diagnostic ignored "-Wsign-compare"
+#include <nan.h>
+#pragma clang diagnostic pop
+
+#include "binding.hpp"
+
+namespace binding {
+
+// A Cache bound to one type, returned by Cache#handle. The type is
+// interned once when the handle is made so lookups through it take
+// shard numbers and ids only.
+class CacheHandle: public node::ObjectWrap {
+    ~CacheHandle();
+public:
+    static v8::Persistent<v8::FunctionTemplate> constructor;
+    static void Initialize(v8::Handle<v8::Object> target);
+    static NAN_METHOD(New);
+    static NAN_METHOD(has);
+    static NAN_METHOD(load);
+    static NAN_METHOD(loadSync);
+    static NAN_METHOD(pack);
+    static NAN_METHOD(list);
+    static NAN_METHOD(get);
+    static NAN_METHOD(_get);
+    static NAN_METHOD(set);
+    static NAN_METHOD(_set);
+    static NAN_METHOD(unload);
+    CacheHandle(Cache * cache, unsigned type);
+    Cache * cache_;
+    unsigned type_;
+};
+
+}
+
+#endif // __CARMEN_CACHEHANDLE_HPP__
@@ -0,0 +1,1056 @@
+#include "indexer.hpp"
+#include <node_version.h>
+#include <node_buffer.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <map>
+#include <sstream>
+#ifdef _WIN32
+#include <process.h>
+#else
+#include <unistd.h>
+#endif
+
+namespace binding {
+
+using namespace v8;
+
+Persistent<FunctionTemplate> Indexer::constructor;
+
+void Indexer::Initialize(Handle<Object> target) {
+    NanScope();
+    Local<FunctionTemplate> t = FunctionTemplate::New(Indexer::New);
+    t->InstanceTemplate()->SetInternalFieldCount(1);
+    t->SetClassName(String::NewSymbol("Indexer"));
+    NODE_SET_PROTOTYPE_METHOD(t, "frequency", frequency);
+    NODE_SET_PROTOTYPE_METHOD(t, "index", index);
+    NODE_SET_PROTOTYPE_METHOD(t, "apply", apply);
+    NODE_SET_PROTOTYPE_METHOD(t, "spill", spill);
+    NODE_SET_PROTOTYPE_METHOD(t, "flush", flush);
+    NODE_SET_PROTOTYPE_METHOD(t, "shards", shards);
+    NODE_SET_PROTOTYPE_METHOD(t, "runs", runs);
+    NODE_SET_PROTOTYPE_METHOD(t, "merge", merge);
+    NODE_SET_PROTOTYPE_METHOD(t, "clear", clear);
+    target->Set(String::NewSymbol("Indexer"),t->GetFunction());
+    NanAssignPersistent(FunctionTemplate, constructor, t);
+}
+
+// postings types, in the order of Indexer::postings_
+static const char * posting_types[] = { "term", "phrase", "grid", "degen" };
+static const std::size_t posting_count = 4;
+static const std::size_t term_type = 0;
+static const std::size_t phrase_type = 1;
+static const std::size_t grid_type = 2;
+static const std::size_t degen_type = 3;
+
+std::size_t posting_type(std::string const& type) {
+    for (std::size_t t = 0; t < posting_count; ++t) {
+        if (type == posting_types[t]) return t;
+    }
+    std::stringstream msg("");
+    msg << "indexer: unknown type '" << type << "'";
+    throw std::runtime_error(msg.str());
+}
+
+// run files of indexers in the same process are told apart by id
+static unsigned next_id = 0;
+
+Indexer::Indexer(unsigned threads, std::string const& dir, std::size_t memory)
+  : ObjectWrap(),
+    threads_(threads),
+    busy_(false),
+    docs_(),
+    batch_(),
+    freq_(),
+    known_(),
+    postings_(),
+    dir_(dir),
+    memory_(memory),
+    pending_(),
+    pending_size_(0),
+    shardlevel_(0),
+    id_(next_id++),
+    runs_(),
+    merging_(0) { }
+
+Indexer::~Indexer() {
+    remove_runs();
+}
+
+// FNV-1a over UTF-16 code units, see lib/util/fnv.js.
+inline Indexer::id_type fnv1a(Indexer::token const& str, unsigned bits) {
+    uint32_t hash = 2166136261u;
+    for (std::size_t i = 0; i < str.size(); ++i) {
+        hash ^= str[i];
+        hash *= 16777619u;
+    }
+    if (bits) {
+        unsigned clear = 32 - bits;
+        hash = hash >> clear << clear;
+    }
+    return hash;
+}
+
+// termops.degens
+void degens(Indexer::token const& str, std::vector<std::pair<Indexer::id_type,Indexer::value_type> > & out) {
+    std::size_t length = str.size();
+    Indexer::id_type tokenid = fnv1a(str, 28);
+    out.push_back(std::make_pair(tokenid, static_cast<Indexer::value_type>(tokenid)));
+    for (std::size_t i = 1; i < length && length - i > 2; ++i) {
+        Indexer::id_type degen = fnv1a(str.substr(0, length - i), 28);
+        out.push_back(std::make_pair(degen, static_cast<Indexer::value_type>(tokenid) + std::min<std::size_t>(i, 15)));
+    }
+}
+
+// Sort and deduplicate like lib/util/uniq.js. Array#sort without a
+// comparator orders numbers by their decimal string.
+void lexical_uniq(Indexer::valuearray & ids) {
+    std::vector<std::pair<std::string,Indexer::value_type> > keyed;
+    keyed.reserve(ids.size());
+    char buf[24];
+    for (std::size_t i = 0; i < ids.size(); ++i) {
+        snprintf(buf, sizeof(buf), "%llu", static_cast<unsigned long long>(ids[i]));
+        keyed.push_back(std::make_pair(std::string(buf), ids[i]));
+    }
+    std::sort(keyed.begin(), keyed.end());
+    ids.clear();
+    for (std::size_t i = 0; i < keyed.size(); ++i) {
+        if (i == 0 || keyed[i].second != keyed[i-1].second) {
+            ids.push_back(keyed[i].second);
+        }
+    }
+}
+
+// generateFrequency over a range of docs.
+void frequency_chunk(void * data) {
+    Indexer::chunk & c = *static_cast<Indexer::chunk *>(data);
+    try {
+        for (std::size_t d = c.begin; d < c.end; ++d) {
+            Indexer::doc const& doc = c.indexer->docs_[d];
+            for (std::size_t x = 0; x < doc.texts.size(); ++x) {
+                Indexer::tokenset const& tokens = doc.texts[x];
+                for (std::size_t k = 0; k < tokens.size(); ++k) {
+                    ++c.freq[fnv1a(tokens[k], 28)];
+                    ++c.freq[0];
+                }
+            }
+        }
+    } catch (std::exception const& ex) {
+        c.error = true;
+        c.error_name = ex.what();
+    }
+}
+
+// loadDoc over a range of docs. Terms are weighted against the merged
+// frequencies of the batch. Degens are collected for terms neither known
+// before the batch nor seen earlier in the chunk; whether an earlier chunk
+// indexed them is settled when chunks are merged.
+void index_chunk(void * data) {
+    Indexer::chunk & c = *static_cast<Indexer::chunk *>(data);
+    try {
+        Indexer const& indexer = *c.indexer;
+        Indexer::termset seen;
+        Indexer::frequencies::const_iterator ftotal = indexer.freq_.find(0);
+        double total = ftotal == indexer.freq_.end() ? 0 : static_cast<double>(ftotal->second);
+        for (std::size_t d = c.begin; d < c.end; ++d) {
+            Indexer::doc const& doc = indexer.docs_[d];
+            for (std::size_t x = 0; x < doc.texts.size(); ++x) {
+                Indexer::tokenset const& tokens = doc.texts[x];
+                std::size_t size = tokens.size();
+
+                // termops.termsWeighted and termops.termsMap
+                std::vector<Indexer::id_type> ids(size);
+                std::vector<double> weights(size);
+                std::map<Indexer::id_type,Indexer::token const*> termsmap;
+                double maxweight = 0;
+                for (std::size_t i = 0; i < size; ++i) {
+                    ids[i] = fnv1a(tokens[i], 28);
+                    termsmap[ids[i]] = &tokens[i];
+                    Indexer::frequencies::const_iterator f = indexer.freq_.find(ids[i]);
+                    double termfreq = f == indexer.freq_.end() ? 1 : static_cast<double>(f->second);
+                    weights[i] = std::log(1 + total/termfreq);
+                    maxweight = std::max(maxweight, weights[i]);
+                }
+                Indexer::valuearray terms(size);
+                bool sig = false;
+                Indexer::id_type sigid = 0;
+                double sigweight = 0;
+                for (std::size_t i = 0; i < size; ++i) {
+                    double weight = std::floor(weights[i]/maxweight*15);
+                    terms[i] = static_cast<Indexer::value_type>(ids[i]) + static_cast<Indexer::value_type>(weight);
+                    if (weight > sigweight) {
+                        sig = true;
+                        sigid = ids[i];
+                        sigweight = weight;
+                    }
+                    if (indexer.known_.count(ids[i]) || !seen.insert(ids[i]).second) {
+                        continue;
+                    }
+                    Indexer::degens fresh;
+                    fresh.term = ids[i];
+                    degens(*termsmap[ids[i]], fresh.postings);
+                    c.fresh.push_back(fresh);
+                }
+                if (!sig) {
+                    throw std::runtime_error("index: text has no significant term");
+                }
+
+                // termops.phrase, clustered by most significant term.
+                Indexer::token text;
+                for (std::size_t i = 0; i < size; ++i) {
+                    if (i) text.push_back(' ');
+                    text.append(tokens[i]);
+                }
+                Indexer::id_type phrase = (fnv1a(text, 0) % 1048576) + (fnv1a(*termsmap[sigid], 0) >> 20 << 20);
+
+                if (c.phrase.find(phrase) == c.phrase.end()) {
+                    c.phrase[phrase] = terms;
+                }
+                c.term[sigid].push_back(phrase);
+                Indexer::valuearray & grid = c.grid[phrase];
+                grid.insert(grid.end(), doc.grid.begin(), doc.grid.end());
+            }
+        }
+    } catch (std::exception const& ex) {
+        c.error = true;
+        c.error_name = ex.what();
+    }
+}
+
+// Split docs_ into one chunk per thread and run `work` over each.
+void Indexer::run(std::vector<chunk> & chunks, void (*work)(void*)) {
+    std::size_t size = docs_.size();
+    std::size_t count = std::max<std::size_t>(1, std::min<std::size_t>(threads_, size));
+    chunks.resize(count);
+    for (std::size_t i = 0; i < count; ++i) {
+        chunks[i].indexer = this;
+        chunks[i].begin = size * i / count;
+        chunks[i].end = size * (i + 1) / count;
+        chunks[i].error = false;
+    }
+    if (count == 1) {
+        work(&chunks[0]);
+        return;
+    }
+    std::vector<uv_thread_t> threads(count);
+    for (std::size_t i = 0; i < count; ++i) {
+        uv_thread_create(&threads[i], work, &chunks[i]);
+    }
+    for (std::size_t i = 0; i < count; ++i) {
+        uv_thread_join(&threads[i]);
+    }
+}
+
+inline void append(Indexer::postings & to, Indexer::postings & from) {
+    Indexer::postings::iterator itr = from.begin();
+    Indexer::postings::iterator end = from.end();
+    for (; itr != end; ++itr) {
+        Indexer::valuearray & vals = to[itr->first];
+        vals.insert(vals.end(), itr->second.begin(), itr->second.end());
+    }
+}
+
+Local<Array> ids_of(Indexer::postings const& data) {
+    std::vector<Indexer::id_type> ids;
+    ids.reserve(data.size());
+    Indexer::postings::const_iterator itr = data.begin();
+    Indexer::postings::const_iterator end = data.end();
+    for (; itr != end; ++itr) {
+        ids.push_back(itr->first);
+    }
+    std::sort(ids.begin(), ids.end());
+    Local<Array> arr = Array::New(static_cast<int>(ids.size()));
+    for (unsigned i = 0; i < ids.size(); ++i) {
+        arr->Set(i, Number::New(ids[i]));
+    }
+    return arr;
+}
+
+struct indexer_baton {
+    uv_work_t request;
+    Indexer * indexer;
+    NanCallback cb;
+    bool error;
+    std::string error_name;
+    indexer_baton(Local<Function> callbackHandle, Indexer * _indexer) :
+      indexer(_indexer),
+      cb(callbackHandle),
+      error(false),
+      error_name() {
+        request.data = this;
+        indexer->busy_ = true;
+        indexer->_ref();
+      }
+    ~indexer_baton() {
+         indexer->busy_ = false;
+         indexer->_unref();
+    }
+};
+
+void Indexer::AsyncFrequency(uv_work_t* req) {
+    indexer_baton *closure = static_cast<indexer_baton *>(req->data);
+    Indexer & indexer = *closure->indexer;
+    std::vector<chunk> chunks;
+    indexer.run(chunks, frequency_chunk);
+    for (std::size_t i = 0; i < chunks.size(); ++i) {
+        if (chunks[i].error) {
+            closure->error = true;
+            closure->error_name = chunks[i].error_name;
+            return;
+        }
+        frequencies::const_iterator itr = chunks[i].freq.begin();
+        frequencies::const_iterator end = chunks[i].freq.end();
+        for (; itr != end; ++itr) {
+            indexer.batch_[itr->first] += itr->second;
+        }
+    }
+}
+
+void Indexer::AfterFrequency(uv_work_t* req) {
+    NanScope();
+    indexer_baton *closure = static_cast<indexer_baton *>(req->data);
+    TryCatch try_catch;
+    if (closure->error) {
+        Local<Value> argv[1] = { Exception::Error(String::New(closure->error_name.c_str())) };
+        closure->cb.Call(1, argv);
+    } else {
+        frequencies const& batch = closure->indexer->batch_;
+        std::vector<id_type> ids;
+        ids.reserve(batch.size());
+        for (frequencies::const_iterator itr = batch.begin(); itr != batch.end(); ++itr) {
+            ids.push_back(itr->first);
+        }
+        std::sort(ids.begin(), ids.end());
+        Local<Array> arr = Array::New(static_cast<int>(ids.size()));
+        for (unsigned i = 0; i < ids.size(); ++i) {
+            arr->Set(i, Number::New(ids[i]));
+        }
+        Local<Value> argv[2] = { Local<Value>::New(Null()), arr };
+        closure->cb.Call(2, argv);
+    }
+    if (try_catch.HasCaught())
+    {
+        node::FatalException(try_catch);
+    }
+    delete closure;
+}
+
+NAN_METHOD(Indexer::frequency)
+{
+    NanScope();
+    if (args.Length() < 3) {
+        return NanThrowTypeError("expected three args: 'texts', 'grids' and 'callback'");
+    }
+    if (!args[0]->IsArray()) {
+        return NanThrowTypeError("first arg 'texts' must be an Array");
+    }
+    if (!args[1]->IsArray()) {
+        return NanThrowTypeError("second arg 'grids' must be an Array");
+    }
+    if (!args[2]->IsFunction()) {
+        return NanThrowTypeError("third arg must be a Function");
+    }
+    Indexer* indexer = node::ObjectWrap::Unwrap<Indexer>(args.This());
+    if (indexer->busy_) {
+        return NanThrowTypeError("indexer is busy");
+    }
+    Local<Array> texts = Local<Array>::Cast(args[0]);
+    Local<Array> grids = Local<Array>::Cast(args[1]);
+    if (texts->Length() != grids->Length()) {
+        return NanThrowTypeError("'texts' and 'grids' must have the same length");
+    }
+    try {
+        std::vector<doc> docs(texts->Length());
+        for (uint32_t d = 0; d < docs.size(); ++d) {
+            Local<Value> doctexts = texts->Get(d);
+            Local<Value> docgrid = grids->Get(d);
+            if (!doctexts->IsArray() || !docgrid->IsArray()) {
+                throw std::runtime_error("frequency: each doc must have an Array of texts and an Array of grids");
+            }
+            Local<Array> textarr = Local<Array>::Cast(doctexts);
+            docs[d].texts.resize(textarr->Length());
+            for (uint32_t x = 0; x < textarr->Length(); ++x) {
+                Local<Value> tokens = textarr->Get(x);
+                if (!tokens->IsArray()) {
+                    throw std::runtime_error("frequency: each text must be an Array of tokens");
+                }
+                Local<Array> tokenarr = Local<Array>::Cast(tokens);
+                tokenset & out = docs[d].texts[x];
+                out.reserve(tokenarr->Length());
+                for (uint32_t k = 0; k < tokenarr->Length(); ++k) {
+                    String::Value tok(tokenarr->Get(k)->ToString());
+                    out.push_back(token(reinterpret_cast<const token::value_type *>(*tok), static_cast<std::size_t>(tok.length())));
+                }
+            }
+            Local<Array> gridarr = Local<Array>::Cast(docgrid);
+            docs[d].grid.reserve(gridarr->Length());
+            for (uint32_t g = 0; g < gridarr->Length(); ++g) {
+                docs[d].grid.push_back(static_cast<value_type>(gridarr->Get(g)->NumberValue()));
+            }
+        }
+        indexer->docs_.swap(docs);
+        indexer->batch_.clear();
+        indexer->freq_.clear();
+        // freq[0] holds the total count and is always loaded
+        indexer->batch_[0] = 0;
+        indexer_baton *closure = new indexer_baton(args[2].As<Function>(), indexer);
+        uv_queue_work(uv_default_loop(), &closure->request, AsyncFrequency, (uv_after_work_cb)AfterFrequency);
+    } catch (std::exception const& ex) {
+        return NanThrowTypeError(ex.what());
+    }
+    NanReturnValue(Undefined());
+}
+
+void Indexer::AsyncIndex(uv_work_t* req) {
+    indexer_baton *closure = static_cast<indexer_baton *>(req->data);
+    Indexer & indexer = *closure->indexer;
+    std::vector<chunk> chunks;
+    indexer.run(chunks, index_chunk);
+    for (std::size_t i = 0; i < chunks.size(); ++i) {
+        if (chunks[i].error) {
+            closure->error = true;
+            closure->error_name = chunks[i].error_name;
+            return;
+        }
+    }
+    // Merge in document order: postings are appended chunk by chunk, the
+    // first phrase wins and degens go to the first chunk to see a term.
+    for (std::size_t i = 0; i < chunks.size(); ++i) {
+        chunk & c = chunks[i];
+        append(indexer.postings_[term_type], c.term);
+        append(indexer.postings_[grid_type], c.grid);
+        postings & phrases = indexer.postings_[phrase_type];
+        for (postings::iterator itr = c.phrase.begin(); itr != c.phrase.end(); ++itr) {
+            if (phrases.find(itr->first) == phrases.end()) {
+                phrases[itr->first].swap(itr->second);
+            }
+        }
+        for (std::size_t f = 0; f < c.fresh.size(); ++f) {
+            if (!indexer.known_.insert(c.fresh[f].term).second) continue;
+            std::vector<std::pair<id_type,value_type> > const& pairs = c.fresh[f].postings;
+            for (std::size_t p = 0; p < pairs.size(); ++p) {
+                indexer.postings_[degen_type][pairs[p].first].push_back(pairs[p].second);
+            }
+        }
+    }
+    std::vector<doc>().swap(indexer.docs_);
+}
+
+void Indexer::AfterIndex(uv_work_t* req) {
+    NanScope();
+    indexer_baton *closure = static_cast<indexer_baton *>(req->data);
+    TryCatch try_catch;
+    if (closure->error) {
+        Local<Value> argv[1] = { Exception::Error(String::New(closure->error_name.c_str())) };
+        closure->cb.Call(1, argv);
+    } else {
+        Indexer & indexer = *closure->indexer;
+        Local<Object> patched = Object::New();
+        for (std::size_t t = 0; t < posting_count; ++t) {
+            patched->Set(String::NewSymbol(posting_types[t]), ids_of(indexer.postings_[t]));
+        }
+        Local<Value> argv[2] = { Local<Value>::New(Null()), patched };
+        closure->cb.Call(2, argv);
+    }
+    if (try_catch.HasCaught())
+    {
+        node::FatalException(try_catch);
+    }
+    delete closure;
+}
+
+NAN_METHOD(Indexer::index)
+{
+    NanScope();
+    if (args.Length() < 2) {
+        return NanThrowTypeError("expected two args: 'cache' and 'callback'");
+    }
+    if (!args[0]->IsObject() || !NanPersistentToLocal(Cache::constructor)->HasInstance(args[0])) {
+        return NanThrowTypeError("first arg must be a Cache");
+    }
+    if (!args[1]->IsFunction()) {
+        return NanThrowTypeError("second arg must be a Function");
+    }
+    Indexer* indexer = node::ObjectWrap::Unwrap<Indexer>(args.This());
+    if (indexer->busy_) {
+        return NanThrowTypeError("indexer is busy");
+    }
+    try {
+        // Add batch counts to the stored frequencies. Their shards are
+        // expected to be loaded already.
+        Cache* c = node::ObjectWrap::Unwrap<Cache>(args[0]->ToObject())->live();
+        unsigned freq_type = Cache::type_id("freq");
+        frequencies::const_iterator itr = indexer->batch_.begin();
+        frequencies::const_iterator end = indexer->batch_.end();
+        for (; itr != end; ++itr) {
+            Cache::key_type key = c->shard_key(freq_type, itr->first);
+            Cache::intarray current;
+            uint64_t count = itr->second;
+            if (c->get(key, itr->first, current) && !current.empty()) {
+                count += current[0];
+            }
+            indexer->freq_[itr->first] = count;
+            current.assign(1, count);
+            c->set(key, itr->first, current);
+        }
+        indexer_baton *closure = new indexer_baton(args[1].As<Function>(), indexer);
+        uv_queue_work(uv_default_loop(), &closure->request, AsyncIndex, (uv_after_work_cb)AfterIndex);
+    } catch (std::exception const& ex) {
+        return NanThrowTypeError(ex.what());
+    }
+    NanReturnValue(Undefined());
+}
+
+// Merge the postings of one type into the cache, the same way update() in
+// lib/index.js merges a patch. Their shards are expected to be loaded.
+NAN_METHOD(Indexer::apply)
+{
+    NanScope();
+    if (args.Length() < 2) {
+        return NanThrowTypeError("expected two args: 'cache' and 'type'");
+    }
+    if (!args[0]->IsObject() || !NanPersistentToLocal(Cache::constructor)->HasInstance(args[0])) {
+        return NanThrowTypeError("first arg must be a Cache");
+    }
+    if (!args[1]->IsString()) {
+        return NanThrowTypeError("second arg must be a String");
+    }
+    Indexer* indexer = node::ObjectWrap::Unwrap<Indexer>(args.This());
+    if (indexer->busy_) {
+        return NanThrowTypeError("indexer is busy");
+    }
+    try {
+        Cache* c = node::ObjectWrap::Unwrap<Cache>(args[0]->ToObject())->live();
+        std::string type = *String::Utf8Value(args[1]->ToString());
+        std::size_t t = posting_type(type);
+        postings * data = &indexer->postings_[t];
+        unsigned tid = Cache::type_id(type);
+        postings::iterator itr = data->begin();
+        postings::iterator end = data->end();
+        for (; itr != end; ++itr) {
+            Cache::key_type key = c->shard_key(tid, itr->first);
+            Cache::intarray current;
+            if (t != phrase_type && c->get(key, itr->first, current)) {
+                current.insert(current.end(), itr->second.begin(), itr->second.end());
+                if (t == term_type && current.size() > 2000) {
+                    lexical_uniq(current);
+                }
+                c->set(key, itr->first, current);
+            } else {
+                c->set(key, itr->first, itr->second);
+            }
+        }
+        postings().swap(*data);
+    } catch (std::exception const& ex) {
+        return NanThrowTypeError(ex.what());
+    }
+    NanReturnValue(Undefined());
+}
+
+inline unsigned process_id() {
+#ifdef _WIN32
+    return static_cast<unsigned>(_getpid());
+#else
+    return static_cast<unsigned>(getpid());
+#endif
+}
+
+// Write the pending postings to a new run file. List values are sorted and
+// deduplicated like store() does, so runs only need merging.
+void Indexer::write_run() {
+    std::stringstream name("");
+    name << dir_ << "/carmen-" << process_id() << "-" << id_ << "-" << runs_.size() << ".run";
+    runfile r;
+    r.path = name.str();
+    FILE * f = fopen(r.path.c_str(), "wb");
+    if (!f) {
+        throw std::runtime_error("spill: cannot open '" + r.path + "' for writing");
+    }
+    unsigned bits = shardlevel_ ? 32 - 4 * shardlevel_ : 32;
+    uint64_t offset = 0;
+    bool ok = true;
+    for (std::size_t t = 0; t < posting_count && ok; ++t) {
+        postings & data = pending_[t];
+        std::vector<id_type> ids;
+        ids.reserve(data.size());
+        for (postings::const_iterator itr = data.begin(); itr != data.end(); ++itr) {
+            ids.push_back(itr->first);
+        }
+        std::sort(ids.begin(), ids.end());
+        for (std::size_t i = 0; i < ids.size() && ok; ++i) {
+            valuearray & vals = data[ids[i]];
+            if (t != phrase_type) {
+                lexical_uniq(vals);
+            }
+            uint32_t header[2] = { ids[i], static_cast<uint32_t>(vals.size()) };
+            ok = fwrite(header, sizeof(uint32_t), 2, f) == 2 &&
+                (vals.empty() || fwrite(&vals[0], sizeof(value_type), vals.size(), f) == vals.size());
+            uint64_t shard = bits < 32 ? ids[i] >> bits : 0;
+            segments::iterator seg = r.shards[t].find(shard);
+            if (seg == r.shards[t].end()) {
+                segment fresh = { offset, offset };
+                seg = r.shards[t].insert(std::make_pair(shard, fresh)).first;
+            }
+            offset += sizeof(header) + vals.size() * sizeof(value_type);
+            seg->second.end = offset;
+        }
+        postings().swap(data);
+    }
+    ok = fclose(f) == 0 && ok;
+    pending_size_ = 0;
+    if (!ok) {
+        std::remove(r.path.c_str());
+        throw std::runtime_error("spill: failed writing '" + r.path + "'");
+    }
+    runs_.push_back(r);
+}
+
+void Indexer::remove_runs() {
+    for (std::size_t i = 0; i < runs_.size(); ++i) {
+        std::remove(runs_[i].path.c_str());
+    }
+    runs_.clear();
+}
+
+// Move the batch postings into the pending tables, the way apply() merges
+// them into the cache, and write a run once they outgrow memory_.
+void Indexer::AsyncSpill(uv_work_t* req) {
+    indexer_baton *closure = static_cast<indexer_baton *>(req->data);
+    Indexer & indexer = *closure->indexer;
+    try {
+        for (std::size_t t = 0; t < posting_count; ++t) {
+            postings & from = indexer.postings_[t];
+            postings & to = indexer.pending_[t];
+            for (postings::iterator itr = from.begin(); itr != from.end(); ++itr) {
+                // sized before the swaps below empty or replace the array
+                std::size_t size = itr->second.size() * sizeof(value_type);
+                postings::iterator found = to.find(itr->first);
+                if (found == to.end()) {
+                    to[itr->first].swap(itr->second);
+                    // rough per entry overhead of the table and array
+                    indexer.pending_size_ += 64 + size;
+                } else if (t == phrase_type) {
+                    indexer.pending_size_ -= found->second.size() * sizeof(value_type);
+                    indexer.pending_size_ += size;
+                    found->second.swap(itr->second);
+                } else {
+                    found->second.insert(found->second.end(), itr->second.begin(), itr->second.end());
+                    indexer.pending_size_ += size;
+                }
+            }
+            postings().swap(from);
+        }
+        if (indexer.pending_size_ >= indexer.memory_) {
+            indexer.write_run();
+        }
+    } catch (std::exception const& ex) {
+        closure->error = true;
+        closure->error_name = ex.what();
+    }
+}
+
+void Indexer::AsyncFlush(uv_work_t* req) {
+    indexer_baton *closure = static_cast<indexer_baton *>(req->data);
+    Indexer & indexer = *closure->indexer;
+    try {
+        bool pending = false;
+        for (std::size_t t = 0; t < posting_count; ++t) {
+            pending = pending || !indexer.pending_[t].empty();
+        }
+        if (pending) {
+            indexer.write_run();
+        }
+    } catch (std::exception const& ex) {
+        closure->error = true;
+        closure->error_name = ex.what();
+    }
+}
+
+void Indexer::AfterSpill(uv_work_t* req) {
+    NanScope();
+    indexer_baton *closure = static_cast<indexer_baton *>(req->data);
+    TryCatch try_catch;
+    if (closure->error) {
+        Local<Value> argv[1] = { Exception::Error(String::New(closure->error_name.c_str())) };
+        closure->cb.Call(1, argv);
+    } else {
+        Local<Value> argv[1] = { Local<Value>::New(Null()) };
+        closure->cb.Call(1, argv);
+    }
+    if (try_catch.HasCaught())
+    {
+        node::FatalException(try_catch);
+    }
+    delete closure;
+}
+
+// Takes the place of apply() when spilling: the postings of the batch are
+// set aside instead of being merged into the cache. `cache` is only used
+// for its shardlevel.
+NAN_METHOD(Indexer::spill)
+{
+    NanScope();
+    if (args.Length() < 2) {
+        return NanThrowTypeError("expected two args: 'cache' and 'callback'");
+    }
+    if (!args[0]->IsObject() || !NanPersistentToLocal(Cache::constructor)->HasInstance(args[0])) {
+        return NanThrowTypeError("first arg must be a Cache");
+    }
+    if (!args[1]->IsFunction()) {
+        return NanThrowTypeError("second arg must be a Function");
+    }
+    Indexer* indexer = node::ObjectWrap::Unwrap<Indexer>(args.This());
+    if (indexer->busy_) {
+        return NanThrowTypeError("indexer is busy");
+    }
+    if (indexer->dir_.empty()) {
+        return NanThrowTypeError("spill: indexer has no spill directory");
+    }
+    Cache* c = node::ObjectWrap::Unwrap<Cache>(args[0]->ToObject())->live();
+    indexer->shardlevel_ = c->shardlevel();
+    indexer_baton *closure = new indexer_baton(args[1].As<Function>(), indexer);
+    uv_queue_work(uv_default_loop(), &closure->request, AsyncSpill, (uv_after_work_cb)AfterSpill);
+    NanReturnValue(Undefined());
+}
+
+// Writes whatever is pending to a last run.
+NAN_METHOD(Indexer::flush)
+{
+    NanScope();
+    if (args.Length() < 1 || !args[0]->IsFunction()) {
+        return NanThrowTypeError("first arg must be a Function");
+    }
+    Indexer* indexer = node::ObjectWrap::Unwrap<Indexer>(args.This());
+    if (indexer->busy_) {
+        return NanThrowTypeError("indexer is busy");
+    }
+    if (indexer->dir_.empty()) {
+        return NanThrowTypeError("flush: indexer has no spill directory");
+    }
+    indexer_baton *closure = new indexer_baton(args[0].As<Function>(), indexer);
+    uv_queue_work(uv_default_loop(), &closure->request, AsyncFlush, (uv_after_work_cb)AfterSpill);
+    NanReturnValue(Undefined());
+}
+
+// Shards of `type` with postings in any run, sorted.
+NAN_METHOD(Indexer::shards)
+{
+    NanScope();
+    if (args.Length() < 1 || !args[0]->IsString()) {
+        return NanThrowTypeError("first arg must be a String");
+    }
+    Indexer* indexer = node::ObjectWrap::Unwrap<Indexer>(args.This());
+    try {
+        std::size_t t = posting_type(*String::Utf8Value(args[0]->ToString()));
+        std::vector<uint64_t> shards;
+        for (std::size_t i = 0; i < indexer->runs_.size(); ++i) {
+            segments const& segs = indexer->runs_[i].shards[t];
+            for (segments::const_iterator itr = segs.begin(); itr != segs.end(); ++itr) {
+                shards.push_back(itr->first);
+            }
+        }
+        std::sort(shards.begin(), shards.end());
+        shards.erase(std::unique(shards.begin(), shards.end()), shards.end());
+        Local<Array> arr = Array::New(static_cast<int>(shards.size()));
+        for (unsigned i = 0; i < shards.size(); ++i) {
+            arr->Set(i, Number::New(static_cast<double>(shards[i])));
+        }
+        NanReturnValue(arr);
+    } catch (std::exception const& ex) {
+        return NanThrowTypeError(ex.what());
+    }
+    NanReturnValue(Undefined());
+}
+
+NAN_METHOD(Indexer::runs)
+{
+    NanScope();
+    Indexer* indexer = node::ObjectWrap::Unwrap<Indexer>(args.This());
+    NanReturnValue(Number::New(static_cast<double>(indexer->runs_.size())));
+}
+
+// Reads the records of one shard of a run file in id order.
+class run_reader {
+public:
+    run_reader(std::string const& path, Indexer::segment const& seg)
+      : id(0),
+        vals(),
+        file_(fopen(path.c_str(), "rb")),
+        remaining_(seg.end - seg.begin) {
+        if (!file_ || fseek(file_, static_cast<long>(seg.begin), SEEK_SET) != 0) {
+            throw std::runtime_error("merge: cannot read '" + path + "'");
+        }
+    }
+    ~run_reader() {
+        if (file_) fclose(file_);
+    }
+    // Reads the next record, returns false past the end of the shard.
+    bool next() {
+        if (!remaining_) return false;
+        uint32_t header[2];
+        if (fread(header, sizeof(uint32_t), 2, file_) != 2) {
+            throw std::runtime_error("merge: truncated run file");
+        }
+        id = header[0];
+        vals.resize(header[1]);
+        if (!vals.empty() && fread(&vals[0], sizeof(Indexer::value_type), vals.size(), file_) != vals.size()) {
+            throw std::runtime_error("merge: truncated run file");
+        }
+        uint64_t size = sizeof(header) + vals.size() * sizeof(Indexer::value_type);
+        if (size > remaining_) {
+            throw std::runtime_error("merge: run file record overruns its shard");
+        }
+        remaining_ -= size;
+        return true;
+    }
+    Indexer::id_type id;
+    Indexer::valuearray vals;
+private:
+    run_reader(run_reader const&);
+    run_reader & operator=(run_reader const&);
+    FILE * file_;
+    uint64_t remaining_;
+};
+
+struct merge_baton {
+    uv_work_t request;
+    Indexer * indexer;
+    NanCallback cb;
+    std::size_t type;
+    uint64_t shard;
+    // the stored shard and the merged result, protobuf encoded
+    std::string base;
+    std::string result;
+    bool error;
+    std::string error_name;
+    merge_baton(Local<Function> callbackHandle, Indexer * _indexer) :
+      indexer(_indexer),
+      cb(callbackHandle),
+      type(0),
+      shard(0),
+      base(),
+      result(),
+      error(false),
+      error_name() {
+        request.data = this;
+        ++indexer->merging_;
+        indexer->_ref();
+      }
+    ~merge_baton() {
+         --indexer->merging_;
+         indexer->_unref();
+    }
+};
+
+// k-way merge of a shard's records across runs, oldest to newest, with the
+// stored shard as the oldest run. Only the current record of each run is
+// held in memory. Values of an id are combined and deduplicated the way
+// update() and store() would have, except phrases where the newest wins.
+void Indexer::AsyncMerge(uv_work_t* req) {
+    merge_baton *closure = static_cast<merge_baton *>(req->data);
+    Indexer & indexer = *closure->indexer;
+    try {
+        std::size_t t = closure->type;
+        carmen::proto::object base;
+        if (!closure->base.empty() && !base.ParseFromString(closure->base)) {
+            throw std::runtime_error("merge: could not decode stored shard");
+        }
+        std::string().swap(closure->base);
+        std::vector<shared_ptr<run_reader> > readers;
+        for (std::size_t i = 0; i < indexer.runs_.size(); ++i) {
+            segments const& segs = indexer.runs_[i].shards[t];
+            segments::const_iterator seg = segs.find(closure->shard);
+            if (seg == segs.end()) continue;
+            shared_ptr<run_reader> reader(new run_reader(indexer.runs_[i].path, seg->second));
+            if (reader->next()) readers.push_back(reader);
+        }
+        // stored shards are packed in id order
+        std::vector<std::pair<id_type,int> > stored;
+        stored.reserve(static_cast<std::size_t>(base.items_size()));
+        for (int i = 0; i < base.items_size(); ++i) {
+            stored.push_back(std::make_pair(static_cast<id_type>(base.items(i).key()), i));
+        }
+        std::sort(stored.begin(), stored.end());
+        std::size_t b = 0;
+        carmen::proto::object message;
+        valuearray vals;
+        while (true) {
+            bool found = b < stored.size();
+            id_type id = found ? stored[b].first : 0;
+            for (std::size_t r = 0; r < readers.size(); ++r) {
+                if (!found || readers[r]->id < id) {
+                    id = readers[r]->id;
+                    found = true;
+                }
+            }
+            if (!found) break;
+            vals.clear();
+            if (b < stored.size() && stored[b].first == id) {
+                carmen::proto::object_item const& item = base.items(stored[b].second);
+                for (int v = 0; v < item.val_size(); ++v) {
+                    vals.push_back(static_cast<value_type>(item.val(v)));
+                }
+                ++b;
+            }
+            for (std::size_t r = 0; r < readers.size();) {
+                run_reader & reader = *readers[r];
+                if (reader.id != id) {
+                    ++r;
+                    continue;
+                }
+                if (t == phrase_type) {
+                    vals.swap(reader.vals);
+                } else {
+                    vals.insert(vals.end(), reader.vals.begin(), reader.vals.end());
+                }
+                if (reader.next()) {
+                    ++r;
+                } else {
+                    readers.erase(readers.begin() + static_cast<std::ptrdiff_t>(r));
+                }
+            }
+            if (t != phrase_type) {
+                lexical_uniq(vals);
+            }
+            ::carmen::proto::object_item * new_item = message.add_items();
+            new_item->set_key(id);
+            for (std::size_t v = 0; v < vals.size(); ++v) {
+                new_item->add_val(static_cast<int64_t>(vals[v]));
+            }
+        }
+        if (!message.SerializeToString(&closure->result)) {
+            throw std::runtime_error("merge: could not encode shard");
+        }
+    } catch (std::exception const& ex) {
+        closure->error = true;
+        closure->error_name = ex.what();
+    }
+}
+
+void Indexer::AfterMerge(uv_work_t* req) {
+    NanScope();
+    merge_baton *closure = static_cast<merge_baton *>(req->data);
+    TryCatch try_catch;
+    if (closure->error) {
+        Local<Value> argv[1] = { Exception::Error(String::New(closure->error_name.c_str())) };
+        closure->cb.Call(1, argv);
+    } else {
+        std::string const& result = closure->result;
+#if NODE_VERSION_AT_LEAST(0, 11, 0)
+        Local<Value> retbuf = node::Buffer::New(result.data(), result.size());
+#else
+        Local<Value> retbuf = Local<Value>::New(node::Buffer::New(result.data(), result.size())->handle_);
+#endif
+        Local<Value> argv[2] = { Local<Value>::New(Null()), retbuf };
+        closure->cb.Call(2, argv);
+    }
+    if (try_catch.HasCaught())
+    {
+        node::FatalException(try_catch);
+    }
+    delete closure;
+}
+
+// Merges the runs of a shard with `buffer`, the shard as stored, and calls
+// back with `(err, buffer)` for the merged shard. Merges may run in
+// parallel once every batch is flushed.
+NAN_METHOD(Indexer::merge)
+{
+    NanScope();
+    if (args.Length() < 4) {
+        return NanThrowTypeError("expected four args: 'type', 'shard', 'buffer' and 'callback'");
+    }
+    if (!args[0]->IsString()) {
+        return NanThrowTypeError("first arg must be a String");
+    }
+    if (!args[1]->IsNumber()) {
+        return NanThrowTypeError("second arg must be an Integer");
+    }
+    if (!args[3]->IsFunction()) {
+        return NanThrowTypeError("fourth arg must be a Function");
+    }
+    Indexer* indexer = node::ObjectWrap::Unwrap<Indexer>(args.This());
+    if (indexer->busy_) {
+        return NanThrowTypeError("indexer is busy");
+    }
+    try {
+        std::size_t t = posting_type(*String::Utf8Value(args[0]->ToString()));
+        std::string base;
+        if (node::Buffer::HasInstance(args[2])) {
+            Local<Object> obj = args[2]->ToObject();
+            base.assign(node::Buffer::Data(obj), node::Buffer::Length(obj));
+        } else if (!args[2]->IsNull() && !args[2]->IsUndefined()) {
+            throw std::runtime_error("third arg must be a Buffer");
+        }
+        merge_baton *closure = new merge_baton(args[3].As<Function>(), indexer);
+        closure->type = t;
+        closure->shard = static_cast<uint64_t>(args[1]->IntegerValue());
+        closure->base.swap(base);
+        uv_queue_work(uv_default_loop(), &closure->request, AsyncMerge, (uv_after_work_cb)AfterMerge);
+    } catch (std::exception const& ex) {
+        return NanThrowTypeError(ex.what());
+    }
+    NanReturnValue(Undefined());
+}
+
+// Deletes all run files.
+NAN_METHOD(Indexer::clear)
+{
+    NanScope();
+    Indexer* indexer = node::ObjectWrap::Unwrap<Indexer>(args.This());
+    if (indexer->busy_ || indexer->merging_) {
+        return NanThrowTypeError("indexer is busy");
+    }
+    indexer->remove_runs();
+    NanReturnValue(Undefined());
+}
+
+NAN_METHOD(Indexer::New)
+{
+    NanScope();
+    if (!args.IsConstructCall()) {
+        return NanThrowTypeError("Cannot call constructor as function, you need to use 'new' keyword");
+    }
+    try {
+        unsigned threads = 1;
+        if (args.Length() > 0) {
+            if (!args[0]->IsNumber() || args[0]->IntegerValue() < 1) {
+                return NanThrowTypeError("first argument 'threads' must be a positive number");
+            }
+            threads = static_cast<unsigned>(args[0]->IntegerValue());
+        }
+        std::string dir;
+        // 256MB of pending postings per run by default
+        std::size_t memory = 256 * 1024 * 1024;
+        if (args.Length() > 1 && !args[1]->IsUndefined()) {
+            if (!args[1]->IsObject()) {
+                return NanThrowTypeError("second argument 'options' must be an Object");
+            }
+            Local<Object> options = args[1]->ToObject();
+            Local<Value> optdir = options->Get(String::NewSymbol("dir"));
+            Local<Value> optmemory = options->Get(String::NewSymbol("memory"));
+            if (!optdir->IsString()) {
+                return NanThrowTypeError("option 'dir' must be a String");
+            }
+            dir = *String::Utf8Value(optdir->ToString());
+            if (!optmemory->IsUndefined()) {
+                if (!optmemory->IsNumber() || optmemory->NumberValue() < 0) {
+                    return NanThrowTypeError("option 'memory' must be a number of bytes");
+                }
+                memory = static_cast<std::size_t>(optmemory->NumberValue());
+            }
+        }
+        Indexer* im = new Indexer(threads, dir, memory);
+        im->Wrap(args.This());
+        args.This()->Set(String::NewSymbol("threads"),Number::New(threads));
+        args.This()->Set(String::NewSymbol("spilling"),Boolean::New(!dir.empty()));
+        NanReturnValue(args.This());
+    } catch (std::exception const& ex) {
+        return NanThrowTypeError(ex.what());
+    }
+    NanReturnValue(Undefined());
+}
+
+} // namespace binding
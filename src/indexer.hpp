@@ -0,0 +1,156 @@
+#ifndef __CARMEN_INDEXER_HPP__
+#define __CARMEN_INDEXER_HPP__
+
+// v8
+#include <v8.h>
+
+// node
+#include <node.h>
+#include <node_object_wrap.h>
+
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wconversion"
+#pragma clang diagnostic ignored "-Wshadow"
+#pragma clang diagnostic ignored "-Wsign-compare"
+#include <nan.h>
+#include <string>
+#include <utility>
+#include <vector>
+#ifdef USE_CXX11
+#include <unordered_map>
+#include <unordered_set>
+#else
+#include <map>
+#include <set>
+#endif
+#pragma clang diagnostic pop
+
+#include "binding.hpp"
+
+namespace binding {
+
+// Builds freq, term, phrase, grid and degen postings for batches of
+// tokenized documents, the native counterpart of generateFrequency and
+// loadDoc in lib/index.js. Each batch is split across worker threads
+// that fill their own tables, which are merged in document order so the
+// result matches indexing the batch one document at a time.
+//
+// With a spill directory set, postings are not merged into the cache
+// batch by batch. They are gathered in memory and written out as run files,
+// sorted by id, whenever they outgrow a threshold. `merge` then combines
+// the runs of a shard with the stored shard one id at a time.
+class Indexer: public node::ObjectWrap {
+    ~Indexer();
+public:
+    // term, phrase and degen ids
+    typedef uint32_t id_type;
+    typedef Cache::int_type value_type;
+    typedef Cache::intarray valuearray;
+#ifdef USE_CXX11
+    typedef std::unordered_map<id_type,valuearray> postings;
+    typedef std::unordered_map<id_type,uint64_t> frequencies;
+    typedef std::unordered_set<id_type> termset;
+#else
+    typedef std::map<id_type,valuearray> postings;
+    typedef std::map<id_type,uint64_t> frequencies;
+    typedef std::set<id_type> termset;
+#endif
+    // tokens are kept as UTF-16 code units, like JS strings, so that
+    // hashes match lib/util/fnv.js
+#ifdef USE_CXX11
+    typedef std::u16string token;
+#else
+    typedef std::basic_string<uint16_t> token;
+#endif
+    typedef std::vector<token> tokenset;
+    struct doc {
+        // one tokenset per non-empty synonym of the doc's text
+        std::vector<tokenset> texts;
+        valuearray grid;
+    };
+    // degen postings of a term indexed for the first time
+    struct degens {
+        id_type term;
+        std::vector<std::pair<id_type,value_type> > postings;
+    };
+    // tables filled by one worker thread from a contiguous range of docs
+    struct chunk {
+        Indexer const* indexer;
+        std::size_t begin;
+        std::size_t end;
+        frequencies freq;
+        postings term;
+        postings phrase;
+        postings grid;
+        std::vector<degens> fresh;
+        bool error;
+        std::string error_name;
+    };
+    // byte range of a shard's records within a run file
+    struct segment {
+        uint64_t begin;
+        uint64_t end;
+    };
+    typedef std::map<uint64_t,segment> segments;
+    // a run file holds the pending postings of every type, each type
+    // sorted by id. Records are a uint32 id, a uint32 count and `count`
+    // uint64 values, in native byte order.
+    struct runfile {
+        std::string path;
+        segments shards[4];
+    };
+    static v8::Persistent<v8::FunctionTemplate> constructor;
+    static void Initialize(v8::Handle<v8::Object> target);
+    static NAN_METHOD(New);
+    static NAN_METHOD(frequency);
+    static NAN_METHOD(index);
+    static NAN_METHOD(apply);
+    static NAN_METHOD(spill);
+    static NAN_METHOD(flush);
+    static NAN_METHOD(shards);
+    static NAN_METHOD(runs);
+    static NAN_METHOD(merge);
+    static NAN_METHOD(clear);
+    static void AsyncFrequency(uv_work_t* req);
+    static void AfterFrequency(uv_work_t* req);
+    static void AsyncIndex(uv_work_t* req);
+    static void AfterIndex(uv_work_t* req);
+    static void AsyncSpill(uv_work_t* req);
+    static void AsyncFlush(uv_work_t* req);
+    static void AfterSpill(uv_work_t* req);
+    static void AsyncMerge(uv_work_t* req);
+    static void AfterMerge(uv_work_t* req);
+    Indexer(unsigned threads, std::string const& dir, std::size_t memory);
+    void _ref() { Ref(); }
+    void _unref() { Unref(); }
+    void run(std::vector<chunk> & chunks, void (*work)(void*));
+    void write_run();
+    void remove_runs();
+    unsigned threads_;
+    bool busy_;
+    std::vector<doc> docs_;
+    // term counts of the current batch
+    frequencies batch_;
+    // stored plus batch counts, used to weight terms
+    frequencies freq_;
+    // terms whose degens have been indexed
+    termset known_;
+    // term, phrase, grid and degen postings of the current batch
+    postings postings_[4];
+    // directory run files are written to, empty unless spilling
+    std::string dir_;
+    // approximate size of pending postings that triggers a run
+    std::size_t memory_;
+    // postings of spilled batches not yet written to a run
+    postings pending_[4];
+    std::size_t pending_size_;
+    unsigned shardlevel_;
+    unsigned id_;
+    std::vector<runfile> runs_;
+    // number of merges in flight, runs are kept until they finish
+    unsigned merging_;
+};
+
+}
+
+#endif // __CARMEN_INDEXER_HPP__
@@ -0,0 +1,228 @@
+#include "metrics.hpp"
+
+#include <cmath>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+namespace binding {
+
+using namespace v8;
+
+Persistent<FunctionTemplate> Metrics::constructor;
+
+void Metrics::Initialize(Handle<Object> target) {
+    NanScope();
+    Local<FunctionTemplate> t = FunctionTemplate::New(Metrics::New);
+    t->InstanceTemplate()->SetInternalFieldCount(1);
+    t->SetClassName(String::NewSymbol("Metrics"));
+    NODE_SET_PROTOTYPE_METHOD(t, "record", record);
+    NODE_SET_PROTOTYPE_METHOD(t, "stats", stats);
+    NODE_SET_PROTOTYPE_METHOD(t, "reset", reset);
+    target->Set(String::NewSymbol("Metrics"),t->GetFunction());
+    NanAssignPersistent(FunctionTemplate, constructor, t);
+}
+
+// Atomic updates of the histogram counters and the index of the highest
+// set bit, through GCC and Clang builtins or MSVC intrinsics.
+#ifdef _MSC_VER
+static inline void atomic_add(uint64_t * ptr, uint64_t val) {
+    _InterlockedExchangeAdd64(reinterpret_cast<volatile __int64 *>(ptr), static_cast<__int64>(val));
+}
+
+static inline uint64_t atomic_cas(uint64_t * ptr, uint64_t expected, uint64_t desired) {
+    return static_cast<uint64_t>(_InterlockedCompareExchange64(reinterpret_cast<volatile __int64 *>(ptr),
+                                                               static_cast<__int64>(desired),
+                                                               static_cast<__int64>(expected)));
+}
+
+// `val` must not be 0.
+static inline unsigned highest_bit(uint64_t val) {
+    unsigned long index;
+    if (_BitScanReverse(&index, static_cast<unsigned long>(val >> 32))) {
+        return static_cast<unsigned>(index) + 32;
+    }
+    _BitScanReverse(&index, static_cast<unsigned long>(val));
+    return static_cast<unsigned>(index);
+}
+#else
+static inline void atomic_add(uint64_t * ptr, uint64_t val) {
+    __sync_fetch_and_add(ptr, val);
+}
+
+static inline uint64_t atomic_cas(uint64_t * ptr, uint64_t expected, uint64_t desired) {
+    return __sync_val_compare_and_swap(ptr, expected, desired);
+}
+
+// `val` must not be 0.
+static inline unsigned highest_bit(uint64_t val) {
+    return 63 - static_cast<unsigned>(__builtin_clzll(val));
+}
+#endif
+
+static void clear_histogram(Metrics::histogram & h) {
+    for (unsigned i = 0; i < Metrics::bucket_count; ++i) {
+        h.buckets[i] = 0;
+    }
+    h.sum = 0;
+    h.min = static_cast<uint64_t>(-1);
+    h.max = 0;
+}
+
+Metrics::Metrics(std::vector<std::string> const& stages)
+  : ObjectWrap(),
+    stages_(stages),
+    histograms_(stages.size()) {
+    for (std::size_t i = 0; i < histograms_.size(); ++i) {
+        clear_histogram(histograms_[i]);
+    }
+}
+
+Metrics::~Metrics() { }
+
+unsigned Metrics::bucket(uint64_t ns) {
+    if (ns < sub_count) {
+        return static_cast<unsigned>(ns);
+    }
+    unsigned exp = highest_bit(ns);
+    unsigned sub = static_cast<unsigned>(ns >> (exp - sub_bits)) & (sub_count - 1);
+    return (exp - sub_bits + 1) * sub_count + sub;
+}
+
+// Midpoint of the values falling in `bucket`.
+uint64_t Metrics::bucket_value(unsigned bucket) {
+    if (bucket < sub_count) {
+        return bucket;
+    }
+    unsigned exp = bucket / sub_count + sub_bits - 1;
+    uint64_t sub = bucket % sub_count;
+    uint64_t width = static_cast<uint64_t>(1) << (exp - sub_bits);
+    return (sub_count + sub) * width + width / 2;
+}
+
+// Counters are updated atomically rather than under a lock. A reader
+// may see a record partially applied, which only skews stats by one value.
+void Metrics::add(unsigned stage, uint64_t ns) {
+    histogram & h = histograms_[stage];
+    atomic_add(&h.buckets[bucket(ns)], 1);
+    atomic_add(&h.sum, ns);
+    uint64_t current = h.min;
+    while (ns < current) {
+        uint64_t previous = atomic_cas(&h.min, current, ns);
+        if (previous == current) break;
+        current = previous;
+    }
+    current = h.max;
+    while (ns > current) {
+        uint64_t previous = atomic_cas(&h.max, current, ns);
+        if (previous == current) break;
+        current = previous;
+    }
+}
+
+NAN_METHOD(Metrics::record)
+{
+    NanScope();
+    if (args.Length() < 2) {
+        return NanThrowTypeError("expected two args: 'stage' and 'ns'");
+    }
+    if (!args[0]->IsNumber()) {
+        return NanThrowTypeError("first arg must be an Integer");
+    }
+    if (!args[1]->IsNumber()) {
+        return NanThrowTypeError("second arg must be a Number");
+    }
+    Metrics* m = node::ObjectWrap::Unwrap<Metrics>(args.This());
+    int64_t stage = args[0]->IntegerValue();
+    if (stage < 0 || static_cast<uint64_t>(stage) >= m->histograms_.size()) {
+        return NanThrowTypeError("unknown stage");
+    }
+    double ns = args[1]->NumberValue();
+    m->add(static_cast<unsigned>(stage), ns > 0 ? static_cast<uint64_t>(ns) : 0);
+    NanReturnValue(Undefined());
+}
+
+// Value at quantile `q` of a copy of a histogram's buckets.
+static double percentile(std::vector<uint64_t> const& buckets, uint64_t count, double q) {
+    uint64_t rank = static_cast<uint64_t>(std::ceil(q * static_cast<double>(count)));
+    if (rank == 0) rank = 1;
+    uint64_t seen = 0;
+    for (unsigned i = 0; i < buckets.size(); ++i) {
+        seen += buckets[i];
+        if (seen >= rank) {
+            return static_cast<double>(Metrics::bucket_value(i));
+        }
+    }
+    return static_cast<double>(Metrics::bucket_value(static_cast<unsigned>(buckets.size() - 1)));
+}
+
+// Per stage count, mean, min, max and percentiles, in milliseconds.
+NAN_METHOD(Metrics::stats)
+{
+    NanScope();
+    Metrics* m = node::ObjectWrap::Unwrap<Metrics>(args.This());
+    Local<Object> result = Object::New();
+    for (std::size_t s = 0; s < m->histograms_.size(); ++s) {
+        histogram const& h = m->histograms_[s];
+        std::vector<uint64_t> buckets(h.buckets, h.buckets + bucket_count);
+        uint64_t count = 0;
+        for (unsigned i = 0; i < bucket_count; ++i) {
+            count += buckets[i];
+        }
+        Local<Object> stage = Object::New();
+        stage->Set(String::NewSymbol("count"), Number::New(static_cast<double>(count)));
+        if (count > 0) {
+            double min = static_cast<double>(h.min);
+            double max = static_cast<double>(h.max);
+            double quantiles[4] = { 0.5, 0.9, 0.99, 0.999 };
+            const char * names[4] = { "p50", "p90", "p99", "p999" };
+            stage->Set(String::NewSymbol("mean"), Number::New(static_cast<double>(h.sum) / static_cast<double>(count) / 1e6));
+            stage->Set(String::NewSymbol("min"), Number::New(min / 1e6));
+            stage->Set(String::NewSymbol("max"), Number::New(max / 1e6));
+            for (unsigned q = 0; q < 4; ++q) {
+                double value = percentile(buckets, count, quantiles[q]);
+                value = value < min ? min : value > max ? max : value;
+                stage->Set(String::NewSymbol(names[q]), Number::New(value / 1e6));
+            }
+        }
+        result->Set(String::New(m->stages_[s].c_str()), stage);
+    }
+    NanReturnValue(result);
+}
+
+// Counts recorded while a reset runs may be lost.
+NAN_METHOD(Metrics::reset)
+{
+    NanScope();
+    Metrics* m = node::ObjectWrap::Unwrap<Metrics>(args.This());
+    for (std::size_t s = 0; s < m->histograms_.size(); ++s) {
+        clear_histogram(m->histograms_[s]);
+    }
+    NanReturnValue(Undefined());
+}
+
+NAN_METHOD(Metrics::New)
+{
+    NanScope();
+    if (!args.IsConstructCall()) {
+        return NanThrowTypeError("Cannot call constructor as function, you need to use 'new' keyword");
+    }
+    try {
+        if (args.Length() < 1 || !args[0]->IsArray()) {
+            return NanThrowTypeError("expected an Array of stage names");
+        }
+        Local<Array> names = Local<Array>::Cast(args[0]);
+        std::vector<std::string> stages;
+        for (unsigned i = 0; i < names->Length(); ++i) {
+            stages.push_back(*String::Utf8Value(names->Get(i)->ToString()));
+        }
+        Metrics* m = new Metrics(stages);
+        m->Wrap(args.This());
+        NanReturnValue(args.This());
+    } catch (std::exception const& ex) {
+        return NanThrowTypeError(ex.what());
+    }
+    NanReturnValue(Undefined());
+}
+
+} // namespace binding
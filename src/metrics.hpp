@@ -0,0 +1,59 @@
+#ifndef __CARMEN_METRICS_HPP__
+#define __CARMEN_METRICS_HPP__
+
+// v8
+#include <v8.h>
+
+// node
+#include <node.h>
+#include <node_object_wrap.h>
+
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wconversion"
+#pragma clang diagnostic ignored "-Wshadow"
+#pragma clang diagnostic ignored "-Wsign-compare"
+#include <nan.h>
+#include <string>
+#include <vector>
+#pragma clang diagnostic pop
+
+namespace binding {
+
+// Latency histograms, one per named stage. Recording is lock-free so it
+// can be done from the main thread and from worker threads at once, see
+// Cache::_settle.
+//
+// Buckets are log-linear over nanoseconds: values below 8 have a bucket
+// each, above that every power of two is split into 8 buckets, so
+// percentiles are within 1/16 of the recorded values.
+class Metrics: public node::ObjectWrap {
+    ~Metrics();
+public:
+    static const unsigned sub_bits = 3;
+    static const unsigned sub_count = 1 << sub_bits;
+    static const unsigned bucket_count = (64 - sub_bits + 1) * sub_count;
+    struct histogram {
+        uint64_t buckets[bucket_count];
+        uint64_t sum;
+        uint64_t min;
+        uint64_t max;
+    };
+    static v8::Persistent<v8::FunctionTemplate> constructor;
+    static void Initialize(v8::Handle<v8::Object> target);
+    static NAN_METHOD(New);
+    static NAN_METHOD(record);
+    static NAN_METHOD(stats);
+    static NAN_METHOD(reset);
+    static unsigned bucket(uint64_t ns);
+    static uint64_t bucket_value(unsigned bucket);
+    Metrics(std::vector<std::string> const& stages);
+    void _ref() { Ref(); }
+    void _unref() { Unref(); }
+    void add(unsigned stage, uint64_t ns);
+    std::vector<std::string> stages_;
+    std::vector<histogram> histograms_;
+};
+
+}
+
+#endif // __CARMEN_METRICS_HPP__
@@ -12,6 +12,7 @@
 #include <stdexcept>
 #include <string>
 #include <cstring>
+#include <cstdio>
 #include <cassert>
 
 #undef LIKELY
@@ -190,17 +191,20 @@ void message::skipValue(uint64_t val)
             break;
         default:
             char msg[80];
-            snprintf(msg, 80, "cannot skip unknown type %lld", val & 0x7);
+            snprintf(msg, 80, "cannot skip unknown type %llu", static_cast<unsigned long long>(val & 0x7));
             throw std::runtime_error(msg);
     }
 }
 
+// Lengths come from the buffer, so they are checked against the bytes left
+// before moving: advancing past `end_` is undefined and a large enough
+// length would wrap the pointer around.
 void message::skipBytes(uint64_t bytes)
 {
-    data_ += bytes;
-    if (data_ > end_) {
+    if (bytes > static_cast<uint64_t>(end_ - data_)) {
         throw std::runtime_error("unexpected end of buffer");
     }
+    data_ += bytes;
 }
 
 message::value_type message::getData()
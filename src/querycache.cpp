@@ -0,0 +1,241 @@
+#include "querycache.hpp"
+
+namespace binding {
+
+using namespace v8;
+
+Persistent<FunctionTemplate> QueryCache::constructor;
+
+// Approximate per-entry bookkeeping cost (list node, map node, strings).
+static const std::size_t entry_overhead = 128;
+
+void QueryCache::Initialize(Handle<Object> target) {
+    NanScope();
+    Local<FunctionTemplate> t = FunctionTemplate::New(QueryCache::New);
+    t->InstanceTemplate()->SetInternalFieldCount(1);
+    t->SetClassName(String::NewSymbol("QueryCache"));
+    NODE_SET_PROTOTYPE_METHOD(t, "get", get);
+    NODE_SET_PROTOTYPE_METHOD(t, "set", set);
+    NODE_SET_PROTOTYPE_METHOD(t, "clear", clear);
+    NODE_SET_PROTOTYPE_METHOD(t, "stats", stats);
+    target->Set(String::NewSymbol("QueryCache"),t->GetFunction());
+    NanAssignPersistent(FunctionTemplate, constructor, t);
+}
+
+QueryCache::QueryCache(std::size_t maxsize, unsigned shards)
+  : ObjectWrap(),
+    maxsize_(maxsize / shards),
+    shards_() {
+    shards_.reserve(shards);
+    for (unsigned i = 0; i < shards; ++i) {
+        shard * s = new shard();
+        uv_mutex_init(&s->mutex);
+        s->size = 0;
+        s->hits = 0;
+        s->misses = 0;
+        s->evictions = 0;
+        shards_.push_back(s);
+    }
+}
+
+QueryCache::~QueryCache() {
+    for (std::size_t i = 0; i < shards_.size(); ++i) {
+        uv_mutex_destroy(&shards_[i]->mutex);
+        delete shards_[i];
+    }
+}
+
+QueryCache::shard & QueryCache::shard_for(std::string const& key) {
+    // fnv1a
+    uint32_t hash = 2166136261u;
+    for (std::size_t i = 0; i < key.size(); ++i) {
+        hash ^= static_cast<unsigned char>(key[i]);
+        hash *= 16777619u;
+    }
+    return *shards_[hash % shards_.size()];
+}
+
+bool QueryCache::lookup(std::string const& key, uint64_t generation, std::string & value) {
+    shard & s = shard_for(key);
+    uv_mutex_lock(&s.mutex);
+    lruindex::iterator itr = s.index.find(key);
+    bool hit = false;
+    if (itr != s.index.end()) {
+        if (itr->second->generation == generation) {
+            s.lru.splice(s.lru.begin(), s.lru, itr->second);
+            value = itr->second->value;
+            hit = true;
+        } else {
+            // computed against an older index, never valid again
+            s.size -= itr->second->key.size() + itr->second->value.size() + entry_overhead;
+            s.lru.erase(itr->second);
+            s.index.erase(itr);
+        }
+    }
+    if (hit) {
+        ++s.hits;
+    } else {
+        ++s.misses;
+    }
+    uv_mutex_unlock(&s.mutex);
+    return hit;
+}
+
+void QueryCache::insert(std::string const& key, std::string const& value, uint64_t generation) {
+    std::size_t size = key.size() + value.size() + entry_overhead;
+    if (size > maxsize_) return;
+    shard & s = shard_for(key);
+    uv_mutex_lock(&s.mutex);
+    lruindex::iterator itr = s.index.find(key);
+    if (itr != s.index.end()) {
+        s.size -= itr->second->key.size() + itr->second->value.size() + entry_overhead;
+        s.lru.erase(itr->second);
+        s.index.erase(itr);
+    }
+    while (!s.lru.empty() && s.size + size > maxsize_) {
+        entry const& last = s.lru.back();
+        s.size -= last.key.size() + last.value.size() + entry_overhead;
+        s.index.erase(last.key);
+        s.lru.pop_back();
+        ++s.evictions;
+    }
+    entry e;
+    e.key = key;
+    e.value = value;
+    e.generation = generation;
+    s.lru.push_front(e);
+    s.index.insert(std::make_pair(key, s.lru.begin()));
+    s.size += size;
+    uv_mutex_unlock(&s.mutex);
+}
+
+void QueryCache::flush() {
+    for (std::size_t i = 0; i < shards_.size(); ++i) {
+        shard & s = *shards_[i];
+        uv_mutex_lock(&s.mutex);
+        s.lru.clear();
+        s.index.clear();
+        s.size = 0;
+        uv_mutex_unlock(&s.mutex);
+    }
+}
+
+NAN_METHOD(QueryCache::get)
+{
+    NanScope();
+    if (args.Length() < 2) {
+        return NanThrowTypeError("expected two args: 'key' and 'generation'");
+    }
+    if (!args[0]->IsString()) {
+        return NanThrowTypeError("first arg must be a String");
+    }
+    if (!args[1]->IsNumber()) {
+        return NanThrowTypeError("second arg must be an Integer");
+    }
+    try {
+        std::string key = *String::Utf8Value(args[0]->ToString());
+        uint64_t generation = static_cast<uint64_t>(args[1]->IntegerValue());
+        QueryCache* qc = node::ObjectWrap::Unwrap<QueryCache>(args.This());
+        std::string value;
+        if (!qc->lookup(key, generation, value)) {
+            NanReturnValue(Undefined());
+        }
+        NanReturnValue(String::New(value.data(), static_cast<int>(value.size())));
+    } catch (std::exception const& ex) {
+        return NanThrowTypeError(ex.what());
+    }
+}
+
+NAN_METHOD(QueryCache::set)
+{
+    NanScope();
+    if (args.Length() < 3) {
+        return NanThrowTypeError("expected three args: 'key', 'value' and 'generation'");
+    }
+    if (!args[0]->IsString()) {
+        return NanThrowTypeError("first arg must be a String");
+    }
+    if (!args[1]->IsString()) {
+        return NanThrowTypeError("second arg must be a String");
+    }
+    if (!args[2]->IsNumber()) {
+        return NanThrowTypeError("third arg must be an Integer");
+    }
+    try {
+        std::string key = *String::Utf8Value(args[0]->ToString());
+        String::Utf8Value value(args[1]);
+        uint64_t generation = static_cast<uint64_t>(args[2]->IntegerValue());
+        QueryCache* qc = node::ObjectWrap::Unwrap<QueryCache>(args.This());
+        qc->insert(key, std::string(*value, static_cast<std::size_t>(value.length())), generation);
+    } catch (std::exception const& ex) {
+        return NanThrowTypeError(ex.what());
+    }
+    NanReturnValue(Undefined());
+}
+
+NAN_METHOD(QueryCache::clear)
+{
+    NanScope();
+    QueryCache* qc = node::ObjectWrap::Unwrap<QueryCache>(args.This());
+    qc->flush();
+    NanReturnValue(Undefined());
+}
+
+NAN_METHOD(QueryCache::stats)
+{
+    NanScope();
+    QueryCache* qc = node::ObjectWrap::Unwrap<QueryCache>(args.This());
+    double hits = 0, misses = 0, evictions = 0, size = 0, count = 0;
+    for (std::size_t i = 0; i < qc->shards_.size(); ++i) {
+        QueryCache::shard & s = *qc->shards_[i];
+        uv_mutex_lock(&s.mutex);
+        hits += s.hits;
+        misses += s.misses;
+        evictions += s.evictions;
+        size += s.size;
+        count += s.index.size();
+        uv_mutex_unlock(&s.mutex);
+    }
+    Local<Object> stats = Object::New();
+    stats->Set(String::NewSymbol("hits"), Number::New(hits));
+    stats->Set(String::NewSymbol("misses"), Number::New(misses));
+    stats->Set(String::NewSymbol("ratio"), Number::New(hits + misses > 0 ? hits / (hits + misses) : 0));
+    stats->Set(String::NewSymbol("evictions"), Number::New(evictions));
+    stats->Set(String::NewSymbol("size"), Number::New(size));
+    stats->Set(String::NewSymbol("count"), Number::New(count));
+    NanReturnValue(stats);
+}
+
+NAN_METHOD(QueryCache::New)
+{
+    NanScope();
+    if (!args.IsConstructCall()) {
+        return NanThrowTypeError("Cannot call constructor as function, you need to use 'new' keyword");
+    }
+    try {
+        if (args.Length() < 1) {
+            return NanThrowTypeError("expected 'maxsize' and optional 'shards' arguments");
+        }
+        if (!args[0]->IsNumber()) {
+            return NanThrowTypeError("first argument 'maxsize' must be a number");
+        }
+        if (args.Length() > 1 && !args[1]->IsNumber()) {
+            return NanThrowTypeError("second argument 'shards' must be a number");
+        }
+        std::size_t maxsize = static_cast<std::size_t>(args[0]->IntegerValue());
+        unsigned shards = args.Length() > 1 ? static_cast<unsigned>(args[1]->IntegerValue()) : 16;
+        if (shards == 0) {
+            return NanThrowTypeError("'shards' must be at least 1");
+        }
+        QueryCache* qc = new QueryCache(maxsize, shards);
+        qc->Wrap(args.This());
+        args.This()->Set(String::NewSymbol("maxsize"),Number::New(static_cast<double>(maxsize)));
+        args.This()->Set(String::NewSymbol("shards"),Number::New(shards));
+        NanReturnValue(args.This());
+    } catch (std::exception const& ex) {
+        return NanThrowTypeError(ex.what());
+    }
+    NanReturnValue(Undefined());
+}
+
+} // namespace binding
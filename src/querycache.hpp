@@ -0,0 +1,65 @@
+#ifndef __CARMEN_QUERYCACHE_HPP__
+#define __CARMEN_QUERYCACHE_HPP__
+
+// v8
+#include <v8.h>
+
+// node
+#include <node.h>
+#include <node_object_wrap.h>
+
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wconversion"
+#pragma clang diagnostic ignored "-Wshadow"
+#pragma clang diagnostic ignored "-Wsign-compare"
+#include <nan.h>
+#include <string>
+#include <list>
+#include <map>
+#include <vector>
+#pragma clang diagnostic pop
+
+namespace binding {
+
+// Size-bounded LRU cache of serialized geocode results. Entries are
+// spread across independently locked shards and tagged with the index
+// generation they were computed against so index writes invalidate them.
+class QueryCache: public node::ObjectWrap {
+    ~QueryCache();
+public:
+    struct entry {
+        std::string key;
+        std::string value;
+        uint64_t generation;
+    };
+    typedef std::list<entry> lrulist;
+    typedef std::map<std::string,lrulist::iterator> lruindex;
+    struct shard {
+        uv_mutex_t mutex;
+        // most recently used first
+        lrulist lru;
+        lruindex index;
+        std::size_t size;
+        uint64_t hits;
+        uint64_t misses;
+        uint64_t evictions;
+    };
+    static v8::Persistent<v8::FunctionTemplate> constructor;
+    static void Initialize(v8::Handle<v8::Object> target);
+    static NAN_METHOD(New);
+    static NAN_METHOD(get);
+    static NAN_METHOD(set);
+    static NAN_METHOD(clear);
+    static NAN_METHOD(stats);
+    QueryCache(std::size_t maxsize, unsigned shards);
+    shard & shard_for(std::string const& key);
+    bool lookup(std::string const& key, uint64_t generation, std::string & value);
+    void insert(std::string const& key, std::string const& value, uint64_t generation);
+    void flush();
+    std::size_t maxsize_;
+    std::vector<shard*> shards_;
+};
+
+}
+
+#endif // __CARMEN_QUERYCACHE_HPP__
@@ -0,0 +1,109 @@
+#include "shard.hpp"
+#include "pbf.hpp"
+
+#include <sstream>
+#include <stdexcept>
+
+namespace binding {
+
+void load_into_cache(larraycache & larrc,
+                            const char * data,
+                            size_t size) {
+    protobuf::message message(data,size);
+    while (message.next()) {
+        if (message.tag == 1) {
+            uint64_t len = message.varint();
+            // skip first so that `len` is known to be within the buffer
+            const char * begin = message.getData();
+            message.skipBytes(len);
+            protobuf::message item(begin, static_cast<std::size_t>(len));
+            while (item.next()) {
+                if (item.tag == 1) {
+                    uint64_t key_id = item.varint();
+                    // NOTE: emplace is faster with libcxx if using std::string
+                    // if using boost::string_ref, std::move is faster
+#ifdef USE_CXX11
+                    larrc.insert(std::make_pair(key_id,std::move(string_ref_type(begin,len))));
+#else
+                    larrc.insert(std::make_pair(key_id,string_ref_type(begin,len)));
+#endif
+                }
+                // it is safe to break immediately because tag 1 should come first
+                break;
+            }
+        } else {
+            std::stringstream msg("");
+            msg << "load: hit unknown protobuf type: '" << message.tag << "'";
+            throw std::runtime_error(msg.str());
+        }
+    }
+}
+
+static inline void append(intarray & array, uint64_t value) {
+#ifdef USE_CXX11
+    array.emplace_back(value);
+#else
+    array.push_back(value);
+#endif
+}
+
+static inline void append(::google::protobuf::RepeatedField< ::google::protobuf::int64> & array, uint64_t value) {
+    array.Add(static_cast<int64_t>(value));
+}
+
+// Append the packed values (tag 2) of a raw item to `array`.
+template <typename T>
+static void decode_item(string_ref_type const& ref, T & array, const char * caller) {
+    protobuf::message item(ref.data(), ref.size());
+    while (item.next()) {
+        if (item.tag == 1) {
+            item.skip();
+        } else if (item.tag == 2) {
+            uint64_t len = item.varint();
+            const char * begin = item.getData();
+            item.skipBytes(len);
+            protobuf::message pbfarray(begin,static_cast<std::size_t>(len));
+            while (pbfarray.next()) {
+                append(array, pbfarray.value);
+            }
+        } else {
+            std::stringstream msg("");
+            msg << caller << ": hit unknown protobuf type: '" << item.tag << "'";
+            throw std::runtime_error(msg.str());
+        }
+    }
+}
+
+void decode_array(string_ref_type const& ref, intarray & array) {
+    // NOTE: we cannot call array.reserve here since
+    // the total length is not known
+    decode_item(ref, array, "cxx get");
+}
+
+void pack_arrays(arraycache const& arrc, carmen::proto::object & message) {
+    arraycache::const_iterator aitr = arrc.begin();
+    arraycache::const_iterator aend = arrc.end();
+    while (aitr != aend) {
+        ::carmen::proto::object_item * new_item = message.add_items();
+        new_item->set_key(aitr->first);
+        intarray const & varr = aitr->second;
+        std::size_t varr_size = varr.size();
+        for (std::size_t i=0;i<varr_size;++i) {
+            new_item->add_val(static_cast<int64_t>(varr[i]));
+        }
+        ++aitr;
+    }
+}
+
+void pack_arrays(larraycache const& larrc, carmen::proto::object & message) {
+    larraycache::const_iterator laitr = larrc.begin();
+    larraycache::const_iterator laend = larrc.end();
+    while (laitr != laend) {
+        ::carmen::proto::object_item * new_item = message.add_items();
+        new_item->set_key(static_cast<int64_t>(laitr->first));
+        decode_item(laitr->second, *new_item->mutable_val(), "pack");
+        ++laitr;
+    }
+}
+
+}
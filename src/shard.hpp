@@ -0,0 +1,43 @@
+#ifndef __CARMEN_SHARD_HPP__
+#define __CARMEN_SHARD_HPP__
+
+// Decoding and encoding of index shards. Nothing here depends on node or
+// v8 so it can be built on its own, see bench/cxx.
+
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wconversion"
+#pragma clang diagnostic ignored "-Wshadow"
+#pragma clang diagnostic ignored "-Wsign-compare"
+#include <stdint.h>
+#include <cstddef>
+#include <map>
+#include <string>
+#include <vector>
+#include "index.pb.h"
+#pragma clang diagnostic pop
+
+namespace binding {
+
+typedef uint64_t int_type;
+// raw protobuf item of a lazily loaded shard, keyed by id
+typedef std::string string_ref_type;
+typedef std::map<int_type,string_ref_type> larraycache;
+// decoded arrays of a shard, keyed by id
+typedef std::vector<int_type> intarray;
+typedef std::map<uint32_t,intarray> arraycache;
+
+// Index the items of a protobuf shard buffer by id, keeping each item
+// raw. Throws on malformed buffers, in which case `larrc` may hold the
+// items read so far.
+void load_into_cache(larraycache & larrc, const char * data, std::size_t size);
+
+// Append the values of a raw item to `array`.
+void decode_array(string_ref_type const& ref, intarray & array);
+
+// Add the arrays of a shard to `message` as items.
+void pack_arrays(arraycache const& arrc, carmen::proto::object & message);
+void pack_arrays(larraycache const& larrc, carmen::proto::object & message);
+
+}
+
+#endif // __CARMEN_SHARD_HPP__
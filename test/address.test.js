@@ -1,5 +1,6 @@
 var assert = require('assert');
-var address = require('../lib/pure/applyaddress.js');
+var address = require('../lib/util/applyaddress.js');
+var Cache = require('../lib/util/cxxcache');
 
 describe('address interpolation (tiger)', function() {
     it('noop', function() {
@@ -138,4 +139,97 @@ describe('address interpolation (tiger)', function() {
             }
         }, 100).coordinates);
     });
+    it('reverse, multiple segments', function() {
+        assert.deepEqual({
+            type: 'Point',
+            coordinates: [0,25]
+        }, address({
+            _rangetype:'tiger',
+            _lfromhn: '100',
+            _ltohn: '0',
+            _geometry: {
+                type:'LineString',
+                coordinates:[[0,0],[0,50],[50,50]]
+            }
+        }, 75));
+    });
+    it('cached', function() {
+        var cache = new Cache('a', 0);
+        var feat = {
+            _rangetype:'tiger',
+            _lfromhn: '0',
+            _ltohn: '100',
+            _geometry: {
+                type:'LineString',
+                coordinates:[[0,0],[0,100]]
+            }
+        };
+        assert.deepEqual([0,9], address(feat, 9, cache, 1).coordinates);
+        assert.equal(true, cache.hasAddress(0, 1));
+        // prepared data is reused rather than rebuilt from the feature.
+        feat._geometry.coordinates = [[0,0],[0,200]];
+        assert.deepEqual([0,20], address(feat, 20, cache, 1).coordinates);
+        // unloading the feature shard drops prepared address data.
+        cache.unload('feature', 0);
+        assert.equal(false, cache.hasAddress(0, 1));
+        assert.deepEqual([0,40], address(feat, 20, cache, 1).coordinates);
+    });
+    // lib/pure/applyaddress.js gave NaN coordinates here.
+    it('range of a single number', function() {
+        assert.deepEqual({
+            type:'Point',
+            coordinates:[0,0]
+        }, address({
+            _rangetype:'tiger',
+            _lfromhn: '10',
+            _ltohn: '10',
+            _geometry: {
+                type:'LineString',
+                coordinates:[[0,0],[0,100]]
+            }
+        }, 10));
+    });
+    // lib/pure/applyaddress.js threw on lines of a single point.
+    it('single point lines', function() {
+        assert.deepEqual(undefined, address({
+            _rangetype:'tiger',
+            _lfromhn: '0',
+            _ltohn: '100',
+            _geometry: {
+                type:'LineString',
+                coordinates:[[0,0]]
+            }
+        }, 10));
+        assert.deepEqual([0,50], address({
+            _rangetype:'tiger',
+            _lfromhn: ['0','0'],
+            _ltohn: ['100','100'],
+            _geometry: {
+                type:'MultiLineString',
+                coordinates:[
+                    [[5,5]],
+                    [[0,40],[0,140]]
+                ]
+            }
+        }, 10).coordinates);
+    });
+    it('lib/pure/applyaddress.js', function() {
+        var pure = require('../lib/pure/applyaddress.js');
+        assert.deepEqual({
+            type:'Point',
+            coordinates:[0,9]
+        }, pure({
+            _rangetype:'tiger',
+            _lfromhn: '0',
+            _ltohn: '100',
+            _geometry: {
+                type:'LineString',
+                coordinates:[[0,0],[0,100]]
+            }
+        }, 9));
+        assert.equal(5, pure.parseSemiNumber('5a'));
+        var coords = [[0,0],[0,3],[4,3]];
+        assert.equal(7, pure.calculateDistance(coords));
+        assert.deepEqual([[0,0,0],[0,3,3],[4,3,7]], coords);
+    });
 });
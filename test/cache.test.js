@@ -88,6 +88,29 @@ describe('Cache', function() {
                 assert.throws(function() { loader.pack('term', 99999999999999) });
             });
 
+            it('#shardlevel', function() {
+                var cache = new Cache('a', 0);
+                cache.shardlevel = 1;
+                assert.equal(1, cache.shardlevel);
+                cache.set('term', Cache.mp[29], [0,1,2]);
+                assert.deepEqual([2], cache.list('term'));
+                assert.throws(function() { cache.shardlevel = 'one'; });
+            });
+
+            it('unknown types', function() {
+                var cache = new Cache('a', 1);
+                assert.equal(false, cache.has('unseen', 0));
+                assert.deepEqual([], cache.list('unseen'));
+                assert.deepEqual([], cache.list('unseen', 0));
+                assert.equal(undefined, cache.get('unseen', 5));
+                assert.equal(false, cache.unload('unseen', 0));
+                assert.throws(function() { cache.pack('unseen', 0); });
+
+                cache.set('unseen', 5, [1]);
+                assert.deepEqual([1], cache.get('unseen', 5));
+                assert.deepEqual([0], cache.list('unseen'));
+            });
+
             it('#load', function() {
                 var cache = new Cache('a', 1);
                 assert.equal('a', cache.id);
@@ -155,6 +178,32 @@ describe('Cache', function() {
                 });
             });
 
+            it('#loadFeatures', function() {
+                var cache = new Cache('a', 1);
+                var segment = cache.packFeatures({ 5: '{"a":1}', 21: '{"b":2}' });
+                assert.equal(9 + 2*12 + 14, segment.length);
+                cache.loadFeatures(segment, 0);
+                assert.equal(true, cache.has('feature', 0));
+                assert.deepEqual(['5', '21'], cache.list('feature', 0));
+                assert.equal('{"a":1}', cache._getFeature(0, 5));
+                assert.equal('{"b":2}', cache._getFeature(0, 21));
+                assert.equal(undefined, cache._getFeature(0, 9));
+                assert.equal(undefined, cache._getFeature(1, 5));
+
+                // appended segments win over earlier ones.
+                var appended = Buffer.concat([segment, cache.packFeatures({ 5: '{"a":3}' })]);
+                var loader = new Cache('b', 1);
+                loader.loadFeatures(appended, 0);
+                assert.equal('{"a":3}', loader._getFeature(0, 5));
+                assert.equal('{"b":2}', loader._getFeature(0, 21));
+
+                // truncated buffers throw and leave loaded features alone.
+                assert.throws(function() { loader.loadFeatures(segment.slice(0, 20), 0) });
+                assert.equal('{"a":3}', loader._getFeature(0, 5));
+                assert.equal(true, loader.unload('feature', 0));
+                assert.equal(undefined, loader._getFeature(0, 5));
+            });
+
             it('#unload on empty data', function() {
                 var cache = new Cache('a', 1);
                 assert.equal(false,cache.unload('term',5));
@@ -209,6 +258,170 @@ describe('Cache', function() {
                 assert.deepEqual([], loader.list('term'), 'no shards');
             });
 
+            it('#snapshot', function() {
+                var cache = new Cache('a', 1);
+                cache.zoom = 6;
+                cache.set('term', 5, [0,1,2]);
+
+                var snap = cache.snapshot();
+                assert.equal('a', snap.id);
+                assert.equal(1, snap.shardlevel);
+                assert.equal(6, snap.zoom);
+                assert.deepEqual([0,1,2], snap.get('term', 5));
+
+                // writes to the cache copy the captured version.
+                cache.set('term', 5, [3]);
+                cache.set('term', 21, [7]);
+                assert.deepEqual([3], cache.get('term', 5));
+                assert.deepEqual([0,1,2], snap.get('term', 5));
+                assert.equal(undefined, snap.get('term', 21));
+
+                // reloads and unloads leave the captured version in place.
+                var other = new Cache('b', 1);
+                other.set('term', 5, [8]);
+                cache.loadSync(other.pack('term', 0), 'term', 0);
+                assert.deepEqual([8], cache.get('term', 5));
+                assert.deepEqual([0,1,2], snap.get('term', 5));
+                assert.deepEqual([5], snap.list('term', 0));
+                cache.unload('term', 0);
+                assert.equal(false, cache.has('term', 0));
+                assert.equal(true, snap.has('term', 0));
+
+                // shards loaded after the snapshot are read once loaded.
+                cache.set('term', Cache.mp[28] * 2, [9]);
+                assert.deepEqual([0, 2], snap.list('term'));
+                assert.deepEqual([9], snap.get('term', Cache.mp[28] * 2));
+
+                // writes through the snapshot apply to the cache.
+                snap.set('term', Cache.mp[28] * 3, [4]);
+                assert.deepEqual([4], cache.get('term', Cache.mp[28] * 3));
+
+                cache.loadFeatures(cache.packFeatures({ 1: '{"a":1}' }), 0);
+                assert.equal('{"a":1}', snap._getFeature(0, 1));
+                cache.loadFeatures(cache.packFeatures({ 1: '{"a":2}' }), 0);
+                assert.equal('{"a":2}', cache._getFeature(0, 1));
+                assert.equal('{"a":1}', snap._getFeature(0, 1));
+            });
+
+            it('#snapshot holds every loaded shard', function() {
+                var cache = new Cache('a', 1);
+                var old = new Cache('b', 1);
+                var current = new Cache('c', 1);
+                for (var shard = 0; shard < 4; shard++) {
+                    old.set('term', Cache.mp[28] * shard, [shard]);
+                    current.set('term', Cache.mp[28] * shard, [shard + 10]);
+                    cache.loadSync(old.pack('term', shard), 'term', shard);
+                }
+
+                // none of the shards are read before they are reloaded.
+                var snap = cache.snapshot();
+                for (shard = 0; shard < 4; shard++) {
+                    cache.loadSync(current.pack('term', shard), 'term', shard);
+                }
+                cache.unload('term', 3);
+                for (shard = 0; shard < 4; shard++) {
+                    assert.deepEqual([shard], snap.get('term', Cache.mp[28] * shard), 'shard ' + shard);
+                    if (shard < 3) assert.deepEqual([shard + 10], cache.get('term', Cache.mp[28] * shard));
+                }
+                assert.deepEqual([0, 1, 2, 3], snap.list('term'));
+                assert.deepEqual([0, 1, 2], cache.list('term'));
+                assert.deepEqual([0, 1, 2], cache.snapshot().list('term'));
+            });
+
+            it('#snapshot (async load)', function(done) {
+                var cache = new Cache('a', 1);
+                cache.set('term', 5, [0,1,2]);
+                var snap = cache.snapshot();
+                assert.deepEqual([0,1,2], snap.get('term', 5));
+                var other = new Cache('b', 1);
+                other.set('term', 5, [8]);
+                cache.load(other.pack('term', 0), 'term', 0, function(err) {
+                    assert.ifError(err);
+                    assert.deepEqual([8], cache.get('term', 5));
+                    assert.deepEqual([0,1,2], snap.get('term', 5));
+                    assert.deepEqual([8], cache.snapshot().get('term', 5));
+                    done();
+                });
+            });
+
+            it('#snapshot release', function() {
+                var cache = new Cache('a', 1);
+                cache.set('term', 5, [0,1,2]);
+                var count = Cache._snapshots();
+                var snap = cache.snapshot();
+                assert.equal(count + 1, Cache._snapshots());
+                cache.set('term', 5, [3]);
+                assert.deepEqual([0,1,2], snap.get('term', 5));
+
+                // a released snapshot holds no shards.
+                snap.release();
+                assert.equal(count, Cache._snapshots());
+                assert.equal(false, snap.has('term', 0));
+                assert.deepEqual([], snap.list('term'));
+                assert.deepEqual([3], cache.get('term', 5));
+                snap.release();
+                assert.equal(count, Cache._snapshots());
+
+                // releasing the cache itself is a no-op.
+                cache.release();
+                assert.deepEqual([3], cache.get('term', 5));
+            });
+
+            it('#handle', function() {
+                var cache = new Cache('a', 1);
+                var term = cache.handle('term');
+                assert.equal('term', term.type);
+                assert.strictEqual(term, cache.handle('term'));
+
+                // handles and the cache share shards.
+                term.set(5, [0,1,2]);
+                cache.set('term', Cache.mp[28] * 10 + 1, [3]);
+                assert.deepEqual([0,1,2], cache.get('term', 5));
+                assert.deepEqual([3], term.get(Cache.mp[28] * 10 + 1));
+                assert.deepEqual([0,1,2], term._get(0, 5));
+                assert.equal(undefined, term.get(6));
+                assert.equal(true, term.has(0));
+                assert.equal(false, term.has(1));
+                assert.deepEqual([0, 10], term.list());
+                assert.deepEqual(['5'], term.list(0));
+
+                // types are kept apart, including ones sharing a prefix.
+                cache.set('terms', 5, [4]);
+                assert.deepEqual([0], cache.list('terms'));
+                assert.deepEqual([0, 10], cache.list('term'));
+                assert.deepEqual([0,1,2], term.get(5));
+
+                var other = new Cache('b', 1).handle('term');
+                other.loadSync(term.pack(0), 3);
+                assert.deepEqual([0,1,2], other._get(3, 5));
+
+                assert.equal(true, term.unload(10));
+                assert.equal(false, cache.has('term', 10));
+                assert.deepEqual([0], term.list());
+
+                // a handle of a snapshot reads the snapshot.
+                var snap = cache.snapshot().handle('term');
+                assert.notStrictEqual(term, snap);
+                assert.deepEqual([0,1,2], snap.get(5));
+                term.set(5, [6]);
+                assert.deepEqual([0,1,2], snap.get(5));
+                assert.deepEqual([6], term.get(5));
+            });
+
+            it('#handle follows shardlevel', function() {
+                var cache = new Cache('a', 0);
+                var term = cache.handle('term');
+                var snap = cache.snapshot();
+                cache.shardlevel = 1;
+                assert.equal(1, snap.shardlevel);
+
+                term.set(Cache.mp[28] * 3 + 1, [0,1,2]);
+                assert.deepEqual([3], cache.list('term'));
+                assert.deepEqual([0,1,2], cache.get('term', Cache.mp[28] * 3 + 1));
+                cache.set('term', Cache.mp[28] * 7, [3]);
+                assert.deepEqual([3], term.get(Cache.mp[28] * 7));
+            });
+
         });
     });
 
@@ -317,4 +530,87 @@ describe('Cache', function() {
             });
         });
     });
+
+    describe('#getall (concurrent)', function() {
+        var Memsource = require('../lib/api-mem');
+        var mem = new Memsource({}, function() {});
+        var docs = require('./fixtures/docs.json');
+        var index = require('../lib/index');
+
+        mem._geocoder = new Cache('a', 1);
+
+        before(function(done) {
+            index.update(mem, docs, function(err) {
+                if (err) return done(err);
+                index.store(mem, done);
+            });
+        });
+
+        it('shares fetches for the same shard', function(done) {
+            var cache = new Cache('a', 1);
+            var fetches = 0;
+            var active = 0;
+            var maxActive = 0;
+            function getter(type, shard, callback) {
+                fetches++;
+                active++;
+                maxActive = Math.max(active, maxActive);
+                setTimeout(function() {
+                    active--;
+                    mem.getGeocoderData(type, shard, callback);
+                }, 10);
+            }
+            var ids = [
+                238637120, // shard0
+                474088544, // shard1
+                546393072, // shard2
+            ];
+            var concurrency = Cache.concurrency;
+            Cache.concurrency = 2;
+            var remaining = 3;
+            for (var i = 0; i < 3; i++) cache.getall(getter, 'term', ids, function(err, result) {
+                assert.ifError(err);
+                result.sort();
+                assert.deepEqual([238233187,474088545,546393074], result);
+                if (--remaining) return;
+                Cache.concurrency = concurrency;
+                // one fetch per shard, no more than 2 at once.
+                assert.equal(3, fetches);
+                assert.equal(2, maxActive);
+                done();
+            });
+        });
+
+        it('passes errors to all waiters', function(done) {
+            var cache = new Cache('a', 1);
+            var remaining = 2;
+            function getter(type, shard, callback) {
+                setTimeout(function() { callback(new Error('fetch failed')); }, 10);
+            }
+            for (var i = 0; i < 2; i++) cache.getall(getter, 'term', [238637120], function(err) {
+                assert.equal('fetch failed', err.message);
+                assert.equal(false, cache.has('term', 0));
+                if (!--remaining) done();
+            });
+        });
+
+        it('does not publish over a newer load', function(done) {
+            var cache = new Cache('a', 1);
+            var newer = new Cache('b', 1);
+            newer.set('term', 238637120, [1]);
+            function getter(type, shard, callback) {
+                // the shard is reloaded while the fetch is in flight.
+                cache.loadSync(newer.pack('term', shard), 'term', shard);
+                setTimeout(function() {
+                    mem.getGeocoderData(type, shard, callback);
+                }, 10);
+            }
+            cache.getall(getter, 'term', [238637120], function(err, result) {
+                assert.ifError(err);
+                assert.deepEqual([1], result);
+                assert.deepEqual([1], cache.get('term', 238637120));
+                done();
+            });
+        });
+    });
 });
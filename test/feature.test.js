@@ -0,0 +1,177 @@
+var assert = require('assert');
+var Cache = require('../lib/util/cxxcache');
+var Memsource = require('../lib/api-mem');
+var feature = require('../lib/util/feature');
+
+describe('feature', function() {
+    function source() {
+        var mem = new Memsource({}, function() {});
+        mem._geocoder = new Cache('a', 0);
+        return mem;
+    }
+
+    it('putFeatures + getFeature', function(done) {
+        var mem = source();
+        var docs = [
+            { _id: 1, _hash: 1, _text: 'a', _grid: [1] },
+            { _id: 65, _hash: 65, _text: 'b' }
+        ];
+        feature.putFeatures(mem, docs, function(err) {
+            assert.ifError(err);
+            // features are stored as binary segments.
+            assert.ok(Buffer.isBuffer(mem._shards.feature[0]));
+            assert.equal(1, mem._shards.feature[0][0]);
+            feature.getFeature(mem, 65, function(err, data) {
+                assert.ifError(err);
+                assert.deepEqual({ 65: { _id: 65, _text: 'b' } }, data);
+                feature.getFeature(mem, 2, function(err, data) {
+                    assert.ifError(err);
+                    assert.equal(undefined, data);
+                    done();
+                });
+            });
+        });
+    });
+
+    it('putFeatures merges', function(done) {
+        var mem = source();
+        feature.putFeatures(mem, [{ _id: 1, _hash: 1, _text: 'a' }], function(err) {
+            assert.ifError(err);
+            // writes don't keep the shard loaded.
+            assert.equal(false, mem._geocoder.has('feature', 0));
+            var before = mem._shards.feature[0].length;
+            feature.putFeatures(mem, [{ _id: 2, _hash: 1, _text: 'b' }], function(err) {
+                assert.ifError(err);
+                assert.ok(mem._shards.feature[0].length > before);
+                // a fresh cache reading the stored shard sees the merged feature.
+                mem._geocoder = new Cache('a', 0);
+                feature.getFeature(mem, 1, function(err, data) {
+                    assert.ifError(err);
+                    assert.deepEqual({
+                        1: { _id: 1, _text: 'a' },
+                        2: { _id: 2, _text: 'b' }
+                    }, data);
+                    done();
+                });
+            });
+        });
+    });
+
+    it('putFeatures rewrites replaced features', function(done) {
+        var mem = source();
+        var sizes = [];
+        var i = 0;
+        (function put() {
+            if (i === 50) return check();
+            var doc = { _id: 1, _hash: 1, _text: 'a', version: i++ };
+            feature.putFeatures(mem, [doc], function(err) {
+                assert.ifError(err);
+                sizes.push(mem._shards.feature[0].length);
+                put();
+            });
+        })();
+        function check() {
+            // the shard only ever holds one version of the feature.
+            sizes.forEach(function(size) {
+                assert.ok(size <= sizes[0] + 1, size + ' > ' + sizes[0]);
+            });
+            mem._geocoder = new Cache('a', 0);
+            feature.getFeature(mem, 1, function(err, data) {
+                assert.ifError(err);
+                assert.deepEqual({ 1: { _id: 1, _text: 'a', version: 49 } }, data);
+                done();
+            });
+        }
+    });
+
+    it('putFeatures skips fetching a loaded shard', function(done) {
+        var mem = source();
+        var fetches = 0;
+        var get = mem.getGeocoderData;
+        mem.getGeocoderData = function(type, shard, callback) {
+            if (type === 'feature') fetches++;
+            return get.apply(this, arguments);
+        };
+        feature.putFeatures(mem, [{ _id: 1, _hash: 1, _text: 'a' }], function(err) {
+            assert.ifError(err);
+            feature.getFeature(mem, 1, function(err, data) {
+                assert.ifError(err);
+                assert.equal(2, fetches);
+                feature.putFeatures(mem, [{ _id: 1, _hash: 1, _text: 'b' }], function(err) {
+                    assert.ifError(err);
+                    assert.equal(2, fetches);
+                    // the shard read by getFeature stays loaded.
+                    assert.equal(true, mem._geocoder.has('feature', 0));
+                    feature.getFeature(mem, 1, function(err, data) {
+                        assert.ifError(err);
+                        assert.equal(2, fetches);
+                        assert.deepEqual({ 1: { _id: 1, _text: 'b' } }, data);
+                        done();
+                    });
+                });
+            });
+        });
+    });
+
+    it('getFeature reuses decoded features', function(done) {
+        var mem = source();
+        feature.putFeatures(mem, [{ _id: 1, _hash: 1, _text: 'a', _center: [0, 0] }], function(err) {
+            assert.ifError(err);
+            feature.getFeature(mem, 1, function(err, a) {
+                assert.ifError(err);
+                a[1]._text = 'b';
+                feature.getFeature(mem, 1, function(err, b) {
+                    assert.ifError(err);
+                    // each lookup gets its own copy of the feature.
+                    assert.equal('a', b[1]._text);
+                    assert.strictEqual(a[1]._center, b[1]._center);
+                    done();
+                });
+            });
+        });
+    });
+
+    it('getFeature keeps at most `limit` shards', function(done) {
+        var mem = source();
+        var limit = feature.limit;
+        feature.limit = 2;
+        // hashes 1, 65 and 129 are in shards 0, 1 and 2.
+        var docs = [
+            { _id: 1, _hash: 1, _text: 'a' },
+            { _id: 65, _hash: 65, _text: 'b' },
+            { _id: 129, _hash: 129, _text: 'c' }
+        ];
+        feature.putFeatures(mem, docs, function(err) {
+            assert.ifError(err);
+            feature.getFeature(mem, 1, function(err) {
+                assert.ifError(err);
+                feature.getFeature(mem, 65, function(err) {
+                    assert.ifError(err);
+                    feature.getFeature(mem, 129, function(err, data) {
+                        assert.ifError(err);
+                        feature.limit = limit;
+                        assert.deepEqual({ 129: { _id: 129, _text: 'c' } }, data);
+                        assert.equal(false, mem._geocoder.has('feature', 0));
+                        assert.equal(true, mem._geocoder.has('feature', 1));
+                        assert.equal(true, mem._geocoder.has('feature', 2));
+                        done();
+                    });
+                });
+            });
+        });
+    });
+
+    it('getFeature (legacy JSON shard)', function(done) {
+        var mem = source();
+        mem._shards.feature = { 0: JSON.stringify({ 1: JSON.stringify({ 1: { _id: 1, _text: 'a' } }) }) };
+        feature.getFeature(mem, 1, function(err, data) {
+            assert.ifError(err);
+            assert.deepEqual({ 1: { _id: 1, _text: 'a' } }, data);
+            feature.getAllFeatures(mem, function(err, docs) {
+                assert.ifError(err);
+                assert.deepEqual([{ _id: 1, _text: 'a' }], docs);
+                done();
+            });
+        });
+    });
+});
@@ -27,6 +27,34 @@ describe('geocode', function() {
             done();
         });
     });
+    it ('trace', function(done) {
+        var traced;
+        geocoder.geocode('georgia', { trace: function(trace) { traced = trace; } }, function(err, res) {
+            assert.ifError(err);
+            assert.equal('georgia', traced.query);
+            assert.ok(traced.ms > 0);
+            var stages = traced.stages.map(function(s) { return s.stage; });
+            ['search', 'degen', 'phrase', 'term', 'relevd', 'grid', 'coalesce', 'relev', 'total'].forEach(function(stage) {
+                assert.ok(stages.indexOf(stage) !== -1, stage);
+            });
+            done();
+        });
+    });
+    it ('metrics', function(done) {
+        geocoder.metrics(true);
+        geocoder.geocode('georgia', {}, function(err, res) {
+            assert.ifError(err);
+            var metrics = geocoder.metrics();
+            assert.equal(1, metrics.total.count);
+            // once per index
+            assert.equal(2, metrics.search.count);
+            assert.equal(1, metrics.relev.count);
+            assert.ok(metrics.total.max >= metrics.relev.max);
+            geocoder.metrics(true);
+            assert.equal(0, geocoder.metrics().total.count);
+            done();
+        });
+    });
     it ('noresults', function(done) {
         geocoder.geocode('asdfasdf', {}, function(err, res) {
             assert.ifError(err);
@@ -36,3 +64,125 @@ describe('geocode', function() {
         });
     });
 });
+
+describe('geocode (snapshots)', function() {
+    var Cache = require('../lib/util/cxxcache');
+    var geocoder = new Carmen({
+        country: Carmen.auto(__dirname + '/fixtures/01-ne.country.s3'),
+        province: Carmen.auto(__dirname + '/fixtures/02-ne.province.s3')
+    });
+    before(function(done) {
+        geocoder._open(done);
+    });
+    // Needs node's --expose-gc, see the test script in package.json.
+    it('are collected after geocodes', function(done) {
+        if (typeof gc !== 'function') return done();
+        var remaining = 50;
+        (function next() {
+            if (!remaining--) return check();
+            geocoder.geocode('georgia', {}, function(err) {
+                assert.ifError(err);
+                setImmediate(next);
+            });
+        })();
+        function check() {
+            gc(); gc();
+            // one snapshot per index per geocode would be 100
+            assert.ok(Cache._snapshots() < 4, Cache._snapshots() + ' snapshots left');
+            done();
+        }
+    });
+});
+
+describe('geocode (concurrency)', function() {
+    var Cache = require('../lib/util/cxxcache');
+    it('is a module level setting', function() {
+        var concurrency = Carmen.concurrency;
+        assert.equal(Cache.concurrency, concurrency);
+        new Carmen({}, { concurrency: 1 });
+        assert.equal(concurrency, Carmen.concurrency);
+        Carmen.concurrency = 3;
+        assert.equal(3, Cache.concurrency);
+        Carmen.concurrency = concurrency;
+    });
+});
+
+describe('geocode (querycache)', function() {
+    var index = require('../lib/index');
+    var geocoder = new Carmen({
+        country: Carmen.auto(__dirname + '/fixtures/01-ne.country.s3'),
+        province: Carmen.auto(__dirname + '/fixtures/02-ne.province.s3')
+    }, { querycache: { size: 1024 * 1024 } });
+    var forward = require(__dirname + '/fixtures/geocode-forward.json');
+
+    // Writes go through a wrapper so the fixture is left untouched, the
+    // generation lives on the cache the wrapper shares with the index.
+    function writer() {
+        var source = Object.create(geocoder.indexes.country);
+        source.putGeocoderData = function(type, shard, data, callback) { callback(); };
+        return source;
+    }
+
+    function geocode(callback) {
+        geocoder.geocode('georgia', { stats: true }, function(err, res) {
+            assert.ifError(err);
+            var cache = res.stats.cache;
+            delete res.stats;
+            assert.deepEqual(forward, res);
+            callback(cache);
+        });
+    }
+
+    before(function(done) {
+        geocoder._open(done);
+    });
+    it('serves a repeated query from the cache', function(done) {
+        geocode(function(first) {
+            assert.equal(0, first.hits);
+            assert.equal(1, first.misses);
+            geocode(function(second) {
+                assert.equal(1, second.hits);
+                assert.equal(1, second.misses);
+                done();
+            });
+        });
+    });
+    it('does not serve results from before update()', function(done) {
+        index.update(writer(), [], function(err) {
+            assert.ifError(err);
+            geocode(function(stats) {
+                assert.equal(1, stats.hits);
+                assert.equal(2, stats.misses);
+                geocode(function(stats) {
+                    assert.equal(2, stats.hits);
+                    done();
+                });
+            });
+        });
+    });
+    it('does not serve results from before store()', function(done) {
+        index.store(writer(), function(err) {
+            assert.ifError(err);
+            geocode(function(stats) {
+                assert.equal(2, stats.hits);
+                assert.equal(3, stats.misses);
+                done();
+            });
+        });
+    });
+    it('does not serve results from before a reload or unload', function(done) {
+        var cache = geocoder.indexes.country._geocoder;
+        var shard = +cache.list('term')[0];
+        cache.loadSync(cache.pack('term', shard), 'term', shard);
+        geocode(function(stats) {
+            assert.equal(2, stats.hits);
+            assert.equal(4, stats.misses);
+            cache.unload('term', shard);
+            geocode(function(stats) {
+                assert.equal(2, stats.hits);
+                assert.equal(5, stats.misses);
+                done();
+            });
+        });
+    });
+});
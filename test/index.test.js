@@ -50,10 +50,199 @@ describe('index', function() {
                     phrase: { '0': '' },
                     grid: { '0': '' },
                     degen: { '0': '' },
-                    feature: { '0': '{}', '1':'{}', '2':'{}', '3':'{}' }
+                    feature: { '0': '', '1':'', '2':'', '3':'' }
                 }, to.serialize().shards);
                 done();
             });
         });
     });
 });
+
+describe('index (native)', function() {
+    var index = require('../lib/index');
+    var Indexer = require('../lib/util/indexer');
+    var Cache = require('../lib/util/cxxcache');
+    var docs = require('./fixtures/docs.json');
+
+    it('matches loadDoc and generateFrequency', function(done) {
+        var to = new mem(null, function() {});
+        to._geocoder = new Cache('to', 0);
+        to._geocoder._indexer = new Indexer(3);
+        index.update(to, JSON.parse(JSON.stringify(docs)), function(err) {
+            assert.ifError(err);
+            var reference = JSON.parse(JSON.stringify(docs));
+            var freq = index.generateFrequency(reference);
+            var patch = { grid: {}, term: {}, phrase: {}, degen: {} };
+            var known = { term: {} };
+            for (var i = 0; i < reference.length; i++) index.loadDoc(reference[i], freq, patch, known);
+
+            var cache = to._geocoder;
+            assert.equal(Object.keys(freq).length, cache.list('freq', 0).length);
+            for (var id in freq) assert.deepEqual(freq[id], cache.get('freq', id), 'freq ' + id);
+            for (var type in patch) {
+                assert.equal(Object.keys(patch[type]).length, cache.list(type, 0).length, type);
+                for (id in patch[type]) assert.deepEqual(patch[type][id], cache.get(type, id), type + ' ' + id);
+            }
+            done();
+        });
+    });
+
+    it('queues overlapping updates', function(done) {
+        function source() {
+            var to = new mem(null, function() {});
+            to._geocoder = new Cache('to', 0);
+            to._geocoder._indexer = new Indexer(3);
+            return to;
+        }
+        var batches = [docs.slice(0, 100), docs.slice(100)].map(function(batch) {
+            return JSON.stringify(batch);
+        });
+
+        var serial = source();
+        index.update(serial, JSON.parse(batches[0]), function(err) {
+            assert.ifError(err);
+            index.update(serial, JSON.parse(batches[1]), function(err) {
+                assert.ifError(err);
+                var overlapping = source();
+                var pending = 2;
+                index.update(overlapping, JSON.parse(batches[0]), updated);
+                index.update(overlapping, JSON.parse(batches[1]), updated);
+                function updated(err) {
+                    assert.ifError(err);
+                    if (--pending) return;
+                    ['freq','term','phrase','grid','degen'].forEach(function(type) {
+                        var ids = serial._geocoder.list(type, 0);
+                        assert.deepEqual(ids.sort(), overlapping._geocoder.list(type, 0).sort(), type);
+                        ids.forEach(function(id) {
+                            assert.deepEqual(serial._geocoder.get(type, id), overlapping._geocoder.get(type, id), type + ' ' + id);
+                        });
+                    });
+                    done();
+                }
+            });
+        });
+    });
+
+    it('shards postings by the cache shardlevel', function(done) {
+        var to = new mem(null, function() {});
+        to._geocoder = new Cache('to', 0);
+        to._geocoder._indexer = new Indexer(3);
+        // as index() does with options.shardlevel
+        to._geocoder.shardlevel = 1;
+        index.update(to, JSON.parse(JSON.stringify(docs)), function(err) {
+            assert.ifError(err);
+            var reference = JSON.parse(JSON.stringify(docs));
+            var freq = index.generateFrequency(reference);
+            var patch = { grid: {}, term: {}, phrase: {}, degen: {} };
+            var known = { term: {} };
+            for (var i = 0; i < reference.length; i++) index.loadDoc(reference[i], freq, patch, known);
+
+            var cache = to._geocoder;
+            assert.equal(1, cache.shardlevel);
+            assert.ok(cache.list('term').length > 1);
+            for (var type in patch) {
+                for (var id in patch[type]) assert.deepEqual(patch[type][id], cache.get(type, id), type + ' ' + id);
+            }
+            done();
+        });
+    });
+});
+
+describe('index (spill)', function() {
+    var index = require('../lib/index');
+    var Indexer = require('../lib/util/indexer');
+    var Cache = require('../lib/util/cxxcache');
+    var docs = require('./fixtures/docs.json');
+    var os = require('os');
+
+    it('indexes a document', function(done) {
+        var from = new mem(null, function() {});
+        var to = new mem(null, function() {});
+        var carmen = new Carmen({ from: from, to: to });
+        carmen.index(from, to, { spill: { memory: 1 } }, function(err) {
+            assert.ifError(err);
+            assert.deepEqual(to.serialize(), memFixture);
+            done();
+        });
+    });
+
+    it('merges runs of several batches', function(done) {
+        var spilled = build(new Indexer(2, { dir: os.tmpdir(), memory: 1 }));
+        var resident = build(new Indexer(2));
+        spilled(function(err, a) {
+            assert.ifError(err);
+            resident(function(err, b) {
+                assert.ifError(err);
+                ['freq','term','phrase','grid','degen'].forEach(function(type) {
+                    assert.deepEqual(a._shards[type], b._shards[type], type);
+                });
+                done();
+            });
+        });
+    });
+
+    it('spills batches that outgrow memory', function(done) {
+        // A batch holds more than 16KB of postings once their values are
+        // counted, so runs are written before store().
+        var indexer = new Indexer(2, { dir: os.tmpdir(), memory: 16 * 1024 });
+        var spilled = build(indexer, function() {
+            assert.ok(indexer.runs() > 0, 'runs: ' + indexer.runs());
+        });
+        var resident = build(new Indexer(2));
+        spilled(function(err, a) {
+            assert.ifError(err);
+            resident(function(err, b) {
+                assert.ifError(err);
+                ['freq','term','phrase','grid','degen'].forEach(function(type) {
+                    assert.deepEqual(a._shards[type], b._shards[type], type);
+                });
+                done();
+            });
+        });
+    });
+
+    it('keeps batches in memory below the limit', function(done) {
+        var indexer = new Indexer(2, { dir: os.tmpdir(), memory: 256 * 1024 * 1024 });
+        build(indexer, function() {
+            assert.equal(0, indexer.runs());
+        })(function(err) {
+            assert.ifError(err);
+            done();
+        });
+    });
+
+    it('does not keep freq or feature shards loaded', function(done) {
+        var indexer = new Indexer(2, { dir: os.tmpdir(), memory: 1 });
+        build(indexer, function(to) {
+            assert.deepEqual([], to._geocoder.list('freq'));
+            assert.deepEqual([], to._geocoder.list('feature'));
+            assert.ok(Object.keys(to._shards.freq).length > 0);
+        })(function(err) {
+            assert.ifError(err);
+            done();
+        });
+    });
+
+    // Indexes three batches of docs, calling `updated(source)` before
+    // store().
+    function build(indexer, updated) {
+        return function(callback) {
+            var to = new mem(null, function() {});
+            to._geocoder = new Cache('to', 0);
+            to._geocoder._indexer = indexer;
+            var batches = [docs.slice(0, 50), docs.slice(50, 120), docs.slice(120)];
+            (function next(i) {
+                if (i === batches.length) {
+                    if (updated) updated(to);
+                    return index.store(to, function(err) {
+                        callback(err, to);
+                    });
+                }
+                index.update(to, JSON.parse(JSON.stringify(batches[i])), function(err) {
+                    if (err) return callback(err);
+                    next(i + 1);
+                });
+            })(0);
+        };
+    }
+});
@@ -0,0 +1,60 @@
+var assert = require('assert');
+var Metrics = require('../lib/util/metrics');
+
+describe('Metrics', function() {
+    it('#record/#stats', function() {
+        var metrics = new Metrics(['a', 'b']);
+        assert.deepEqual({ a: { count: 0 }, b: { count: 0 } }, metrics.stats());
+        // 1..1000 ms
+        for (var i = 1; i <= 1000; i++) metrics.record(0, i * 1e6);
+        var a = metrics.stats().a;
+        assert.equal(1000, a.count);
+        assert.equal(500.5, a.mean);
+        assert.equal(1, a.min);
+        assert.equal(1000, a.max);
+        // percentiles are within 1/16 of the recorded values.
+        [['p50', 500], ['p90', 900], ['p99', 990], ['p999', 999]].forEach(function(p) {
+            assert.ok(Math.abs(a[p[0]] - p[1]) <= p[1] / 16, p[0] + ' ' + a[p[0]]);
+        });
+        assert.equal(0, metrics.stats().b.count);
+    });
+
+    it('#record small values', function() {
+        var metrics = new Metrics(['a']);
+        metrics.record(0, 0);
+        metrics.record(0, 3);
+        var a = metrics.stats().a;
+        assert.equal(2, a.count);
+        assert.equal(0, a.min);
+        assert.equal(3e-6, a.max);
+    });
+
+    it('#record unknown stage', function() {
+        var metrics = new Metrics(['a']);
+        assert.throws(function() { metrics.record(1, 10); }, /unknown stage/);
+    });
+
+    it('#reset', function() {
+        var metrics = new Metrics(['a']);
+        metrics.record(0, 1e6);
+        metrics.reset();
+        assert.deepEqual({ a: { count: 0 } }, metrics.stats());
+        metrics.record(0, 2e6);
+        assert.equal(2, metrics.stats().a.min);
+    });
+
+    it('Recorder', function() {
+        var metrics = new Metrics(Metrics.stages);
+        var recorder = new Metrics.Recorder(metrics, true);
+        var ms = recorder.time('grid', process.hrtime(), 'country');
+        assert.ok(ms >= 0);
+        recorder.add('decode', 1.5, 'country');
+        assert.deepEqual([
+            { stage: 'grid', source: 'country', ms: ms },
+            { stage: 'decode', source: 'country', ms: 1.5 }
+        ], recorder.trace);
+        assert.equal(1, metrics.stats().grid.count);
+        // added stages are only traced.
+        assert.equal(0, metrics.stats().decode.count);
+    });
+});
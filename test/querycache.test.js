@@ -0,0 +1,65 @@
+var assert = require('assert');
+var QueryCache = require('../lib/util/querycache');
+
+describe('QueryCache', function() {
+    it('#get/#set', function() {
+        var cache = new QueryCache(1024 * 1024, 4);
+        assert.equal(1024 * 1024, cache.maxsize);
+        assert.equal(4, cache.shards);
+        assert.equal(undefined, cache.get('a', 0));
+        cache.set('a', '{"features":[]}', 0);
+        assert.equal('{"features":[]}', cache.get('a', 0));
+        cache.set('a', '{"features":[1]}', 0);
+        assert.equal('{"features":[1]}', cache.get('a', 0));
+        assert.deepEqual({ hits:2, misses:1, ratio:2/3, evictions:0 }, {
+            hits: cache.stats().hits,
+            misses: cache.stats().misses,
+            ratio: cache.stats().ratio,
+            evictions: cache.stats().evictions
+        });
+        assert.equal(1, cache.stats().count);
+    });
+
+    it('generation', function() {
+        var cache = new QueryCache(1024 * 1024);
+        cache.set('a', 'result', 1);
+        assert.equal(undefined, cache.get('a', 2));
+        // stale entries are dropped on lookup.
+        assert.equal(undefined, cache.get('a', 1));
+        assert.equal(0, cache.stats().count);
+    });
+
+    it('evicts least recently used', function() {
+        // a single shard with room for two entries.
+        var cache = new QueryCache(600, 1);
+        var value = new Array(100).join('x');
+        cache.set('a', value, 0);
+        cache.set('b', value, 0);
+        assert.equal(value, cache.get('a', 0));
+        cache.set('c', value, 0);
+        assert.equal(value, cache.get('a', 0));
+        assert.equal(undefined, cache.get('b', 0));
+        assert.equal(value, cache.get('c', 0));
+        assert.equal(1, cache.stats().evictions);
+        // entries larger than a shard are not stored.
+        cache.set('d', new Array(1000).join('x'), 0);
+        assert.equal(undefined, cache.get('d', 0));
+        cache.clear();
+        assert.equal(0, cache.stats().count);
+        assert.equal(0, cache.stats().size);
+    });
+
+    it('.key', function() {
+        assert.equal(QueryCache.key(['a', 'b'], { limit:5 }), QueryCache.key(['a', 'b'], { limit:5, stats:false }));
+        assert.equal(QueryCache.key(['a', 'b'], { limit:5 }), QueryCache.key(['a', 'b'], { limit:5, stats:true }));
+        assert.notEqual(QueryCache.key(['a', 'b'], { limit:5 }), QueryCache.key(['a', 'b'], { limit:10 }));
+        assert.notEqual(QueryCache.key(['a', 'b'], { limit:5 }), QueryCache.key(['a b'], { limit:5 }));
+    });
+
+    it('.generation', function() {
+        var indexes = { a: { _geocoder: {} }, b: { _geocoder: { generation: 2 } } };
+        assert.equal(2, QueryCache.generation(indexes));
+        indexes.a._geocoder.generation = 1;
+        assert.equal(3, QueryCache.generation(indexes));
+    });
+});